@@ -11,8 +11,29 @@
  */
 
 #include "hid-nswitch.h"
+#include "nswitch-uapi.h"
+
+#include <linux/kthread.h>
+#include <uapi/linux/sched/types.h>
+
+static int thread_priority;
+module_param(thread_priority, int, 0644);
+MODULE_PARM_DESC(thread_priority, "SCHED_FIFO priority of new device threads (1-99), 0 for SCHED_NORMAL");
+
+static char *thread_cpus;
+module_param(thread_cpus, charp, 0644);
+MODULE_PARM_DESC(thread_cpus, "CPU list new device threads may run on, all if unset");
+
+static bool rumble_handshake = true;
+module_param(rumble_handshake, bool, 0644);
+MODULE_PARM_DESC(rumble_handshake, "Rumble when a device is ready and on personality selection steps");
 
 DEFINE_SPINLOCK(global_lock);
+/*
+  Command, stream and IR acknowledgement workers, which block in
+  command exchanges for up to a second, off the system workqueue
+ */
+struct workqueue_struct *nswitch_wq;
 __u8 allocated_players[8];
 LIST_HEAD(ljoycons);
 LIST_HEAD(rjoycons);
@@ -25,6 +46,8 @@ void simplejc_prepare(nswitch_dev *ndev);
 void handshake_rumble(nswitch_dev *ndev) {
 	nswitch_dev_input_report res;
 
+	if (!READ_ONCE(rumble_handshake))
+		return;
 	res = ns_exchange(ndev, &(output_command) {
 			RUMBLE_REPORT, 0, 0, {
 				0xc2, 0xc8, 0x03, 0x72,
@@ -79,18 +102,26 @@ static ssize_t nswitch_dev_show(struct device *dev,
 }
 
 /*
-  Requires cmd_lock
+  Requires cmd_lock, and exchange_lock for BASIC commands.
+  Only queues the report for the transmit worker, never blocks.
  */
-/* TODO: rewrite the mecanism to work from any thread */
 int nd_send_cmd(nswitch_dev *ndev, output_command *oc) {
-	oc->gpn = ++ndev->cmdcounter;
+	int ret;
+
+	if (ndev->deinit)
+		return -ENODEV;
+	ns_cmd_prepare(oc, ++ndev->cmdcounter);
 	if (oc->report == BASIC) {
 		ndev->reply = oc->subcommand;
 		hid_info(ndev->hdev, "Sending command %02x", oc->subcommand);
 		reinit_completion(&ndev->cmd_pending);
 	}
-	hid_hw_output_report(ndev->hdev, (void*)oc, sizeof(*oc));
-	return 1;
+	ret = tx_queue(ndev, oc);
+	if (ret) {
+		hid_warn(ndev->hdev, "Output queue full, dropping command %02x", oc->subcommand);
+		ndev->reply = 0;
+	}
+	return ret;
 }
 
 /* Worker Thread */
@@ -103,224 +134,214 @@ int nd_wait(nswitch_dev *jdev, struct completion *smth) {
 	return ret;
 }
 
+/*
+  Sends oc and, for BASIC commands, returns its reply.
+  The init sequence, the device thread and the workers may all be
+  exchanging: exchange_lock is held from the send to the copy of the
+  reply, so that only one reply is expected at a time.
+  Other reports are only queued, an empty reply is returned.
+  Should only be called from a worker thread
+ */
 /* Worker Thread */
-int nd_wait_reply(nswitch_dev *jdev) {
-	if (!jdev->reply) {
-		hid_err(jdev->hdev, "No reply awaiting\n");
-		return 0;
-	}
-	return nd_wait(jdev, &jdev->cmd_pending);
-}
+nswitch_dev_input_report ns_exchange(nswitch_dev *ndev,
+									 output_command *oc) {
+	unsigned long flags;
+	nswitch_dev_input_report ret = {0};
+	__u64 start = timing_start();
+	long r;
 
-/* Worker Thread */
-static void init_calibration_data(nswitch_dev *ndev) {
-	nswitch_dev_input_report res;
-	left_stick_calibration_data *lscd;
-	right_stick_calibration_data *rscd;
-	sax_calibration_data *scd;
-	spi_read_reply *srr;
-	__u32 *coeff;
-
-	/* TODO: Refactor */
-	srr = (void*)&res.full.reply.data;
-	res = ns_exchange(ndev, &(output_command) {
-			BASIC, 0, 0, {}, SPI_FLASH_READ, {
-				.spi_read = USER_CALIBRATION_LEFT_STICK
-			}
-	});
+	if (oc->report != BASIC) {
+		spin_lock_irqsave(&ndev->cmd_lock, flags);
+		nd_send_cmd(ndev, oc);
+		spin_unlock_irqrestore(&ndev->cmd_lock, flags);
+		goto end;
+	}
 
-	if (srr->data[0] != 0xB2 || srr->data[1] != 0xA1) {
-		hid_info(ndev->hdev, "No LS user config, loading factory settings...");
-		res = ns_exchange(ndev, &(output_command) {
-				BASIC, 0, 0, {}, SPI_FLASH_READ, {
-					.spi_read = FACTORY_CALIBRATION_LEFT_STICK
-				}
-			});
-		lscd = (void*)srr->data;
-	} else
-		lscd = (void*)(srr->data + 2);
+	if (!mutex_trylock(&ndev->exchange_lock)) {
+		hid_dbg(ndev->hdev, "Command %02x pending, waiting for it to finish",
+				READ_ONCE(ndev->reply));
+		mutex_lock(&ndev->exchange_lock);
+	}
+	spin_lock_irqsave(&ndev->cmd_lock, flags);
+	r = nd_send_cmd(ndev, oc);
+	spin_unlock_irqrestore(&ndev->cmd_lock, flags);
+	if (r)
+		goto unlock;
 
-	ndev->calibration.left_stick = *lscd;
+	r = wait_for_completion_interruptible_timeout(&ndev->cmd_pending, HZ);
+	spin_lock_irqsave(&ndev->cmd_lock, flags);
+	if (ndev->reply) {
+		/* A late reply is dropped as unsollicited */
+		if (!ndev->deinit)
+			hid_err(ndev->hdev, "No reply to command %02x: %ld\n",
+					ndev->reply, r);
+		ndev->reply = 0;
+	} else {
+		ret.input_report = REPLY;
+		ret.full.reply = ndev->reply_data;
+	}
+	spin_unlock_irqrestore(&ndev->cmd_lock, flags);
+unlock:
+	mutex_unlock(&ndev->exchange_lock);
+end:
+	/* Not spent handling the report */
+	if (current == ndev->thread)
+		ndev->exchange_ns += timing_start() - start;
+	return ret;
+}
 
-	res = ns_exchange(ndev, &(output_command) {
-			BASIC, 0, 0, {}, SPI_FLASH_READ, {
-				.spi_read = USER_CALIBRATION_RIGHT_STICK
-			}
-	});
+/*
+  Safe from any context
+ */
+int nd_queue_cmd(nswitch_dev *ndev, nswitch_async_cmd *cmd) {
+	unsigned long flags;
 
-	if (srr->data[0] != 0xB2 || srr->data[1] != 0xA1) {
-		hid_info(ndev->hdev, "No RS user config, loading factory settings...");
-		res = ns_exchange(ndev, &(output_command) {
-				BASIC, 0, 0, {}, SPI_FLASH_READ, {
-					.spi_read = FACTORY_CALIBRATION_RIGHT_STICK
-				}
-			});
-		rscd = (void*)srr->data;
-	} else
-		rscd = (void*)(srr->data + 2);
-	ndev->calibration.right_stick = *rscd;
+	spin_lock_irqsave(&ndev->cmd_lock, flags);
+	if (ndev->deinit) {
+		spin_unlock_irqrestore(&ndev->cmd_lock, flags);
+		return -ENODEV;
+	}
+	list_add_tail(&cmd->list, &ndev->cmd_queue);
+	spin_unlock_irqrestore(&ndev->cmd_lock, flags);
+	queue_work(nswitch_wq, &ndev->cmd_worker);
+	return 0;
+}
 
-	res = ns_exchange(ndev, &(output_command) {
-			BASIC, 0, 0, {}, SPI_FLASH_READ, {
-				.spi_read = USER_CALIBRATION_6AXIS
-			}
-	});
+/* Worker Thread */
+static void nswitch_dev_cmd_worker(struct work_struct *work) {
+	nswitch_dev *ndev = container_of(work,
+									 nswitch_dev,
+									 cmd_worker);
+	nswitch_async_cmd *cmd;
+	nswitch_dev_input_report res = {0};
+	unsigned long flags;
+	int status;
 
-	if (srr->data[0] != 0xB2 || srr->data[1] != 0xA1) {
-		hid_info(ndev->hdev, "No 6AXIS user config, loading factory settings...");
-		res = ns_exchange(ndev, &(output_command) {
-				BASIC, 0, 0, {}, SPI_FLASH_READ, {
-					.spi_read = FACTORY_CALIBRATION_6AXIS
-				}
-			});
-		scd = (void*)srr->data;
-	} else
-		scd = (void*)(srr->data + 2);
-
-	ndev->calibration.sax = *scd;
-
-	coeff = ndev->calibration.gyro_coeff;
-	coeff[0] = 816 / (13371 - (scd->gyroscope_origin[0]));
-	coeff[1] = 816 / (13371 - (scd->gyroscope_origin[1]));
-	coeff[2] = 816 / (13371 - (scd->gyroscope_origin[2]));
+	for (;;) {
+		spin_lock_irqsave(&ndev->cmd_lock, flags);
+		cmd = list_first_entry_or_null(&ndev->cmd_queue,
+									   nswitch_async_cmd, list);
+		if (cmd)
+			list_del(&cmd->list);
+		spin_unlock_irqrestore(&ndev->cmd_lock, flags);
+		if (!cmd || ndev->deinit)
+			break;
+
+		res = ns_exchange(ndev, &cmd->oc);
+		status = 0;
+		if (cmd->oc.report == BASIC &&
+			res.full.reply.reply_to != cmd->oc.subcommand)
+			status = -EIO;
+		cmd->done(cmd, &res, status);
+	}
+	if (cmd)
+		cmd->done(cmd, &res, -ENODEV);
 }
 
 /* Event Handler */
-static void prepare_projoypad(nswitch_dev *ndev) {
-	calibration_data *lcd, *rcd;
-	unsigned int i;
-
-	lcd = &ndev->calibration;
-	rcd = &ndev->calibration;
-	ndev->siminput = input_allocate_device();
-	input_set_drvdata(ndev->siminput, ndev);
-
-	ndev->siminput->dev.parent = &ndev->hdev->dev;
-	ndev->siminput->id.bustype = ndev->hdev->bus;
-	ndev->siminput->id.vendor = ndev->hdev->vendor;
-	ndev->siminput->id.product = ndev->hdev->product;
-	ndev->siminput->id.version = ndev->hdev->version;
-	ndev->siminput->name = kasprintf(GFP_KERNEL, "%s Dual Joycon Controller" , ndev->hdev->name);
-
-	set_bit(EV_KEY, ndev->siminput->evbit);
-	for (i = 0; i < ARRAY_SIZE(ns_buttons); ++i)
-		set_bit(ns_buttons[i], ndev->siminput->keybit);
-
-	set_bit(EV_ABS, ndev->siminput->evbit);
-
-	set_bit(ABS_X, ndev->siminput->absbit);
-	set_bit(ABS_Y, ndev->siminput->absbit);
-	set_bit(ABS_RX, ndev->siminput->absbit);
-	set_bit(ABS_RY, ndev->siminput->absbit);
-
-	input_set_abs_params(ndev->siminput, ABS_X,
-						 lcd->left_stick.xcenter - lcd->left_stick.xmin_offset,
-						 lcd->left_stick.xcenter + lcd->left_stick.xmax_offset, 10, 0);
-	input_set_abs_params(ndev->siminput, ABS_Y,
-						 lcd->left_stick.ycenter - lcd->left_stick.ymin_offset,
-						 lcd->left_stick.ycenter + lcd->left_stick.ymax_offset, 10, 0);
-	input_set_abs_params(ndev->siminput, ABS_RX,
-						 rcd->right_stick.xcenter - rcd->right_stick.xmin_offset,
-						 rcd->right_stick.xcenter + rcd->right_stick.xmax_offset, 10, 0);
-	input_set_abs_params(ndev->siminput, ABS_RY,
-						 rcd->right_stick.ycenter - rcd->right_stick.ymin_offset,
-						 rcd->right_stick.ycenter + rcd->right_stick.ymax_offset, 10, 0);
-
-	//ndev->handler = report_dual_keys;
-
-	hid_info(ndev->hdev, "Handler set to report keys...");
-	input_register_device(ndev->siminput);
-	ns_exchange(ndev, &(output_command) {
-			BASIC, 0, 0, {}, SET_INPUT_REPORT_MODE, {
-				.mode = STANDARD
-	}});
-}
+static void nswitch_dev_flush_cmds(nswitch_dev *ndev) {
+	nswitch_async_cmd *cmd, *tmp;
+	nswitch_dev_input_report res = {0};
+	unsigned long flags;
+	LIST_HEAD(cmds);
 
-/* Event Handler */
-static void projc_prepare(nswitch_dev *ndev) {
-	if (ndev->ledcache >> 4 != 0xF) {
-		set_leds(ndev, 0xF0);
-	}
-	if (ndev->state.simple.right) {
-		/* TODO: Implement this */
-		hid_info(ndev->hdev, "ProJC validated");
-		prepare_projoypad(ndev);
-	} else if (ndev->state.simple.down) {
-		hid_info(ndev->hdev, "ProJC unvalidated");
-		ndev->handler = projc_prepare;
+	spin_lock_irqsave(&ndev->cmd_lock, flags);
+	list_splice_init(&ndev->cmd_queue, &cmds);
+	spin_unlock_irqrestore(&ndev->cmd_lock, flags);
+	list_for_each_entry_safe(cmd, tmp, &cmds, list) {
+		list_del(&cmd->list);
+		cmd->done(cmd, &res, -ENODEV);
 	}
 }
 
+static void init_home_led(nswitch_dev *ndev) {
+	/* TODO:  */
+}
+
 /*
-  Should only be called from a worker thread
+  Moves the oldest queued report to ndev->state, and its decoded frame
+  to ndev->frame.
+  Returns 0 when there is none.
  */
 /* Worker Thread */
-nswitch_dev_input_report ns_exchange(nswitch_dev *ndev,
-									 output_command *oc) {
+static int nswitch_event_pop(nswitch_dev *ndev) {
 	unsigned long flags;
-	nswitch_dev_input_report ret = {0};
-	int r;
-
-	spin_lock_irqsave(&ndev->cmd_lock, flags);
-	if (ndev->reply) {
-		hid_err(ndev->hdev, "Command %02x pending, waiting for it to finish", ndev->reply);
-		spin_unlock_irqrestore(&ndev->cmd_lock, flags);
-		r = wait_for_completion_interruptible_timeout(&ndev->cmd_pending, HZ);
-		spin_lock_irqsave(&ndev->cmd_lock, flags);
-		if (r <= 0 || ndev->reply) {
-			hid_err(ndev->hdev, "Something's gone horribly wrong %d %02x\n", r, ndev->reply);
-			goto end;
-		}
+	int ret = 0;
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	if (ndev->events_head != ndev->events_tail) {
+		ndev->state = ndev->events[ndev->events_tail % NSWITCH_EVENT_SLOTS];
+		ndev->frame = ndev->events_frame[ndev->events_tail % NSWITCH_EVENT_SLOTS];
+		ndev->state_time = ndev->events_time[ndev->events_tail++ % NSWITCH_EVENT_SLOTS];
+		ret = 1;
 	}
-	nd_send_cmd(ndev, oc);
-	spin_unlock_irqrestore(&ndev->cmd_lock, flags);
-	if (ndev->deinit) {
-		hid_err(ndev->hdev, "Device is deiniting\n");
-		goto end;
-	}
-	if(oc->report == BASIC) {
-		nd_wait_reply(ndev);
-		spin_lock_irqsave(&ndev->state_lock, flags);
-		memcpy(&ret, &ndev->state, sizeof(ret));
-		spin_unlock_irqrestore(&ndev->state_lock, flags);
-	}
-end:
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
 	return ret;
 }
 
+/*
+  Handles the report moved to ndev->state by nswitch_event_pop
+ */
 /* Worker Thread */
-static void init_rumble(nswitch_dev *ndev) {
-	ns_exchange(ndev, &(output_command) {
-			BASIC, 0, 0, {}, SET_VIBRATION, {
-				.vibrate = 1
-			}
-	});
+static void nswitch_handle_report(nswitch_dev *ndev) {
+	nd_filter_sticks(ndev);
+	nd_imu_update(ndev);
+	nswitch_mode_handlers[atomic_read_acquire(&ndev->mode)](ndev);
 }
 
-static void init_ir_cam(nswitch_dev *ndev) {
-	/* TODO:  */
+/*
+  Handles every queued report, command exchanges excluded from the
+  handler timing
+ */
+/* Worker Thread */
+static void nswitch_handle_events(nswitch_dev *ndev) {
+	__u64 start;
+
+	while (nswitch_event_pop(ndev)) {
+		ndev->exchange_ns = 0;
+		start = timing_start();
+		nswitch_handle_report(ndev);
+		timing_add(&ndev->handler_timing, start + ndev->exchange_ns);
+	}
 }
 
-static void init_home_led(nswitch_dev *ndev) {
-	/* TODO:  */
+/*
+  Takes the calibration read by the init sequence, as a whole for the
+  readers of each copy
+ */
+/* Worker Thread */
+static void nswitch_recalibrate(nswitch_dev *ndev) {
+	unsigned long flags;
+
+	mutex_lock(&pair_lock);
+	ndev->calibration = ndev->init_calibration;
+	mutex_unlock(&pair_lock);
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	ndev->state_calibration = ndev->init_calibration;
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+	update_stick_ranges(ndev);
+	nd_imu_reset(ndev);
 }
 
 /*
   Put the device in a simple state.
-  Get info on the device and initialize the needed devices in sysfs
+  Over USB, hand the joycon its HID protocol first.
+  Get info on the device, accept input with the default calibration
+  while the init sequence runs, then run the handler of its mode for
+  each report until the device goes away.
  */
 /* Worker Thread */
-void nswitch_dev_init_worker(struct work_struct *work)
+static int nswitch_dev_thread(void *data)
 {
-	nswitch_dev *ndev = container_of(work,
-									 nswitch_dev,
-									 init_worker);
+	nswitch_dev *ndev = data;
 	nswitch_dev_input_report res;
 	nswitch_devinfo *info = (void*)&res.full.reply.data;
 	unsigned long flags;
 	struct list_head *target;
 	nswitch_list *nl;
 
+	if (ndev->grip)
+		grip_handshake(ndev);
 	res = ns_exchange(ndev, &(output_command) {
 			BASIC, 0, 0, {}, DEVICE_INFO, {}
 	});
@@ -336,19 +357,11 @@ void nswitch_dev_init_worker(struct work_struct *work)
 	hid_info(ndev->hdev, "Allocated at: %p\n", ndev);
 	dump_mem(ndev->hdev, (void*)&ndev->info, sizeof(*info));
 
-	init_player_leds(ndev);
-	init_battery(ndev);
-	ndev->inited_hw = 1;
 	//init_keys(ndev);
 //init_axis(ndev);
-	init_rumble(ndev);
-	init_calibration_data(ndev);
-
 	// TODO:  exposes rom/ram/spi into char devices
 	//init_memory_map(ndev);
 
-	handshake_rumble(ndev);
-
 	switch(info->type) {
 	case RIGHT_JOYCON:
 		init_ir_cam(ndev);
@@ -357,28 +370,94 @@ void nswitch_dev_init_worker(struct work_struct *work)
 		init_home_led(ndev);
 		/* fallthrough */
 	case LEFT_JOYCON:
-		ndev->handler = ((update_fun_t[]){
-			&simplejc_prepare,
-			&simplejc_prepare,
-			&projc_prepare
-		})[info->type - LEFT_JOYCON];
 		break;
 	default:
 		hid_info(ndev->hdev, "Unknown device type %d\n", info->type);
-		return;
+		return 0;
 	}
 
 	nl = kzalloc(sizeof(*nl), GFP_KERNEL);
+	if (!nl)
+		return -ENOMEM;
 	INIT_LIST_HEAD(&nl->list);
 	nl->ndev = ndev;
 	target = select_list(info->type);
 	spin_lock_irqsave(&global_lock, flags);
-	list_add(target, &nl->list);
+	list_add(&nl->list, target);
 	spin_unlock_irqrestore(&global_lock, flags);
-	while (nd_wait(ndev, &ndev->state_pending) >= 0 && !ndev->deinit) {
+
+	if (init_sequence_start(ndev))
+		hid_warn(ndev->hdev, "cannot start the init sequence\n");
+
+	/* Only the latest report received during init matters */
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	if (ndev->events_head != ndev->events_tail)
+		ndev->events_tail = ndev->events_head - 1;
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+	nd_set_mode(ndev, NSWITCH_UNCONFIGURED, NSWITCH_SELECTING);
+	ndev->ready_ns = ktime_get_ns() - ndev->probe_ns;
+	if (ndev->grip)
+		grip_pair(ndev);
+
+	while (nd_wait(ndev, &ndev->state_pending) >= 0 &&
+		   !ndev->deinit && !kthread_should_stop()) {
 		reinit_completion(&ndev->state_pending);
-		ndev->handler(ndev);
+		timing_add(&ndev->dispatch_timing, READ_ONCE(ndev->state_ns));
+		if (unlikely(!ndev->first_event_ns))
+			ndev->first_event_ns = ktime_get_ns() - ndev->probe_ns;
+		if (test_and_clear_bit(0, &ndev->recalibrate))
+			nswitch_recalibrate(ndev);
+		nswitch_handle_events(ndev);
 	}
+
+	spin_lock_irqsave(&global_lock, flags);
+	list_del(&nl->list);
+	spin_unlock_irqrestore(&global_lock, flags);
+	kfree(nl);
+	return 0;
+}
+
+/*
+  Applies thread_priority and thread_cpus to a new device thread
+ */
+/* Event Handler */
+static void nswitch_dev_set_sched(nswitch_dev *ndev) {
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = SCHED_FIFO
+	};
+	cpumask_var_t mask;
+	int prio = READ_ONCE(thread_priority);
+	int ret;
+
+	if (prio > 0) {
+		attr.sched_priority = min(prio, MAX_RT_PRIO - 1);
+		ret = sched_setattr_nocheck(ndev->thread, &attr);
+		if (ret)
+			hid_warn(ndev->hdev, "cannot set thread priority: %d\n", ret);
+	}
+
+	if (!thread_cpus || !*thread_cpus || !zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return;
+	if (cpulist_parse(thread_cpus, mask) ||
+		set_cpus_allowed_ptr(ndev->thread, mask))
+		hid_warn(ndev->hdev, "invalid thread_cpus %s\n", thread_cpus);
+	free_cpumask_var(mask);
+}
+
+/* Event Handler */
+static int nswitch_dev_start(nswitch_dev *ndev) {
+	struct task_struct *t;
+
+	t = kthread_create(nswitch_dev_thread, ndev, "nswitch/%u", ndev->hdev->id);
+	if (IS_ERR(t))
+		return PTR_ERR(t);
+	/* The thread may exit on its own, keep it around for kthread_stop */
+	get_task_struct(t);
+	ndev->thread = t;
+	nswitch_dev_set_sched(ndev);
+	wake_up_process(t);
+	return 0;
 }
 
 static DEVICE_ATTR(devtype, S_IRUGO, nswitch_dev_show, NULL);
@@ -395,16 +474,34 @@ static nswitch_dev *nswitch_dev_create(struct hid_device *hdev,
 
 	memset(nsd, 0, sizeof(*nsd));
 	nsd->hdev = hdev;
+	nsd->probe_ns = ktime_get_ns();
+	ns_default_calibration(&nsd->calibration);
+	nsd->state_calibration = nsd->calibration;
 	hid_set_drvdata(hdev, nsd);
 
 	spin_lock_init(&nsd->state_lock);
 	spin_lock_init(&nsd->cmd_lock);
+	mutex_init(&nsd->exchange_lock);
 	init_completion(&nsd->cmd_pending);
 	init_completion(&nsd->state_pending);
-
-	INIT_WORK(&nsd->init_worker, nswitch_dev_init_worker);
-	//INIT_WORK(&nsd->cmd_worker, nswitch_dev_cmd_worker);
-	schedule_work(&nsd->init_worker);
+	INIT_LIST_HEAD(&nsd->cmd_queue);
+	INIT_LIST_HEAD(&nsd->poll_entry);
+
+	INIT_WORK(&nsd->cmd_worker, nswitch_dev_cmd_worker);
+	init_stream(nsd);
+	nsd->filter_params = (ns_filter_params) NS_FILTER_DEFAULTS;
+	ns_fusion_init(&nsd->fusion);
+	nsd->aim = (ns_aim_params) NS_AIM_DEFAULTS;
+	if (init_tx(nsd)) {
+		kfree(nsd);
+		return NULL;
+	}
+	if (hdev->product == USB_DEVICE_ID_NINTENDO_CHARGING_GRIP &&
+		init_grip(nsd)) {
+		deinit_tx(nsd);
+		kfree(nsd);
+		return NULL;
+	}
 	return nsd;
 }
 
@@ -447,14 +544,39 @@ static int nswitch_hid_probe(struct hid_device *hdev,
 		goto err_close;
 	}
 
+	ret = nswitch_dev_start(nsdev);
+	if (ret) {
+		hid_err(hdev, "cannot start device thread\n");
+		goto err_file;
+	}
+
+	ret = init_cdev(nsdev);
+	if (ret)
+		hid_warn(hdev, "cannot create character device\n");
+	init_trace(nsdev);
+	if (init_personalities(nsdev))
+		hid_warn(hdev, "cannot create personalities attribute\n");
+	if (init_remap(nsdev))
+		hid_warn(hdev, "cannot create remap attribute\n");
+	if (init_filter(nsdev))
+		hid_warn(hdev, "cannot create stick_filter attribute\n");
+	if (init_imu(nsdev))
+		hid_warn(hdev, "cannot create IMU attributes\n");
+
 	hid_info(hdev, "New device registered\n");
 	return 0;
 
+err_file:
+	device_remove_file(&hdev->dev, &dev_attr_devtype);
 err_close:
 	hid_hw_close(hdev);
 err_stop:
 	hid_hw_stop(hdev);
 err:
+	poll_cancel(nsdev);
+	if (nsdev->grip)
+		deinit_grip(nsdev);
+	deinit_tx(nsdev);
 	kfree(nsdev);
 	return ret;
 }
@@ -476,74 +598,225 @@ void dump_mem(struct hid_device *hdev, __u8 *s, int size) {
 	}
 }
 
+/*
+  Reports with the same buttons only differ by their sticks and IMU samples
+ */
+static int nswitch_same_buttons(const nswitch_dev_input_report *a,
+								const nswitch_dev_input_report *b) {
+	if (a->input_report != b->input_report)
+		return 0;
+	switch (a->input_report) {
+	case SIMPLE:
+		/* Buttons and stick direction */
+		return !memcmp(&a->simple, &b->simple, 3);
+	default:
+		return !memcmp(&a->full.buttons, &b->full.buttons,
+					   sizeof(a->full.buttons));
+	}
+}
+
+/*
+  Sample time of a report, reconstructed from the device timer.
+  SIMPLE reports have no timer, they get their arrival time.
+ */
 /* Event Handler */
-static int nswitch_hid_event(struct hid_device *hdev,
-							 struct hid_report *report,
-							 u8 *raw_data,
-							 int size) {
-	nswitch_dev *nsdev = hid_get_drvdata(hdev);
-	nswitch_dev_input_report *rep;
+static __u64 nswitch_sample_time(nswitch_dev *ndev,
+								 const nswitch_dev_input_report *rep,
+								 int size) {
+	__u64 now = ktime_get_ns();
 	unsigned long flags;
 
+	if (size < 2)
+		return now;
+	switch (rep->input_report) {
+	case REPLY:
+	case STANDARD:
+	case STD_NFCIR:
+	case STD_UNKNOWN0:
+	case STD_UNKNOWN1:
+		break;
+	default:
+		return now;
+	}
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	now = ns_clock_update(&ndev->clock, rep->full.timer, now);
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+	return now;
+}
+
+/*
+  Sample time of one of the 3 IMU samples of the report being handled,
+  oldest first
+ */
+/* Worker Thread */
+__u64 nd_imu_time(nswitch_dev *ndev, int sample) {
+	unsigned long flags;
+	__u64 ts;
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	ts = ns_clock_imu_time(&ndev->clock, ndev->state_time, sample);
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+	return ts;
+}
+
+/*
+  Queues a report for the device thread.
+  A report with the same buttons as the previous queued one replaces
+  it, so only stick and IMU updates are coalesced, never button changes.
+  When the queue is full, the newest report is replaced, losing its
+  button changes but keeping the latest state.
+ */
+/* Event Handler */
+static void nswitch_event_push(nswitch_dev *ndev, const __u8 *raw, int size,
+							   const ns_frame *f, __u64 sample_time) {
+	nswitch_dev_input_report *last;
+	unsigned long flags;
+	unsigned int queued, slot;
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	queued = ndev->events_head - ndev->events_tail;
+	slot = (ndev->events_head - 1) % NSWITCH_EVENT_SLOTS;
+	last = &ndev->events[slot];
+	if (queued && nswitch_same_buttons(last, (const void*)raw)) {
+		++ndev->events_coalesced;
+	} else if (queued == NSWITCH_EVENT_SLOTS) {
+		++ndev->events_overruns;
+	} else {
+		slot = ndev->events_head++ % NSWITCH_EVENT_SLOTS;
+		last = &ndev->events[slot];
+	}
+	memset(last, 0, sizeof(*last));
+	memcpy(last, raw, size);
+	ndev->events_frame[slot] = *f;
+	ndev->events_time[slot] = sample_time;
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+}
+
+void nswitch_timing_add(nswitch_timing *t, __u64 start_ns) {
+	__u64 d = ktime_get_ns() - start_ns;
+
+	WRITE_ONCE(t->count, t->count + 1);
+	WRITE_ONCE(t->total_ns, t->total_ns + d);
+	if (d > t->max_ns)
+		WRITE_ONCE(t->max_ns, d);
+}
+
+/* Event Handler */
+static int nswitch_hid_decode(nswitch_dev *nsdev,
+							  u8 *raw_data,
+							  int size) {
+	struct hid_device *hdev = nsdev->hdev;
+	nswitch_dev_input_report *rep;
+	unsigned long flags;
+	__u64 sample_time;
+	__u8 expected;
+	ns_frame f;
+
+	trace_report(nsdev, NSWITCH_TRACE_IN, raw_data, size);
+	if (size > NFC_IR_MCU_OFFSET && raw_data[0] == STD_NFCIR) {
+		if (size >= NFC_IR_MCU_OFFSET + (int)sizeof(ir_mcu_fragment))
+			ircam_handle_fragment(nsdev, (void*)(raw_data + NFC_IR_MCU_OFFSET));
+		size = sizeof(*rep);
+	}
+	/* Padded to the USB packet size */
+	if (nsdev->grip && (unsigned)size > sizeof(*rep))
+		size = sizeof(*rep);
 	if ((unsigned)size > sizeof(*rep)) {
 		hid_warn(hdev, "Input report too big");
 		return 1;
 	}
+	if (raw_data[0] == USB_REPLY) {
+		grip_handle_reply(nsdev, raw_data, size);
+		return 0;
+	}
+	cdev_push_report(nsdev, raw_data, size);
 	rep = (void*) raw_data;
-	spin_lock_irqsave(&nsdev->state_lock, flags);
-	nsdev->state.input_report = rep->input_report;
-	spin_unlock_irqrestore(&nsdev->state_lock, flags);
+	sample_time = nswitch_sample_time(nsdev, rep, size);
+	/* The only decoding of the report, for all its consumers */
+	if (ns_decode_report(raw_data, size, &f))
+		cdev_update_state(nsdev, &f, sample_time);
 
 	switch (rep->input_report) {
 	case REPLY:
 		dump_mem(hdev, raw_data, size);
-		if (nsdev->reply != rep->full.reply.reply_to) {
+		spin_lock_irqsave(&nsdev->cmd_lock, flags);
+		expected = nsdev->reply;
+		if (expected != rep->full.reply.reply_to) {
+			spin_unlock_irqrestore(&nsdev->cmd_lock, flags);
 			hid_warn(nsdev->hdev, "Got a reply for an unsollicited command");
-			hid_warn(nsdev->hdev, "Expected %02x, got %02x", nsdev->reply, rep->full.reply.reply_to);
+			hid_warn(nsdev->hdev, "Expected %02x, got %02x", expected, rep->full.reply.reply_to);
 			return 1;
-		} else {
-			hid_info(nsdev->hdev, "Reply %02x received on event handler\n", nsdev->reply);
 		}
-		spin_lock_irqsave(&nsdev->cmd_lock, flags);
-		nsdev->reply = 0;
-		spin_unlock_irqrestore(&nsdev->cmd_lock, flags);
-
-		spin_lock_irqsave(&nsdev->state_lock, flags);
+		/* Stored before the exchange sees reply cleared */
 		nsdev->reply_data = rep->full.reply;
-		spin_unlock_irqrestore(&nsdev->state_lock, flags);
+		nsdev->reply = 0;
 		complete_all(&nsdev->cmd_pending);
-/* fall through */
+		spin_unlock_irqrestore(&nsdev->cmd_lock, flags);
+		hid_info(nsdev->hdev, "Reply %02x received on event handler\n", expected);
+		/* Only for the exchange, the next report has the same state */
+		return 0;
 	case STANDARD:
 	case STD_NFCIR:
 	case STD_UNKNOWN0:
 	case STD_UNKNOWN1:
-		spin_lock_irqsave(&nsdev->state_lock, flags);
-		nsdev->state.full = rep->full;
-		spin_unlock_irqrestore(&nsdev->state_lock, flags);
-		break;
 	case SIMPLE:
-		spin_lock_irqsave(&nsdev->state_lock, flags);
-		nsdev->state.simple = rep->simple;
-		spin_unlock_irqrestore(&nsdev->state_lock, flags);
+		nswitch_event_push(nsdev, raw_data, size, &f, sample_time);
 		break;
 	default:
 		hid_warn(hdev, "Unhandled input report type %02x", rep->input_report);
+		return 1;
 	}
 
-	complete_all(&nsdev->state_pending);
+	WRITE_ONCE(nsdev->state_ns, timing_start());
+	poll_report(nsdev);
 	return 0;
 }
 
+/* Event Handler */
+static int nswitch_hid_event(struct hid_device *hdev,
+							 struct hid_report *report,
+							 u8 *raw_data,
+							 int size) {
+	nswitch_dev *nsdev = hid_get_drvdata(hdev);
+	__u64 start = timing_start();
+	int ret;
+
+	ret = nswitch_hid_decode(nsdev, raw_data, size);
+	timing_add(&nsdev->event_timing, start);
+	return ret;
+}
+
+#ifdef CONFIG_NSWITCH_KUNIT_TEST
+/*
+  For nswitch-kunit.c: raw goes through raw_event, then the reports it
+  queued are handled as by the device thread
+ */
+int nd_kunit_feed(nswitch_dev *ndev, u8 *raw_data, int size) {
+	int ret;
+
+	ret = nswitch_hid_event(ndev->hdev, NULL, raw_data, size);
+	nswitch_handle_events(ndev);
+	return ret;
+}
+#endif
+
 /* Event Handler */
 static void nswitch_hid_remove(struct hid_device *hdev) {
+	unsigned long flags;
 	int i;
 	nswitch_dev *ndev = hid_get_drvdata(hdev);
 
+	spin_lock_irqsave(&ndev->cmd_lock, flags);
 	ndev->deinit = 1;
+	spin_unlock_irqrestore(&ndev->cmd_lock, flags);
 	complete_all(&ndev->state_pending);
+	complete_all(&ndev->cmd_pending);
 	hid_info(hdev, "remove requested");
-	cancel_work_sync(&ndev->init_worker);
-	//cancel_work_sync(&ndev->cmd_worker);
+	kthread_stop(ndev->thread);
+	put_task_struct(ndev->thread);
+	cancel_work_sync(&ndev->cmd_worker);
+	nswitch_dev_flush_cmds(ndev);
 
 	if (ndev->inited_hw) {
 		for (i = 0; i < 4; ++i)
@@ -551,30 +824,42 @@ static void nswitch_hid_remove(struct hid_device *hdev) {
 
 		power_supply_unregister(ndev->battery);
 		kfree(ndev->battery_desc.name);
+	}
 
-		//kfree(ndev->siminput->name);
-		//ndev->siminput->name = 0;
-		if (ndev->siminput) {
-			input_unregister_device(ndev->siminput);
-		}
-
-		if (ndev->right) {
-			if (ndev->info.type == LEFT_JOYCON) {
-				ndev->right->handler = &simplejc_prepare;
-				ns_exchange(ndev->right, &(output_command) {
-						BASIC, 0, 0, {}, SET_INPUT_REPORT_MODE, {
-							.mode = SIMPLE
-				}});
-				ndev->right->right = 0;
-				ndev->right = 0;
-			}
-		}
+	/*
+	  Input is accepted before the init sequence ends, and the partner
+	  may report through our input device
+	 */
+	nd_unpair(ndev);
+	/* No table swap may report through an input device going away */
+	deinit_remap(ndev);
+	//kfree(ndev->siminput->name);
+	//ndev->siminput->name = 0;
+	if (ndev->siminput) {
+		input_unregister_device(ndev->siminput);
 	}
+	if (ndev->axis)
+		input_unregister_device(ndev->axis);
+	deinit_personalities(ndev);
+	deinit_filter(ndev);
+	deinit_imu(ndev);
+	deinit_stream(ndev);
 
 	hid_info(hdev, "finished disabling hardware");
 	device_remove_file(&hdev->dev, &dev_attr_devtype);
+	tx_stop(ndev);
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
+	poll_cancel(ndev);
+	if (ndev->ircam)
+		deinit_ir_cam(ndev);
+	if (ndev->cdev)
+		deinit_cdev(ndev);
+	if (ndev->trace)
+		deinit_trace(ndev);
+	if (ndev->grip)
+		deinit_grip(ndev);
+	deinit_tx(ndev);
 	kfree(ndev);
 }
 
@@ -585,6 +870,8 @@ static const struct hid_device_id nswitch_hid_devices[] = {
 				USB_DEVICE_ID_NINTENDO_JOYCON_R) },
 	{ HID_BLUETOOTH_DEVICE(USB_VENDOR_ID_NINTENDO,
 				USB_DEVICE_ID_NINTENDO_NS_PRO_CONTROLLER) },
+	{ HID_USB_DEVICE(USB_VENDOR_ID_NINTENDO,
+				USB_DEVICE_ID_NINTENDO_CHARGING_GRIP) },
 /*	{ HID_USB_DEVICE(USB_VENDOR_ID_NINTENDO,
 	USB_DEVICE_ID_NINTENDO_NS_PRO_CONTROLLER) },*/
 	{ }
@@ -600,12 +887,36 @@ static struct hid_driver nswitch_hid_driver = {
 };
 static int __init nswitch_hid_driver_init(void)
 {
+	int ret;
+
+	nswitch_wq = alloc_workqueue("nswitch", WQ_HIGHPRI | WQ_UNBOUND, 0);
+	if (!nswitch_wq)
+		return -ENOMEM;
 	/* TODO: init RPC file */
-	return hid_register_driver(&nswitch_hid_driver);
+	ret = nswitch_cdev_register();
+	if (ret) {
+		destroy_workqueue(nswitch_wq);
+		return ret;
+	}
+	nswitch_trace_register();
+	nswitch_poll_register();
+	ret = hid_register_driver(&nswitch_hid_driver);
+	if (ret) {
+		nswitch_poll_unregister();
+		nswitch_trace_unregister();
+		nswitch_cdev_unregister();
+		destroy_workqueue(nswitch_wq);
+	}
+	return ret;
 }
 static void __exit nswitch_hid_driver_exit(void)
 {
 	hid_unregister_driver(&nswitch_hid_driver);
+	nswitch_tx_unregister();
+	nswitch_poll_unregister();
+	nswitch_trace_unregister();
+	nswitch_cdev_unregister();
+	destroy_workqueue(nswitch_wq);
 }
 module_init(nswitch_hid_driver_init);
 module_exit(nswitch_hid_driver_exit);
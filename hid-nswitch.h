@@ -25,11 +25,14 @@
 #include <linux/timer.h>
 #include <linux/list.h>
 
+#include "nswitch-proto.h"
+#include "nswitch-uapi.h"
+
 #define USB_VENDOR_ID_NINTENDO 0x057e
 #define USB_DEVICE_ID_NINTENDO_JOYCON_L	0x2006
 #define USB_DEVICE_ID_NINTENDO_JOYCON_R	0x2007
 #define USB_DEVICE_ID_NINTENDO_NS_PRO_CONTROLLER	0x2009
-/* TODO: Handle Charging Grip */
+#define USB_DEVICE_ID_NINTENDO_CHARGING_GRIP	0x200e
 
 /*
 From:
@@ -43,286 +46,88 @@ limits so any additional player will have their LEDs off instead of being reject
 */
 #define PLAYER_LEDS 0x6BA9FEC8
 
-#define PACKED __attribute__((packed))
-
-/*
-  HCI states exposed by all the peripherals in this family
-  through the Bluetooth HID in subcommand 0xXX
- */
-enum nswitch_dev_hci_state {
-	DISCONNECT,
-	REBOOT_RECONNECT,
-	REBOOT_PAIR,
-	REBOOT_RECONNECT_HOME
-};
-
-typedef struct {
-	__u16 xmax_offset	: 12;
-	__u16 ymax_offset	: 12;
-	__u16 xcenter		: 12;
-	__u16 ycenter		: 12;
-	__u16 xmin_offset	: 12;
-	__u16 ymin_offset	: 12;
-} PACKED left_stick_calibration_data;
-
-typedef struct {
-	__u16 xcenter		: 12;
-	__u16 ycenter		: 12;
-	__u16 xmin_offset	: 12;
-	__u16 ymin_offset	: 12;
-	__u16 xmax_offset	: 12;
-	__u16 ymax_offset	: 12;
-} PACKED right_stick_calibration_data;
+typedef struct emulated_input emulated_input;
+struct nswitch_ircam;
+struct nswitch_grip;
+struct nswitch_cdev;
+struct nswitch_trace;
+struct nswitch_tx;
+struct nswitch_poller;
+struct seq_file;
 
-typedef struct {
-	__u16 accelerometer_origin[3];
-	__u16 accelerometer_sensitivity[3];
-	__u16 gyroscope_origin[3];
-	__u16 gyroscope_sensitivity[3];
-} PACKED sax_calibration_data;
+struct nswitch_dev;
+typedef struct nswitch_dev nswitch_dev;
 
-typedef struct {
-	left_stick_calibration_data left_stick;
-	right_stick_calibration_data right_stick;
-	sax_calibration_data sax;
-	__u32 gyro_coeff[3];
-} PACKED calibration_data;
+typedef void (*update_fun_t)(nswitch_dev *d);
 
 /*
-   Available stick directions (left joystick for the procontroller)
-   when holding the controller sideway with SR/SL on the top
-   when using 0x3F input reports.
+  Personality of a device, selecting the handler of its reports.
+  Only changed through nd_set_mode.
  */
-enum simple_stick_direction {
-	TOP,
-	TOP_RIGHT,
-	RIGHT,
-	BOTTOM_RIGHT,
-	BOTTOM,
-	BOTTOM_LEFT,
-	LEFT,
-	TOP_LEFT,
-	NEUTRAL
+enum nswitch_mode {
+	NSWITCH_UNCONFIGURED,
+	NSWITCH_SELECTING,
+	NSWITCH_VALIDATING_SIMPLE,
+	NSWITCH_VALIDATING_DUAL,
+	NSWITCH_SINGLE,
+	NSWITCH_DUAL_LEFT,
+	NSWITCH_DUAL_RIGHT,
+	NSWITCH_PRO,
+	NSWITCH_MODES
 };
 
 /*
-  HID input report types
+  Personalities a single joycon reports through, any number of them at
+  once, see nswitch-personality.c
  */
-enum input_report_type {
-	/*
-	   Driver init peripherals to this type
-
-	*/
-	SIMPLE			= 0x3F,
-
-	REPLY			= 0x21,
-	STANDARD		= 0x30,
-	STD_NFCIR		= 0x31,
-	STD_UNKNOWN0	= 0x32,
-	STD_UNKNOWN1	= 0x33,
-
-	NFC_UPDATE		= 0x23
+enum nswitch_personality {
+	NSWITCH_GAMEPAD,
+	NSWITCH_MOUSE,
+	NSWITCH_MOTION,
+	NSWITCH_KEYBOARD,
+	NSWITCH_PERSONALITIES
 };
 
-/*
-  State as reported by input report 0x3F
- */
-typedef struct {
-	__u8  down		: 1;
-	__u8  right		: 1;
-	__u8  left		: 1;
-	__u8  up		: 1;
-	__u8  sl		: 1;
-	__u8  sr		: 1;
-	__u8  __res1	: 2;
-	__u8  minus		: 1;
-	__u8  plus		: 1;
-	__u8  ls		: 1;
-	__u8  rs		: 1;
-	__u8  home		: 1;
-	__u8  capture	: 1;
-	__u8  lr		: 1; /* L or R on the corresponding joycon */
-	__u8  z			: 1; /* ZL or ZR -- --- ------------- ------*/
-
-	enum  simple_stick_direction direction : 8;
-
-	__u64 padding;
-} PACKED nswitch_dev_simple_state;
+/* Power of two */
+#define NSWITCH_EVENT_SLOTS 16
 
 /*
-  State reported by the standard input report types
-*/
-typedef struct {
-	__u8 y		: 1;
-	__u8 x		: 1;
-	__u8 b		: 1;
-	__u8 a		: 1;
-	__u8 rsr	: 1;
-	__u8 rsl	: 1;
-	__u8 r		: 1;
-	__u8 zr		: 1;
-
-	__u8 minus			: 1;
-	__u8 plus			: 1;
-	__u8 rs				: 1;
-	__u8 ls				: 1;
-	__u8 home			: 1;
-	__u8 capture		: 1;
-	__u8 __res1			: 1;
-	__u8 charging_grip	: 1;
-
-	__u8 down	: 1;
-	__u8 up		: 1;
-	__u8 right	: 1;
-	__u8 left	: 1;
-	__u8 lsr	: 1;
-	__u8 lsl	: 1;
-	__u8 l		: 1;
-	__u8 zl		: 1;
-} PACKED standard_button_state;
+  Range of the x and y axes of a stick, from its calibration
+ */
+#define set_stick_abs(input, x, y, cal)									\
+	do {																\
+		input_set_abs_params(input, x,									\
+							 (cal).xcenter - (cal).xmin_offset,			\
+							 (cal).xcenter + (cal).xmax_offset, 10, 0);	\
+		input_set_abs_params(input, y,									\
+							 (cal).ycenter - (cal).ymin_offset,			\
+							 (cal).ycenter + (cal).ymax_offset, 10, 0);	\
+	} while (0)
 
 /*
-  Only when the input report type is REPLY
+  Time spent per report in one stage of the report path.
+  Only updated from the context running that stage, and only when built
+  with CONFIG_NSWITCH_TIMING=y.
  */
 typedef struct {
-	__u8 ack;
-	__u8 reply_to;
-	__u8 data[35];
-} PACKED subcmd_input;
-
-typedef struct {
-	__u16 x : 12;
-	__u16 y : 12;
-} PACKED stick_state;
-
-typedef struct {
-	__u8  timer;
-	__u8  connection: 4;
-	__u8  battery: 4;
-	standard_button_state buttons;
-	stick_state left_stick;
-	stick_state right_stick;
-	__u8 vib;
-	union {
-		subcmd_input reply;
-		__u8 nfc_ir_mcu[37];
-		__u16 ax6[3][2][3];
-	};
-} PACKED nswitch_dev_full_report;
-
-enum nswitch_dev_type {
-	LEFT_JOYCON = 1,
-	RIGHT_JOYCON,
-	PRO_CONTROLLER
-};
+	__u64 count;
+	__u64 total_ns;
+	__u64 max_ns;
+} nswitch_timing;
 
 /*
-   Reply from subcmd 0x02
+  Command queued to the device command worker.
+  done is called from the worker once the command has been sent,
+  or with -ENODEV when the device goes away.
  */
-typedef struct {
-	__u8 vmajor;
-	__u8 vminor;
-	enum nswitch_dev_type type : 8;
-	__u8 two;
-	__u8 mac[6];
-	__u8 one;
-	__u8 colored;
-} PACKED nswitch_devinfo;
-
-typedef struct {
-	enum input_report_type input_report : 8;
-	union {
-		nswitch_dev_simple_state simple;
-		nswitch_dev_full_report full;
-	};
-} PACKED nswitch_dev_input_report;
-
-enum report_type {
-	BASIC				= 0x1,
-	NFC_UPDATE_REPORT	= 0x3,
-	RUMBLE_REPORT		= 0x10,
-	UNKNOWN_REPORT		= 0x12
-};
-
-typedef struct {
-	__u8 pair_type;
-	__u8 host_bd_addr[6];
-} PACKED manual_pair_args;
-
-typedef struct {
-	__u16 l, r, zl, zr, sl, sr, home;
-} PACKED elapsed_trigger_time;
-
-typedef struct {
-	__u32 addr;
-	__u8 size;
-} PACKED spi_read_args_t;
-
-typedef struct {
-	spi_read_args_t echo;
-	__u8 data[];
-} PACKED spi_read_reply;
-
-/* +2 for magic */
-#define USER_CALIBRATION_LEFT_STICK {0x8010, 9 + 2}
-#define USER_CALIBRATION_RIGHT_STICK {0x801B, 9 + 2}
-#define USER_CALIBRATION_6AXIS {0x8028, 0x18 + 2}
-
-#define FACTORY_CALIBRATION_LEFT_STICK {0x603D, 9}
-#define FACTORY_CALIBRATION_RIGHT_STICK {0x6046, 9}
-#define FACTORY_CALIBRATION_6AXIS {0x6020, 0x18}
-
-enum subcommand_type {
-	GET_CONTROLLER_STATE	= 0x00,
-	MANUAL_PAIR				= 0x01,
-	DEVICE_INFO				= 0x02,
-	SET_INPUT_REPORT_MODE	= 0x03,
-	ELAPSED_TRIGGER_TIME	= 0x04,
-	PAGE_LIST_STATE			= 0x05,
-	SET_HCI					= 0x06,
-	RESET_PAIRING			= 0x07,
-	SET_SHIPMENT			= 0x08,
-	SPI_FLASH_READ			= 0x10,
-	SPI_FLASH_WRITE			= 0x11,
-	SPI_FLASH_ERASE_SECTOR	= 0x12,
-	RESET_NFC_IR			= 0x20,
-	SET_NFC_IR				= 0x21,
-	SET_PLAYER_LIGHTS		= 0x30,
-	GET_PLAYER_LIGHTS		= 0x31,
-	SET_HOME_LIGHT			= 0x38,
-	SET_IMU					= 0x40,
-	SET_IMU_SENSITIVITY		= 0x41,
-	SET_VIBRATION			= 0x48,
-	GET_VOLTAGE				= 0x50,
+typedef struct nswitch_async_cmd nswitch_async_cmd;
+struct nswitch_async_cmd {
+	struct list_head list;
+	output_command oc;
+	void (*done)(nswitch_async_cmd *cmd, nswitch_dev_input_report *res,
+				 int status);
 };
 
-typedef struct {
-	enum report_type report : 8;
-	__u8 gpn : 4;
-	__u8 zero : 4;
-	__u8 rumble_data[8];
-	enum subcommand_type subcommand : 8;
-	union {
-		__u8 raw[54];
-		manual_pair_args manual_pair;
-		enum input_report_type mode : 8;
-		elapsed_trigger_time ett;
-		enum nswitch_dev_hci_state new_hci_state : 8;
-		__u8 shipment_mode;
-		spi_read_args_t spi_read;
-		__u8 player_lights;
-		__u8 imu_state;
-		__u8 vibrate;
-	};
-} PACKED output_command;
-
-typedef struct emulated_input emulated_input;
-
-struct nswitch_dev;
-typedef struct nswitch_dev nswitch_dev;
-
-typedef void (*update_fun_t)(nswitch_dev *d);
-
 struct nswitch_dev {
 	struct spinlock cmd_lock;
 	struct spinlock state_lock;
@@ -333,27 +138,105 @@ struct nswitch_dev {
 	struct power_supply *battery;
 	struct power_supply_desc battery_desc;
 
-	update_fun_t handler;
+	atomic_t mode; /* enum nswitch_mode */
+	/* Opened input devices owned by this device, see nswitch-mode.c */
+	atomic_t users;
+	struct work_struct stream_worker;
+	__u8 wants_imu; /* Set by the personality before entering its mode */
+	__u8 ir_active; /* Set by the IR camera, which needs STD_NFCIR */
+	/* Only written by the stream worker */
+	enum input_report_type report_mode;
+	__u8 imu_on; /* Only written by the stream worker */
 
 	struct led_classdev player_leds[4];
 	struct led_classdev home_led;
-	struct work_struct init_worker;
+	struct task_struct *thread;
 	struct work_struct cmd_worker;
+	struct mutex exchange_lock; /* Held by the BASIC command exchanges */
 	struct completion cmd_pending;
 	struct completion state_pending;
+	struct list_head cmd_queue;
+	nswitch_timing event_timing;
+	nswitch_timing dispatch_timing;
+	nswitch_timing handler_timing;
+	__u64 exchange_ns; /* Spent by the thread in ns_exchange, for handler_timing */
+	__u64 state_ns; /* When state_pending was last completed */
+	/* Device clock of the full reports, under state_lock */
+	ns_clock clock;
 
+	/*
+	  Defaults until the init sequence reads it, then set by the device
+	  thread under pair_lock
+	 */
 	calibration_data calibration;
+	/* calibration for cdev_update_state, under state_lock */
+	calibration_data state_calibration;
 	nswitch_devinfo info;
+	/* Report being handled, only written by the device thread */
 	nswitch_dev_input_report state;
-	subcmd_input reply_data;
+	ns_frame frame; /* state, decoded, with filtered sticks */
+	ns_axis_filter stick_filters[4];
+	__u8 sticks_changed; /* Bit per frame stick axis */
+	ns_filter_params filter_params; /* Written from sysfs */
+	ns_gyro_bias gyro_bias; /* Only written by the device thread */
+	ns_fusion fusion; /* Only used by the device thread */
+	unsigned long reset_heading; /* Bit 0: heading to reset */
+	/* IMU samples of frame, see nd_imu_update */
+	__s32 imu[3][6]; /* Calibrated, without the gyroscope bias */
+	__s32 quat[3][4]; /* Orientation after each sample */
+	__u64 imu_time[3];
+	/* frame as handled, under state_lock, for the partner of a pair */
+	__u32 pair_buttons;
+	__u16 pair_sticks[4];
+	ns_aim_params aim; /* Written from sysfs, as a whole under state_lock */
+	__u16 aim_out[2]; /* Right stick as last aimed */
+	/* Axes reported or filtered out, by the devices reporting them */
+	atomic64_t stick_events;
+	atomic64_t stick_suppressed;
+	__u64 state_time; /* Sample time of state */
+	subcmd_input reply_data; /* Under cmd_lock */
+
+	/* Reports waiting for the device thread, under state_lock */
+	nswitch_dev_input_report events[NSWITCH_EVENT_SLOTS];
+	ns_frame events_frame[NSWITCH_EVENT_SLOTS];
+	__u64 events_time[NSWITCH_EVENT_SLOTS];
+	unsigned int events_head;
+	unsigned int events_tail;
+	__u64 events_coalesced;
+	__u64 events_overruns;
+	struct list_head poll_entry; /* Under the lock of poller */
+	unsigned long poll_queued; /* Bit 0: poll_entry on the list of poller */
+	struct nswitch_poller *poller;
+
+	/* Commands run once the device reports, see nswitch-hw-init.c */
+	nswitch_async_cmd init_cmd;
+	calibration_data init_calibration;
+	__u8 init_step;
+	unsigned long recalibrate; /* Bit 0: init_calibration to take */
+	__u64 probe_ns;
+	__u64 ready_ns; /* From probe to accepting input */
+	__u64 first_event_ns; /* From probe to the first report handled */
+	__u64 calibrated_ns; /* From probe to the end of the init sequence */
+
 	__u8 ledcache;
 	__u8 inited_hw;
 	__u8 deinit;
 
-	__u8 reply;
+	__u8 reply; /* Subcommand awaiting its reply, under cmd_lock */
 	__u8 cmdcounter : 4;
 
-	nswitch_dev *right;
+	nswitch_dev __rcu *right; /* Partner, written with pair_lock held */
+	/* Enabled personalities, bit per enum nswitch_personality */
+	unsigned long personalities;
+	/* Allocated when first enabled, with pair_lock held */
+	struct input_dev *pinputs[NSWITCH_PERSONALITIES];
+	/* Remap tables, NULL for the defaults, written with pair_lock held */
+	struct nswitch_remap __rcu *remap[NSWITCH_REMAP_TARGETS];
+	struct nswitch_ircam *ircam;
+	struct nswitch_grip *grip; /* Only in the Charging Grip */
+	struct nswitch_cdev *cdev;
+	struct nswitch_trace *trace;
+	struct nswitch_tx *tx;
 };
 
 typedef struct {
@@ -364,16 +247,126 @@ typedef struct {
 void init_keys(nswitch_dev *ndev);
 int init_battery(nswitch_dev *ndev);
 int init_player_leds(nswitch_dev *ndev);
+int init_sequence_start(nswitch_dev *ndev);
+void update_stick_ranges(nswitch_dev *ndev);
 int nd_send_cmd(nswitch_dev *ndev, output_command *oc);
-int nd_wait_reply(nswitch_dev *jdev);
 nswitch_dev_input_report ns_exchange(nswitch_dev *ndev,
 									 output_command *oc);
+int nd_queue_cmd(nswitch_dev *ndev, nswitch_async_cmd *cmd);
 void set_leds(nswitch_dev *ndev, __u8 mask);
 void dump_mem(struct hid_device *hdev, __u8 *s, int size);
+__u64 nd_imu_time(nswitch_dev *ndev, int sample);
 void handshake_rumble(nswitch_dev *ndev);
 void simplejc_prepare(nswitch_dev *ndev);
+void projc_prepare(nswitch_dev *ndev);
+void validate_simple(nswitch_dev *ndev);
+void validate_dual(nswitch_dev *ndev);
+void report_single(nswitch_dev *ndev);
+void report_dual_left(nswitch_dev *ndev);
+void report_dual_right(nswitch_dev *ndev);
+void report_pro(nswitch_dev *ndev);
+int setup_dual_joypad(nswitch_dev *rdev);
+#ifdef CONFIG_NSWITCH_KUNIT_TEST
+int nd_kunit_feed(nswitch_dev *ndev, u8 *raw_data, int size);
+#endif
+int nd_set_mode(nswitch_dev *ndev, enum nswitch_mode from,
+				enum nswitch_mode to);
+int nd_link(nswitch_dev *left, nswitch_dev *right);
+nswitch_dev *nd_pair(nswitch_dev *left);
+void nd_unlink(nswitch_dev *ndev);
+void nd_unpair(nswitch_dev *ndev);
+void nd_stream_update(nswitch_dev *ndev);
+int nd_input_open(struct input_dev *input);
+void nd_input_close(struct input_dev *input);
+void init_stream(nswitch_dev *ndev);
+void deinit_stream(nswitch_dev *ndev);
+struct input_dev *nd_alloc_input(nswitch_dev *ndev, const char *kind);
+void nd_setup_motion(struct input_dev *input);
+void nd_report_motion(nswitch_dev *ndev, struct input_dev *input,
+					  const ns_frame *f);
+int nd_set_personalities(nswitch_dev *ndev, unsigned long mask);
+int init_personalities(nswitch_dev *ndev);
+void deinit_personalities(nswitch_dev *ndev);
+
+void nd_setup_remap_keys(struct input_dev *input);
+void nd_report_keys(nswitch_dev *owner, enum nswitch_remap_target target,
+					struct input_dev *input, __u32 buttons);
+void nd_report_sticks(nswitch_dev *owner, enum nswitch_remap_target target,
+					  struct input_dev *input, const int *codes,
+					  const __u16 *values, unsigned long owned,
+					  unsigned long changed);
+int init_remap(nswitch_dev *ndev);
+void deinit_remap(nswitch_dev *ndev);
+void nd_filter_sticks(nswitch_dev *ndev);
+int init_filter(nswitch_dev *ndev);
+void deinit_filter(nswitch_dev *ndev);
+void nd_imu_update(nswitch_dev *ndev);
+void nd_imu_reset(nswitch_dev *ndev);
+unsigned long nd_gyro_aim(nswitch_dev *ndev, __u16 sticks[4]);
+int init_imu(nswitch_dev *ndev);
+void deinit_imu(nswitch_dev *ndev);
+int init_ir_cam(nswitch_dev *ndev);
+void deinit_ir_cam(nswitch_dev *ndev);
+void ircam_handle_fragment(nswitch_dev *ndev, ir_mcu_fragment *frag);
+int init_grip(nswitch_dev *ndev);
+void deinit_grip(nswitch_dev *ndev);
+void grip_handshake(nswitch_dev *ndev);
+void grip_handle_reply(nswitch_dev *ndev, __u8 *raw, int size);
+void grip_pair(nswitch_dev *ndev);
+int nswitch_cdev_register(void);
+void nswitch_cdev_unregister(void);
+int init_cdev(nswitch_dev *ndev);
+void deinit_cdev(nswitch_dev *ndev);
+void cdev_push_report(nswitch_dev *ndev, __u8 *raw, int size);
+void cdev_update_state(nswitch_dev *ndev, const ns_frame *f,
+					   __u64 sample_time);
+void nswitch_trace_register(void);
+void nswitch_trace_unregister(void);
+int init_trace(nswitch_dev *ndev);
+void deinit_trace(nswitch_dev *ndev);
+void trace_report(nswitch_dev *ndev, int dir, __u8 *data, int size);
+void nswitch_show_timing(struct seq_file *s, const char *name,
+						 nswitch_timing *t);
+int init_tx(nswitch_dev *ndev);
+void deinit_tx(nswitch_dev *ndev);
+void tx_stop(nswitch_dev *ndev);
+int tx_queue(nswitch_dev *ndev, output_command *oc);
+void tx_show_stats(nswitch_dev *ndev, struct seq_file *s);
+void nswitch_tx_unregister(void);
+void poll_report(nswitch_dev *ndev);
+void poll_cancel(nswitch_dev *ndev);
+void poll_show_stats(struct seq_file *s);
+void nswitch_poll_register(void);
+void nswitch_poll_unregister(void);
+
+/*
+  Always built, for the output report queues.
+  The report path only times itself with CONFIG_NSWITCH_TIMING, through
+  timing_start and timing_add.
+ */
+void nswitch_timing_add(nswitch_timing *t, __u64 start_ns);
+
+#ifdef CONFIG_NSWITCH_TIMING
+static inline void timing_add(nswitch_timing *t, __u64 start_ns) {
+	nswitch_timing_add(t, start_ns);
+}
+
+static inline __u64 timing_start(void) {
+	return ktime_get_ns();
+}
+#else
+static inline void timing_add(nswitch_timing *t, __u64 start_ns) {
+}
+
+static inline __u64 timing_start(void) {
+	return 0;
+}
+#endif
 
 extern spinlock_t global_lock;
+extern struct workqueue_struct *nswitch_wq;
+extern struct mutex pair_lock;
+extern const update_fun_t nswitch_mode_handlers[NSWITCH_MODES];
 extern __u8 allocated_players[8];
 extern struct list_head ljoycons;
 extern struct list_head rjoycons;
@@ -381,5 +374,7 @@ extern struct list_head procontrollers;
 
 extern const short ns_simple_buttons[11];
 extern const short ns_buttons[24];
+extern const short ns_pro_buttons[24];
+extern const short ns_keyboard_keys[11];
 
 #endif
@@ -0,0 +1,620 @@
+#include "hid-nswitch.h"
+#include "nswitch-uapi.h"
+
+#include <linux/cdev.h>
+#include <linux/eventfd.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/idr.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+/*
+  One /dev/nswitchN character device per peripheral.
+  Raw input reports are published through a mmap'd single producer,
+  single consumer ring filled from the event handler, without locks.
+  Readers are woken up by batches, every ring_batch reports or
+  ring_batch_us after the first report of a batch.
+  The latest decoded state is also published in a read-only page
+  behind a sequence counter, for readers polling at their own pace.
+  Commands submitted through ioctls go through the device command
+  worker, so they never race with the driver own exchanges.
+ */
+
+#define NSWITCH_MINORS 32
+
+static unsigned int ring_order = 10;
+module_param(ring_order, uint, 0444);
+MODULE_PARM_DESC(ring_order, "log2 of the number of records in each report ring (4-16)");
+
+static unsigned int ring_batch = 8;
+module_param(ring_batch, uint, 0644);
+MODULE_PARM_DESC(ring_batch, "Wake up ring readers every N reports");
+
+static unsigned int ring_batch_us = 2000;
+module_param(ring_batch_us, uint, 0644);
+MODULE_PARM_DESC(ring_batch_us, "Wake up ring readers at most T us after a report");
+
+static dev_t nswitch_devt;
+static struct class *nswitch_class;
+static DEFINE_IDA(nswitch_minors);
+
+struct nswitch_cdev {
+	struct device dev;
+	struct cdev cdev;
+
+	/* Protects ndev and ring ownership changes */
+	struct spinlock lock;
+	nswitch_dev *ndev;
+	/* Serializes ring ownership changes with the ring reset */
+	struct mutex ring_lock;
+
+	nswitch_ring_header *ring;
+	nswitch_ring_record *records;
+	size_t ring_size;
+	__u32 ring_mask;
+	struct file *ring_owner;
+
+	nswitch_state_page *state;
+
+	wait_queue_head_t wait;
+	struct hrtimer batch_timer;
+	atomic_t pending;
+};
+
+/*
+  Per open file. Outlives the file while commands are in flight.
+ */
+typedef struct {
+	struct kref ref;
+	struct nswitch_cdev *c;
+
+	/* Protects efd and done */
+	struct spinlock lock;
+	struct eventfd_ctx *efd;
+	DECLARE_KFIFO(done, nswitch_cmd_completion, NSWITCH_MAX_INFLIGHT);
+	wait_queue_head_t wait;
+	atomic_t slots;
+} nswitch_cdev_file;
+
+typedef struct {
+	nswitch_async_cmd cmd;
+	nswitch_cdev_file *f;
+	__u64 user_data;
+} nswitch_cdev_cmd;
+
+static enum hrtimer_restart nswitch_cdev_batch_timeout(struct hrtimer *t) {
+	struct nswitch_cdev *c = container_of(t, struct nswitch_cdev, batch_timer);
+
+	atomic_set(&c->pending, 0);
+	wake_up_interruptible(&c->wait);
+	return HRTIMER_NORESTART;
+}
+
+/*
+  Must only be called from the event handler, which is the only
+  producer. It runs under RCU, so that the owner release can wait for
+  it before resetting the ring.
+  The tail is owned by user space, so it is only trusted as far as
+  masking it keeps us in the ring.
+ */
+/* Event Handler */
+void cdev_push_report(nswitch_dev *ndev, __u8 *raw, int size) {
+	struct nswitch_cdev *c = ndev->cdev;
+	nswitch_ring_header *h;
+	nswitch_ring_record *r;
+	__u32 head, tail;
+
+	if (!c)
+		return;
+	rcu_read_lock();
+	if (!smp_load_acquire(&c->ring_owner)) {
+		rcu_read_unlock();
+		return;
+	}
+
+	h = c->ring;
+	head = h->head;
+	tail = smp_load_acquire(&h->tail);
+	WRITE_ONCE(h->produced, h->produced + 1);
+	if (head - tail > c->ring_mask) {
+		WRITE_ONCE(h->overruns, h->overruns + 1);
+	} else {
+		r = c->records + (head & c->ring_mask);
+		r->timestamp = ktime_get_ns();
+		memcpy(r->report, raw, size);
+		memset(r->report + size, 0, sizeof(r->report) - size);
+		smp_store_release(&h->head, head + 1);
+	}
+	rcu_read_unlock();
+
+	if (atomic_inc_return(&c->pending) >= ring_batch) {
+		atomic_set(&c->pending, 0);
+		hrtimer_try_to_cancel(&c->batch_timer);
+		wake_up_interruptible(&c->wait);
+	} else if (!hrtimer_active(&c->batch_timer)) {
+		hrtimer_start(&c->batch_timer,
+					  ns_to_ktime((__u64)ring_batch_us * NSEC_PER_USEC),
+					  HRTIMER_MODE_REL);
+	}
+}
+
+/*
+  Only the event handler writes to the state page.
+ */
+/* Event Handler */
+void cdev_update_state(nswitch_dev *ndev, const ns_frame *f,
+					   __u64 sample_time) {
+	struct nswitch_cdev *c = ndev->cdev;
+	nswitch_state_page *st;
+	calibration_data cal, *cd = &cal;
+	unsigned long flags;
+	__u8 i;
+
+	if (!c || f->type == SIMPLE)
+		return;
+	/* Whole, the device thread may be taking a new one */
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	cal = ndev->state_calibration;
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+
+	st = c->state;
+	WRITE_ONCE(st->seq, st->seq + 1);
+	smp_wmb();
+	st->report_type = f->type;
+	st->timer = f->timer;
+	st->battery = f->battery;
+	st->connection = f->connection;
+	st->timestamp = ktime_get_ns();
+	st->updates++;
+	st->buttons = f->buttons;
+	ns_calibrate_sticks(cd, f, st->sticks);
+	if (f->has_imu) {
+		for (i = 0; i < 3; ++i) {
+			st->accel[i] = f->imu[2][i];
+			st->gyro[i] = f->imu[2][3 + i] - cd->sax.gyroscope_origin[i] -
+				((READ_ONCE(ndev->gyro_bias.bias[i]) + 128) >> 8);
+		}
+	}
+	st->sample_time = sample_time;
+	st->lost = ndev->clock.lost;
+	st->duplicated = ndev->clock.duplicated;
+	smp_wmb();
+	WRITE_ONCE(st->seq, st->seq + 1);
+}
+
+static void nswitch_cdev_file_free(struct kref *ref) {
+	nswitch_cdev_file *f = container_of(ref, nswitch_cdev_file, ref);
+
+	if (f->efd)
+		eventfd_ctx_put(f->efd);
+	kfree(f);
+}
+
+/* Worker Thread */
+static void nswitch_cdev_cmd_done(nswitch_async_cmd *cmd,
+								  nswitch_dev_input_report *res,
+								  int status) {
+	nswitch_cdev_cmd *cc = container_of(cmd, nswitch_cdev_cmd, cmd);
+	nswitch_cdev_file *f = cc->f;
+	nswitch_cmd_completion done = {
+		.user_data = cc->user_data,
+		.status = status,
+		.ack = res->full.reply.ack,
+		.reply_to = res->full.reply.reply_to,
+	};
+	unsigned long flags;
+
+	memcpy(done.data, res->full.reply.data, sizeof(done.data));
+	spin_lock_irqsave(&f->lock, flags);
+	/* Submission reserved a slot, this can't fail */
+	kfifo_put(&f->done, done);
+	if (f->efd)
+		eventfd_signal(f->efd);
+	spin_unlock_irqrestore(&f->lock, flags);
+	wake_up_interruptible(&f->wait);
+
+	kref_put(&f->ref, nswitch_cdev_file_free);
+	kfree(cc);
+}
+
+static int nswitch_cdev_open(struct inode *inode, struct file *file) {
+	struct nswitch_cdev *c = container_of(inode->i_cdev,
+										  struct nswitch_cdev, cdev);
+	nswitch_cdev_file *f;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+	kref_init(&f->ref);
+	f->c = c;
+	spin_lock_init(&f->lock);
+	INIT_KFIFO(f->done);
+	init_waitqueue_head(&f->wait);
+	atomic_set(&f->slots, NSWITCH_MAX_INFLIGHT);
+
+	file->private_data = f;
+	return nonseekable_open(inode, file);
+}
+
+/*
+  The next owner gets an empty ring, reset once the producer is done
+  with this owner
+ */
+static int nswitch_cdev_release(struct inode *inode, struct file *file) {
+	nswitch_cdev_file *f = file->private_data;
+	struct nswitch_cdev *c = f->c;
+	nswitch_ring_header *h = c->ring;
+	unsigned long flags;
+
+	mutex_lock(&c->ring_lock);
+	if (c->ring_owner == file) {
+		spin_lock_irqsave(&c->lock, flags);
+		smp_store_release(&c->ring_owner, NULL);
+		spin_unlock_irqrestore(&c->lock, flags);
+		synchronize_rcu();
+		h->head = h->tail = 0;
+		h->produced = h->overruns = 0;
+	}
+	mutex_unlock(&c->ring_lock);
+	kref_put(&f->ref, nswitch_cdev_file_free);
+	return 0;
+}
+
+static ssize_t nswitch_cdev_read(struct file *file, char __user *buf,
+								 size_t count, loff_t *ppos) {
+	nswitch_cdev_file *f = file->private_data;
+	nswitch_cmd_completion done;
+	unsigned long flags;
+	ssize_t ret = 0;
+	int got;
+
+	if (count < sizeof(done))
+		return -EINVAL;
+
+	if (kfifo_is_empty(&f->done)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(f->wait, !kfifo_is_empty(&f->done)))
+			return -ERESTARTSYS;
+	}
+
+	while (count - ret >= sizeof(done)) {
+		spin_lock_irqsave(&f->lock, flags);
+		got = kfifo_get(&f->done, &done);
+		spin_unlock_irqrestore(&f->lock, flags);
+		if (!got)
+			break;
+		atomic_inc(&f->slots);
+		if (copy_to_user(buf + ret, &done, sizeof(done)))
+			return -EFAULT;
+		ret += sizeof(done);
+	}
+	return ret;
+}
+
+/*
+  Commands that could brick or unpair the peripheral need privileges
+ */
+static int nswitch_cdev_check_cmd(nswitch_cmd *cmd) {
+	switch (cmd->report) {
+	case BASIC:
+		break;
+	case RUMBLE_REPORT:
+	case MCU_REPORT:
+		return 0;
+	default:
+		return -EINVAL;
+	}
+	switch (cmd->subcommand) {
+	case RESET_PAIRING:
+	case SET_SHIPMENT:
+	case SPI_FLASH_WRITE:
+	case SPI_FLASH_ERASE_SECTOR:
+		return capable(CAP_SYS_ADMIN) ? 0 : -EPERM;
+	default:
+		return 0;
+	}
+}
+
+static long nswitch_cdev_submit(nswitch_cdev_file *f,
+								nswitch_cmd_batch __user *ubatch) {
+	struct nswitch_cdev *c = f->c;
+	nswitch_cmd_batch batch;
+	nswitch_cmd __user *ucmds;
+	nswitch_cmd cmd;
+	nswitch_cdev_cmd *cc;
+	unsigned long flags;
+	__u32 i;
+	int ret = 0;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	ucmds = u64_to_user_ptr(batch.cmds);
+
+	for (i = 0; i < batch.count; ++i) {
+		if (copy_from_user(&cmd, ucmds + i, sizeof(cmd))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = nswitch_cdev_check_cmd(&cmd);
+		if (ret)
+			break;
+		if (atomic_dec_if_positive(&f->slots) < 0) {
+			ret = -EAGAIN;
+			break;
+		}
+
+		cc = kzalloc(sizeof(*cc), GFP_KERNEL);
+		if (!cc) {
+			atomic_inc(&f->slots);
+			ret = -ENOMEM;
+			break;
+		}
+		cc->f = f;
+		cc->user_data = cmd.user_data;
+		cc->cmd.done = nswitch_cdev_cmd_done;
+		cc->cmd.oc.report = cmd.report;
+		memcpy(cc->cmd.oc.rumble_data, cmd.rumble, sizeof(cmd.rumble));
+		cc->cmd.oc.subcommand = cmd.subcommand;
+		memcpy(cc->cmd.oc.raw, cmd.args, sizeof(cmd.args));
+
+		kref_get(&f->ref);
+		spin_lock_irqsave(&c->lock, flags);
+		ret = c->ndev ? nd_queue_cmd(c->ndev, &cc->cmd) : -ENODEV;
+		spin_unlock_irqrestore(&c->lock, flags);
+		if (ret) {
+			kref_put(&f->ref, nswitch_cdev_file_free);
+			atomic_inc(&f->slots);
+			kfree(cc);
+			break;
+		}
+	}
+	return i ? i : ret;
+}
+
+static long nswitch_cdev_ioctl(struct file *file, unsigned int cmd,
+							   unsigned long arg) {
+	nswitch_cdev_file *f = file->private_data;
+	struct eventfd_ctx *efd, *old;
+	unsigned long flags;
+	__s32 fd;
+
+	switch (cmd) {
+	case NSWITCH_IOC_SET_EVENTFD:
+		if (get_user(fd, (__s32 __user *)arg))
+			return -EFAULT;
+		efd = NULL;
+		if (fd >= 0) {
+			efd = eventfd_ctx_fdget(fd);
+			if (IS_ERR(efd))
+				return PTR_ERR(efd);
+		}
+		spin_lock_irqsave(&f->lock, flags);
+		old = f->efd;
+		f->efd = efd;
+		spin_unlock_irqrestore(&f->lock, flags);
+		if (old)
+			eventfd_ctx_put(old);
+		return 0;
+	case NSWITCH_IOC_SUBMIT:
+		return nswitch_cdev_submit(f, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static int nswitch_cdev_mmap_ring(struct nswitch_cdev *c, struct file *file,
+								  struct vm_area_struct *vma) {
+	unsigned long flags;
+	int ret;
+
+	if (vma->vm_end - vma->vm_start > c->ring_size)
+		return -EINVAL;
+
+	/* Waits for the reset of a ring being released */
+	mutex_lock(&c->ring_lock);
+	spin_lock_irqsave(&c->lock, flags);
+	if (!c->ndev) {
+		ret = -ENODEV;
+	} else if (c->ring_owner && c->ring_owner != file) {
+		ret = -EBUSY;
+	} else {
+		smp_store_release(&c->ring_owner, file);
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&c->lock, flags);
+	mutex_unlock(&c->ring_lock);
+	if (ret)
+		return ret;
+	return remap_vmalloc_range(vma, c->ring, 0);
+}
+
+static int nswitch_cdev_mmap_state(struct nswitch_cdev *c,
+								   struct vm_area_struct *vma) {
+	if (vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+	return remap_vmalloc_range(vma, c->state, 0);
+}
+
+static int nswitch_cdev_mmap(struct file *file, struct vm_area_struct *vma) {
+	nswitch_cdev_file *f = file->private_data;
+	struct nswitch_cdev *c = f->c;
+
+	switch (vma->vm_pgoff << PAGE_SHIFT) {
+	case NSWITCH_MMAP_RING:
+		return nswitch_cdev_mmap_ring(c, file, vma);
+	case NSWITCH_MMAP_STATE:
+		return nswitch_cdev_mmap_state(c, vma);
+	default:
+		return -EINVAL;
+	}
+}
+
+static __poll_t nswitch_cdev_poll(struct file *file, poll_table *wait) {
+	nswitch_cdev_file *f = file->private_data;
+	struct nswitch_cdev *c = f->c;
+	nswitch_ring_header *h = c->ring;
+	__poll_t mask = 0;
+
+	poll_wait(file, &c->wait, wait);
+	if (!READ_ONCE(c->ndev))
+		mask |= EPOLLHUP;
+	if (READ_ONCE(c->ring_owner) == file &&
+		smp_load_acquire(&h->head) != READ_ONCE(h->tail))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	return mask;
+}
+
+static const struct file_operations nswitch_cdev_fops = {
+	.owner = THIS_MODULE,
+	.open = nswitch_cdev_open,
+	.release = nswitch_cdev_release,
+	.read = nswitch_cdev_read,
+	.mmap = nswitch_cdev_mmap,
+	.poll = nswitch_cdev_poll,
+	.unlocked_ioctl = nswitch_cdev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = no_llseek,
+};
+
+static ssize_t ring_stats_show(struct device *dev,
+							   struct device_attribute *attr,
+							   char *buf) {
+	struct nswitch_cdev *c = container_of(dev, struct nswitch_cdev, dev);
+	nswitch_ring_header *h = c->ring;
+
+	return sprintf(buf, "produced: %llu\noverruns: %llu\nqueued: %u\n",
+				   READ_ONCE(h->produced), READ_ONCE(h->overruns),
+				   READ_ONCE(h->head) - READ_ONCE(h->tail));
+}
+
+static DEVICE_ATTR(ring_stats, S_IRUGO, ring_stats_show, NULL);
+
+static struct attribute *nswitch_cdev_attrs[] = {
+	&dev_attr_ring_stats.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(nswitch_cdev);
+
+/*
+  Open files keep the character device, hence this structure, alive
+  after the peripheral is gone.
+ */
+static void nswitch_cdev_free(struct device *dev) {
+	struct nswitch_cdev *c = container_of(dev, struct nswitch_cdev, dev);
+
+	vfree(c->ring);
+	vfree(c->state);
+	ida_free(&nswitch_minors, MINOR(dev->devt));
+	kfree(c);
+}
+
+/* Event Handler */
+int init_cdev(nswitch_dev *ndev) {
+	struct nswitch_cdev *c;
+	int minor;
+	int ret;
+
+	BUILD_BUG_ON(sizeof(nswitch_dev_input_report) != NSWITCH_REPORT_SIZE);
+	c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+
+	minor = ida_alloc_max(&nswitch_minors, NSWITCH_MINORS - 1, GFP_KERNEL);
+	if (minor < 0) {
+		kfree(c);
+		return minor;
+	}
+
+	spin_lock_init(&c->lock);
+	mutex_init(&c->ring_lock);
+	init_waitqueue_head(&c->wait);
+	hrtimer_init(&c->batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	c->batch_timer.function = nswitch_cdev_batch_timeout;
+	c->ndev = ndev;
+
+	device_initialize(&c->dev);
+	c->dev.devt = MKDEV(MAJOR(nswitch_devt), minor);
+	c->dev.class = nswitch_class;
+	c->dev.parent = &ndev->hdev->dev;
+	c->dev.groups = nswitch_cdev_groups;
+	c->dev.release = nswitch_cdev_free;
+	dev_set_name(&c->dev, "nswitch%d", minor);
+
+	c->ring_mask = (1 << ring_order) - 1;
+	c->ring_size = PAGE_SIZE + PAGE_ALIGN(sizeof(*c->records) << ring_order);
+	c->ring = vmalloc_user(c->ring_size);
+	if (!c->ring) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	c->ring->nrecords = 1 << ring_order;
+	c->ring->records_offset = PAGE_SIZE;
+	c->records = (void*)c->ring + PAGE_SIZE;
+
+	c->state = vmalloc_user(PAGE_SIZE);
+	if (!c->state) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	cdev_init(&c->cdev, &nswitch_cdev_fops);
+	c->cdev.owner = THIS_MODULE;
+	ret = cdev_device_add(&c->cdev, &c->dev);
+	if (ret)
+		goto err;
+
+	ndev->cdev = c;
+	return 0;
+
+err:
+	put_device(&c->dev);
+	return ret;
+}
+
+/*
+  Must be called once no more input report can be received
+ */
+/* Event Handler */
+void deinit_cdev(nswitch_dev *ndev) {
+	struct nswitch_cdev *c = ndev->cdev;
+	unsigned long flags;
+
+	ndev->cdev = NULL;
+	spin_lock_irqsave(&c->lock, flags);
+	c->ndev = NULL;
+	spin_unlock_irqrestore(&c->lock, flags);
+	hrtimer_cancel(&c->batch_timer);
+	wake_up_interruptible(&c->wait);
+
+	cdev_device_del(&c->cdev, &c->dev);
+	put_device(&c->dev);
+}
+
+int nswitch_cdev_register(void) {
+	int ret;
+
+	ring_order = clamp(ring_order, 4U, 16U);
+	ret = alloc_chrdev_region(&nswitch_devt, 0, NSWITCH_MINORS, "nswitch");
+	if (ret)
+		return ret;
+
+	nswitch_class = class_create("nswitch");
+	if (IS_ERR(nswitch_class)) {
+		unregister_chrdev_region(nswitch_devt, NSWITCH_MINORS);
+		return PTR_ERR(nswitch_class);
+	}
+	return 0;
+}
+
+void nswitch_cdev_unregister(void) {
+	class_destroy(nswitch_class);
+	unregister_chrdev_region(nswitch_devt, NSWITCH_MINORS);
+}
@@ -0,0 +1,90 @@
+#include "hid-nswitch.h"
+
+/*
+  Stick filtering, before the mode handlers.
+  Raw sticks jitter by a few units at rest, and every report would move
+  every axis: each device thread filters the sticks of its frame, see
+  ns_filter_axis, and handlers only report the axes that moved.
+  The filter is tuned per device through the stick_filter sys file:
+
+	echo "strength speed hysteresis rest" > stick_filter
+
+  with "0 0 0 0" turning it off.
+ */
+
+/* Worker Thread */
+void nd_filter_sticks(nswitch_dev *ndev) {
+	const calibration_data *cd = &ndev->calibration;
+	ns_filter_params p;
+	ns_frame *f = &ndev->frame;
+	int centers[4];
+	int i;
+
+	switch (f->type) {
+	case STANDARD:
+	case STD_NFCIR:
+	case STD_UNKNOWN0:
+	case STD_UNKNOWN1:
+		break;
+	default:
+		ndev->sticks_changed = 0;
+		return;
+	}
+
+	p.strength = READ_ONCE(ndev->filter_params.strength);
+	p.speed = READ_ONCE(ndev->filter_params.speed);
+	p.hysteresis = READ_ONCE(ndev->filter_params.hysteresis);
+	p.rest = READ_ONCE(ndev->filter_params.rest);
+	centers[0] = cd->left_stick.xcenter;
+	centers[1] = cd->left_stick.ycenter;
+	centers[2] = cd->right_stick.xcenter;
+	centers[3] = cd->right_stick.ycenter;
+
+	ndev->sticks_changed = 0;
+	for (i = 0; i < 4; ++i) {
+		if (ns_filter_axis(&ndev->stick_filters[i], &p, f->sticks[i], centers[i]))
+			ndev->sticks_changed |= BIT(i);
+		f->sticks[i] = ndev->stick_filters[i].out;
+	}
+}
+
+static ssize_t stick_filter_show(struct device *dev,
+								 struct device_attribute *attr, char *buf) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+
+	return sprintf(buf, "%u %u %u %u\n",
+				   READ_ONCE(ndev->filter_params.strength),
+				   READ_ONCE(ndev->filter_params.speed),
+				   READ_ONCE(ndev->filter_params.hysteresis),
+				   READ_ONCE(ndev->filter_params.rest));
+}
+
+static ssize_t stick_filter_store(struct device *dev,
+								  struct device_attribute *attr,
+								  const char *buf, size_t count) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+	unsigned int strength, speed, hysteresis, rest;
+
+	if (sscanf(buf, "%u %u %u %u", &strength, &speed, &hysteresis, &rest) != 4)
+		return -EINVAL;
+	if (strength > 255 || speed > 4095 || hysteresis > 4095 || rest > 4095)
+		return -EINVAL;
+	WRITE_ONCE(ndev->filter_params.strength, strength);
+	WRITE_ONCE(ndev->filter_params.speed, speed);
+	WRITE_ONCE(ndev->filter_params.hysteresis, hysteresis);
+	WRITE_ONCE(ndev->filter_params.rest, rest);
+	return count;
+}
+
+static DEVICE_ATTR(stick_filter, S_IRUGO | S_IWUSR,
+				   stick_filter_show, stick_filter_store);
+
+/* Event Handler */
+int init_filter(nswitch_dev *ndev) {
+	return device_create_file(&ndev->hdev->dev, &dev_attr_stick_filter);
+}
+
+/* Event Handler */
+void deinit_filter(nswitch_dev *ndev) {
+	device_remove_file(&ndev->hdev->dev, &dev_attr_stick_filter);
+}
@@ -0,0 +1,146 @@
+#include "hid-nswitch.h"
+
+/*
+  Joycons in the Charging Grip, over USB.
+  The grip exposes one HID interface per slot, each probed as its own
+  device, with the side given by DEVICE_INFO like over Bluetooth.
+  Before their HID protocol, the joycons expect a USB handshake, with
+  USB_COMMAND output reports answered by USB_REPLY input reports.
+  Their input reports are padded to the USB packet size.
+
+  Both halves of a grip are paired as soon as they are selecting,
+  without the button dance: they share the USB device path, so their
+  physical paths only differ by the interface.
+ */
+
+#define GRIP_KEY_SIZE 64
+
+struct nswitch_grip {
+	struct completion reply;
+	__u8 cmd; /* USB command awaiting its reply, 0 if none */
+	char key[GRIP_KEY_SIZE]; /* Physical path of the grip */
+};
+
+/*
+  Returns -ETIMEDOUT when the joycon does not reply
+ */
+/* Worker Thread */
+static int grip_usb_cmd(nswitch_dev *ndev, enum usb_command_type cmd) {
+	struct nswitch_grip *grip = ndev->grip;
+	output_command oc;
+	int ret;
+
+	ns_usb_cmd_prepare(&oc, cmd);
+	reinit_completion(&grip->reply);
+	WRITE_ONCE(grip->cmd, cmd);
+	ret = tx_queue(ndev, &oc);
+	if (!ret && !wait_for_completion_timeout(&grip->reply, HZ))
+		ret = -ETIMEDOUT;
+	WRITE_ONCE(grip->cmd, 0);
+	return ret;
+}
+
+/*
+  Switches the joycon to its HID protocol, at 3Mbps, without the
+  timeout that would disconnect it when the host sends nothing.
+ */
+/* Worker Thread */
+void grip_handshake(nswitch_dev *ndev) {
+	static const enum usb_command_type cmds[] = {
+		USB_HANDSHAKE, USB_BAUDRATE_3M, USB_HANDSHAKE, USB_NO_TIMEOUT
+	};
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(cmds); ++i) {
+		ret = grip_usb_cmd(ndev, cmds[i]);
+		if (ret) {
+			hid_warn(ndev->hdev, "USB command %02x failed: %d\n", cmds[i], ret);
+			return;
+		}
+	}
+	hid_info(ndev->hdev, "USB handshake done");
+}
+
+/* Event Handler */
+void grip_handle_reply(nswitch_dev *ndev, __u8 *raw, int size) {
+	struct nswitch_grip *grip = ndev->grip;
+
+	if (!grip || size < 2)
+		return;
+	if (raw[1] == READ_ONCE(grip->cmd))
+		complete(&grip->reply);
+}
+
+/*
+  Pairs ndev with the selecting other half of its grip, as a dual
+  joypad right away.
+ */
+/* Worker Thread */
+void grip_pair(nswitch_dev *ndev) {
+	nswitch_dev *other = NULL, *left, *right;
+	struct list_head *others;
+	unsigned long flags;
+	nswitch_list *nl;
+
+	switch (ndev->info.type) {
+	case LEFT_JOYCON:
+		others = &rjoycons;
+		break;
+	case RIGHT_JOYCON:
+		others = &ljoycons;
+		break;
+	default:
+		return;
+	}
+
+	mutex_lock(&pair_lock);
+	spin_lock_irqsave(&global_lock, flags);
+	list_for_each_entry(nl, others, list) {
+		if (nl->ndev->grip &&
+			atomic_read(&nl->ndev->mode) == NSWITCH_SELECTING &&
+			!strcmp(nl->ndev->grip->key, ndev->grip->key)) {
+			other = nl->ndev;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&global_lock, flags);
+	if (!other)
+		goto end;
+
+	left = ndev->info.type == LEFT_JOYCON ? ndev : other;
+	right = ndev->info.type == LEFT_JOYCON ? other : ndev;
+	if (!nd_link(left, right))
+		goto end;
+	hid_info(ndev->hdev, "Grip pair found, setting up dual joypad...");
+	setup_dual_joypad(right);
+end:
+	mutex_unlock(&pair_lock);
+}
+
+/* Event Handler */
+int init_grip(nswitch_dev *ndev) {
+	struct nswitch_grip *grip;
+	const char *phys = ndev->hdev->phys;
+	const char *slash;
+	int len;
+
+	grip = kzalloc(sizeof(*grip), GFP_KERNEL);
+	if (!grip)
+		return -ENOMEM;
+	init_completion(&grip->reply);
+	slash = strrchr(phys, '/');
+	len = slash ? slash - phys : (int)strlen(phys);
+	snprintf(grip->key, sizeof(grip->key), "%.*s", len, phys);
+	ndev->grip = grip;
+	return 0;
+}
+
+/*
+  Must be called once the device thread is gone
+ */
+/* Event Handler */
+void deinit_grip(nswitch_dev *ndev) {
+	kfree(ndev->grip);
+	ndev->grip = NULL;
+}
@@ -141,3 +141,127 @@ int init_player_leds(nswitch_dev *ndev) {
 	}
 	return ret;
 }
+
+/*
+  Commands run after DEVICE_INFO, once the device already reports with
+  the default calibration: enabling rumble, then reading the user or
+  factory calibration of each block.
+  Each step is queued to the command worker by the completion of the
+  previous one, the device thread never waits on them.
+ */
+
+typedef struct {
+	const char *name;
+	spi_read_args_t user;
+	spi_read_args_t factory;
+	size_t offset;
+	size_t size;
+} calibration_block;
+
+static const calibration_block calibration_blocks[] = {
+	{ "LS", USER_CALIBRATION_LEFT_STICK, FACTORY_CALIBRATION_LEFT_STICK,
+	  offsetof(calibration_data, left_stick),
+	  sizeof(left_stick_calibration_data) },
+	{ "RS", USER_CALIBRATION_RIGHT_STICK, FACTORY_CALIBRATION_RIGHT_STICK,
+	  offsetof(calibration_data, right_stick),
+	  sizeof(right_stick_calibration_data) },
+	{ "6AXIS", USER_CALIBRATION_6AXIS, FACTORY_CALIBRATION_6AXIS,
+	  offsetof(calibration_data, sax),
+	  sizeof(sax_calibration_data) }
+};
+
+/* Rumble, then a user and a factory read per block */
+#define INIT_STEPS (1 + 2 * ARRAY_SIZE(calibration_blocks))
+
+static void init_step_done(nswitch_async_cmd *cmd,
+						   nswitch_dev_input_report *res, int status);
+
+static int init_step_send(nswitch_dev *ndev) {
+	nswitch_async_cmd *cmd = &ndev->init_cmd;
+	const calibration_block *cb;
+	int step = ndev->init_step;
+
+	cmd->done = init_step_done;
+	if (!step) {
+		cmd->oc = (output_command) {
+			BASIC, 0, 0, {}, SET_VIBRATION, {
+				.vibrate = 1
+			}
+		};
+		return nd_queue_cmd(ndev, cmd);
+	}
+	cb = &calibration_blocks[(step - 1) / 2];
+	cmd->oc = (output_command) {
+		BASIC, 0, 0, {}, SPI_FLASH_READ, {
+			.spi_read = (step - 1) % 2 ? cb->factory : cb->user
+		}
+	};
+	return nd_queue_cmd(ndev, cmd);
+}
+
+/*
+  Publishes the calibration, the device thread takes it and updates the
+  ranges of the axes it reports before handling its next report.
+ */
+/* Worker Thread */
+static void init_sequence_end(nswitch_dev *ndev) {
+	ns_init_gyro_coeff(&ndev->init_calibration);
+	/* init_calibration written before the bit is seen */
+	smp_mb__before_atomic();
+	set_bit(0, &ndev->recalibrate);
+
+	init_player_leds(ndev);
+	init_battery(ndev);
+	ndev->inited_hw = 1;
+	/* Rumble is enabled by now */
+	handshake_rumble(ndev);
+	ndev->calibrated_ns = ktime_get_ns() - ndev->probe_ns;
+	hid_info(ndev->hdev, "Calibrated %llu us after probe",
+			 div_u64(ndev->calibrated_ns, NSEC_PER_USEC));
+}
+
+/* Worker Thread */
+static void init_step_done(nswitch_async_cmd *cmd,
+						   nswitch_dev_input_report *res, int status) {
+	nswitch_dev *ndev = container_of(cmd, nswitch_dev, init_cmd);
+	spi_read_reply *srr = (void*)&res->full.reply.data;
+	const calibration_block *cb;
+	const __u8 *data = NULL;
+	int step = ndev->init_step;
+
+	if (status == -ENODEV)
+		return;
+	if (status)
+		hid_warn(ndev->hdev, "Init step %d failed: %d", step, status);
+
+	if (step) {
+		cb = &calibration_blocks[(step - 1) / 2];
+		if (!status)
+			data = (step - 1) % 2 ? srr->data : ns_user_calibration(srr);
+		if (data) {
+			memcpy((__u8*)&ndev->init_calibration + cb->offset, data, cb->size);
+			/* No factory read needed */
+			if (!((step - 1) % 2))
+				++step;
+		} else if (!((step - 1) % 2)) {
+			hid_info(ndev->hdev, "No %s user config, loading factory settings...", cb->name);
+		}
+	}
+
+	ndev->init_step = ++step;
+	if (step < INIT_STEPS) {
+		init_step_send(ndev);
+		return;
+	}
+	init_sequence_end(ndev);
+}
+
+/*
+  Starts the init sequence, from the defaults in ndev->calibration
+ */
+/* Worker Thread */
+int init_sequence_start(nswitch_dev *ndev) {
+	ndev->init_calibration = ndev->calibration;
+	ndev->init_step = 0;
+	return init_step_send(ndev);
+}
@@ -0,0 +1,205 @@
+#include "hid-nswitch.h"
+
+/*
+  IMU processing in the device thread, before the mode handlers.
+  Each sample of the frame is calibrated once, into ndev->imu, for
+  every IMU consumer:
+  - the gyroscope bias is estimated from every sample, see
+    ns_bias_update, and removed;
+  - the orientation is fused from every sample, see ns_fusion_update,
+    into ndev->quat.
+  The bias estimate is shown in the gyro_bias sys file, in NS_GYRO_RES
+  units per axis, then its confidence in percent.
+  Writing to the reset_heading sys file turns the orientation back to
+  heading 0, keeping its tilt.
+
+  Gyro aiming mixes the gyroscope into the right stick of the dual and
+  pro controller joypads, for games that only read sticks, see
+  ns_aim_deflection. It is set through the gyro_aim sys file of the
+  device with the gyroscope, the right joycon of a pair:
+
+	echo "enabled sensitivity deadzone curve ratchet" > gyro_aim
+
+  sensitivity and deadzone in NS_GYRO_RES units, curve from 0 to 100,
+  ratchet a standard_button_state bit of that device, held to move
+  without aiming, or 255.
+ */
+
+/* Worker Thread */
+void nd_imu_update(nswitch_dev *ndev) {
+	const ns_frame *f = &ndev->frame;
+	int i;
+
+	if (!f->has_imu)
+		return;
+	if (test_and_clear_bit(0, &ndev->reset_heading))
+		ns_fusion_reset_heading(&ndev->fusion);
+	for (i = 0; i < 3; ++i) {
+		ndev->imu_time[i] = nd_imu_time(ndev, i);
+		ns_bias_update(&ndev->gyro_bias, &ndev->calibration, f->imu[i]);
+		ns_calibrate_imu(&ndev->calibration, ndev->gyro_bias.bias,
+						 f->imu[i], ndev->imu[i]);
+		ns_fusion_update(&ndev->fusion, ndev->imu[i], ndev->imu_time[i]);
+		memcpy(ndev->quat[i], ndev->fusion.q, sizeof(ndev->quat[i]));
+	}
+}
+
+/*
+  The bias is relative to the factory origin, the init sequence may
+  replace it
+ */
+/* Worker Thread */
+void nd_imu_reset(nswitch_dev *ndev) {
+	memset(&ndev->gyro_bias, 0, sizeof(ndev->gyro_bias));
+}
+
+/*
+  Mixes the gyroscope into the raw right stick values, sticks[2] and
+  sticks[3], with the axes of the gyro mouse: the deflection of each
+  IMU sample, the mean of the report since it has a single stick value.
+  Returns the sticks bits the aim changed.
+ */
+/* Event Handler */
+unsigned long nd_gyro_aim(nswitch_dev *ndev, __u16 sticks[4]) {
+	const right_stick_calibration_data *cal = &ndev->calibration.right_stick;
+	const ns_frame *f = &ndev->frame;
+	unsigned long changed = 0, flags;
+	ns_aim_params p;
+	int aiming;
+	__s32 d, v;
+	int i, j;
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	p = ndev->aim;
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+	if (!p.enabled) {
+		/* Back to the stick once */
+		if (!ndev->aim_out[0] && !ndev->aim_out[1])
+			return 0;
+		ndev->aim_out[0] = ndev->aim_out[1] = 0;
+		return BIT(2) | BIT(3);
+	}
+
+	aiming = f->has_imu && (p.ratchet >= 24 || !ns_button(f, p.ratchet));
+	for (i = 0; i < 2; ++i) {
+		d = 0;
+		/* Gyroscope z for x, y for y */
+		if (aiming)
+			for (j = 0; j < 3; ++j)
+				d += ns_aim_deflection(&p, ndev->imu[j][5 - i]);
+		d /= 3;
+		v = sticks[2 + i];
+		if (i == 0)
+			v += d * (d < 0 ? cal->xmin_offset : cal->xmax_offset) / 32767;
+		else
+			v += d * (d < 0 ? cal->ymin_offset : cal->ymax_offset) / 32767;
+		if (i == 0)
+			v = clamp_val(v, cal->xcenter - cal->xmin_offset,
+						  cal->xcenter + cal->xmax_offset);
+		else
+			v = clamp_val(v, cal->ycenter - cal->ymin_offset,
+						  cal->ycenter + cal->ymax_offset);
+		sticks[2 + i] = v;
+		if (v != ndev->aim_out[i])
+			changed |= BIT(2 + i);
+		ndev->aim_out[i] = v;
+	}
+	return changed;
+}
+
+static ssize_t gyro_bias_show(struct device *dev,
+							  struct device_attribute *attr, char *buf) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+	const calibration_data *cd = &ndev->calibration;
+	__s32 bias[3];
+	int i;
+
+	/* Scaled like ns_calibrate_imu */
+	for (i = 0; i < 3; ++i)
+		bias[i] = ((__s64)READ_ONCE(ndev->gyro_bias.bias[i]) *
+				   cd->gyro_coeff[i]) >> 24;
+	return sprintf(buf, "%d %d %d %u\n", bias[0], bias[1], bias[2],
+				   READ_ONCE(ndev->gyro_bias.confidence) * 100 / NS_BIAS_CONFIDENCE);
+}
+
+static DEVICE_ATTR(gyro_bias, S_IRUGO, gyro_bias_show, NULL);
+
+static ssize_t reset_heading_store(struct device *dev,
+								   struct device_attribute *attr,
+								   const char *buf, size_t count) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+
+	set_bit(0, &ndev->reset_heading);
+	return count;
+}
+
+static DEVICE_ATTR(reset_heading, S_IWUSR, NULL, reset_heading_store);
+
+static ssize_t gyro_aim_show(struct device *dev,
+							 struct device_attribute *attr, char *buf) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	ns_aim_params p;
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	p = ndev->aim;
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+	return sprintf(buf, "%u %d %d %u %u\n", p.enabled, p.sensitivity,
+				   p.deadzone, p.curve, p.ratchet);
+}
+
+static ssize_t gyro_aim_store(struct device *dev,
+							  struct device_attribute *attr,
+							  const char *buf, size_t count) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+	unsigned int enabled, curve, ratchet;
+	int sensitivity, deadzone;
+	unsigned long flags;
+
+	if (sscanf(buf, "%u %d %d %u %u", &enabled, &sensitivity, &deadzone,
+			   &curve, &ratchet) != 5)
+		return -EINVAL;
+	if (enabled > 1 || sensitivity <= 0 || deadzone < 0 ||
+		deadzone >= sensitivity || curve > 100 || ratchet > 255)
+		return -EINVAL;
+
+	mutex_lock(&pair_lock);
+	/* Whole, for nd_gyro_aim */
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	ndev->aim.sensitivity = sensitivity;
+	ndev->aim.deadzone = deadzone;
+	ndev->aim.curve = curve;
+	ndev->aim.ratchet = ratchet;
+	WRITE_ONCE(ndev->aim.enabled, enabled);
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+	/* The right joycon of a pair only streams its IMU to aim */
+	if (atomic_read(&ndev->mode) == NSWITCH_DUAL_RIGHT) {
+		WRITE_ONCE(ndev->wants_imu, enabled);
+		nd_stream_update(ndev);
+	}
+	mutex_unlock(&pair_lock);
+	return count;
+}
+
+static DEVICE_ATTR(gyro_aim, S_IRUGO | S_IWUSR, gyro_aim_show, gyro_aim_store);
+
+static struct attribute *nswitch_imu_attrs[] = {
+	&dev_attr_gyro_bias.attr,
+	&dev_attr_reset_heading.attr,
+	&dev_attr_gyro_aim.attr,
+	NULL
+};
+
+static const struct attribute_group nswitch_imu_group = {
+	.attrs = nswitch_imu_attrs
+};
+
+/* Event Handler */
+int init_imu(nswitch_dev *ndev) {
+	return sysfs_create_group(&ndev->hdev->dev.kobj, &nswitch_imu_group);
+}
+
+/* Event Handler */
+void deinit_imu(nswitch_dev *ndev) {
+	sysfs_remove_group(&ndev->hdev->dev.kobj, &nswitch_imu_group);
+}
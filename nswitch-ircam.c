@@ -0,0 +1,550 @@
+#include "hid-nswitch.h"
+
+#include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <media/v4l2-dev.h>
+#include <media/v4l2-device.h>
+#include <media/v4l2-ioctl.h>
+#include <media/videobuf2-v4l2.h>
+#include <media/videobuf2-vmalloc.h>
+
+/*
+  The right joycon IR camera is driven through the NFC/IR MCU.
+  While it streams, ir_active has the stream worker keep the device
+  in STD_NFCIR reports, whatever its input devices need.
+  Once configured, the MCU appends 300 bytes image fragments to
+  every STD_NFCIR report, and only sends the next one after the host
+  acknowledged the previous fragment through an MCU_REPORT.
+  256 fragments make a 320x240 greyscale frame.
+ */
+#define IR_WIDTH 320
+#define IR_HEIGHT 240
+#define IR_MAX_FRAG ((IR_WIDTH * IR_HEIGHT) / IR_FRAGMENT_SIZE - 1)
+
+/* 31200 ticks per ms */
+#define IR_EXPOSURE_US 300
+#define IR_EXPOSURE ((31200 * IR_EXPOSURE_US) / 1000)
+
+enum mcu_mode {
+	MCU_MODE_STANDBY	= 0x01,
+	MCU_MODE_IR			= 0x05
+};
+
+enum mcu_command {
+	MCU_SET_MODE	= 0x21,
+	MCU_SET_IR		= 0x23
+};
+
+enum mcu_ir_subcommand {
+	MCU_IR_CONFIG		= 0x01,
+	MCU_IR_WRITE_REGS	= 0x04
+};
+
+#define MCU_IR_IMAGE_TRANSFER 0x07
+
+typedef struct {
+	struct vb2_v4l2_buffer vb;
+	struct list_head list;
+} nswitch_ircam_buf;
+
+struct nswitch_ircam {
+	struct v4l2_device v4l2;
+	struct video_device vdev;
+	struct vb2_queue queue;
+	struct mutex vb_lock;
+
+	/* Protects everything below */
+	struct spinlock buf_lock;
+	struct list_head bufs;
+	nswitch_ircam_buf *cur;
+	nswitch_dev *ndev;
+	struct work_struct ack_worker;
+
+	__u8 streaming;
+	__u8 prev_frag;
+	__u8 resend;
+	__u8 resend_frag;
+	__u32 sequence;
+
+	__u64 frames;
+	__u64 fragments;
+	__u64 dropped;
+	__u64 bytes;
+	ktime_t start;
+};
+
+/* Worker Thread */
+static int ircam_mcu_command(nswitch_dev *ndev, output_command *oc) {
+	nswitch_dev_input_report res;
+
+	oc->raw[37] = ns_mcu_crc8(oc->raw + 1, 36);
+	res = ns_exchange(ndev, oc);
+	if (!(res.full.reply.ack & 0x80)) {
+		hid_err(ndev->hdev, "MCU command %02x:%02x rejected\n",
+				oc->raw[0], oc->raw[1]);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Worker Thread */
+static int ircam_configure(nswitch_dev *ndev) {
+	int ret;
+	output_command oc = {
+		BASIC, 0, 0, {}, SET_NFC_IR, {
+			.raw = { MCU_SET_MODE, 0x00, MCU_MODE_IR }
+		}
+	};
+
+	/* Waits for the stream worker to switch to STD_NFCIR */
+	WRITE_ONCE(ndev->ir_active, 1);
+	nd_stream_update(ndev);
+	flush_work(&ndev->stream_worker);
+	ns_exchange(ndev, &(output_command) {
+			BASIC, 0, 0, {}, SET_NFC_IR_STATE, {
+				.raw = { 1 }
+			}
+	});
+
+	ret = ircam_mcu_command(ndev, &oc);
+	if (ret)
+		return ret;
+	/* Leave the MCU some time to switch to IR mode */
+	msleep(50);
+
+	oc = (output_command) {
+		BASIC, 0, 0, {}, SET_NFC_IR, {
+			.raw = {
+				MCU_SET_IR, MCU_IR_CONFIG, MCU_IR_IMAGE_TRANSFER, IR_MAX_FRAG,
+				0x05, 0x00, 0x18, 0x00 /* Minimal MCU firmware: 5.18 */
+			}
+		}
+	};
+	ret = ircam_mcu_command(ndev, &oc);
+	if (ret)
+		return ret;
+
+	/* (page, register, value) triplets */
+	oc = (output_command) {
+		BASIC, 0, 0, {}, SET_NFC_IR, {
+			.raw = {
+				MCU_SET_IR, MCU_IR_WRITE_REGS, 6,
+				0x00, 0x2e, 0x00, /* 320x240 */
+				0x01, 0x30, IR_EXPOSURE & 0xFF,
+				0x01, 0x31, IR_EXPOSURE >> 8,
+				0x01, 0x32, 0x00, /* Manual exposure */
+				0x00, 0x10, 0x00, /* All IR leds on */
+				0x00, 0x07, 0x01  /* Finalize */
+			}
+		}
+	};
+	return ircam_mcu_command(ndev, &oc);
+}
+
+/*
+  The stream worker then restores the report mode the input devices need
+ */
+/* Worker Thread */
+static void ircam_shutdown(nswitch_dev *ndev) {
+	ns_exchange(ndev, &(output_command) {
+			BASIC, 0, 0, {}, SET_NFC_IR_STATE, {
+				.raw = { 0 }
+			}
+	});
+	WRITE_ONCE(ndev->ir_active, 0);
+	nd_stream_update(ndev);
+}
+
+/* Worker Thread */
+static void ircam_ack_worker(struct work_struct *work) {
+	struct nswitch_ircam *ir = container_of(work,
+											struct nswitch_ircam,
+											ack_worker);
+	output_command oc = {
+		MCU_REPORT, 0, 0, {}, (enum subcommand_type)MCU_IR_DATA, {}
+	};
+	unsigned long flags;
+	nswitch_dev *ndev;
+
+	spin_lock_irqsave(&ir->buf_lock, flags);
+	ndev = ir->ndev;
+	if (!ndev || !ir->streaming) {
+		spin_unlock_irqrestore(&ir->buf_lock, flags);
+		return;
+	}
+	if (ir->resend) {
+		oc.raw[1] = 1;
+		oc.raw[2] = ir->resend_frag;
+		ir->resend = 0;
+	} else
+		oc.raw[3] = ir->prev_frag;
+	spin_unlock_irqrestore(&ir->buf_lock, flags);
+
+	oc.raw[36] = ns_mcu_crc8(oc.raw, 36);
+	oc.raw[37] = 0xFF;
+	ns_exchange(ndev, &oc);
+}
+
+static nswitch_ircam_buf *ircam_next_buf(struct nswitch_ircam *ir) {
+	nswitch_ircam_buf *buf;
+
+	if (list_empty(&ir->bufs))
+		return NULL;
+	buf = list_first_entry(&ir->bufs, nswitch_ircam_buf, list);
+	list_del(&buf->list);
+	return buf;
+}
+
+/*
+  Frames are reassembled straight into the next queued vb2 buffer.
+  Frames that find no queued buffer are still acknowledged so the
+  MCU keeps streaming, but are dropped.
+ */
+/* Event Handler */
+void ircam_handle_fragment(nswitch_dev *ndev, ir_mcu_fragment *frag) {
+	struct nswitch_ircam *ir = ndev->ircam;
+	unsigned long flags;
+	__u8 expected;
+	__u8 *dst;
+
+	if (!ir || frag->type != MCU_IR_DATA)
+		return;
+
+	spin_lock_irqsave(&ir->buf_lock, flags);
+	if (!ir->streaming)
+		goto end;
+	++ir->fragments;
+	expected = (ir->prev_frag + 1) % (IR_MAX_FRAG + 1);
+	if (frag->frag == ir->prev_frag) {
+		/* Our ack got lost, repeat it */
+		goto ack;
+	} else if (frag->frag != expected) {
+		ir->dropped += (__u8)(frag->frag - expected);
+		ir->resend = 1;
+		ir->resend_frag = expected;
+		goto ack;
+	}
+
+	if (frag->frag == 0 && !ir->cur)
+		ir->cur = ircam_next_buf(ir);
+	if (ir->cur) {
+		dst = vb2_plane_vaddr(&ir->cur->vb.vb2_buf, 0);
+		memcpy(dst + frag->frag * IR_FRAGMENT_SIZE, frag->data, IR_FRAGMENT_SIZE);
+	}
+	ir->bytes += IR_FRAGMENT_SIZE;
+	ir->prev_frag = frag->frag;
+
+	if (frag->frag == IR_MAX_FRAG) {
+		++ir->frames;
+		if (ir->cur) {
+			ir->cur->vb.vb2_buf.timestamp = ktime_get_ns();
+			ir->cur->vb.sequence = ir->sequence++;
+			ir->cur->vb.field = V4L2_FIELD_NONE;
+			vb2_buffer_done(&ir->cur->vb.vb2_buf, VB2_BUF_STATE_DONE);
+			ir->cur = NULL;
+		}
+	}
+ack:
+	queue_work(nswitch_wq, &ir->ack_worker);
+end:
+	spin_unlock_irqrestore(&ir->buf_lock, flags);
+}
+
+static int ircam_queue_setup(struct vb2_queue *vq,
+							 unsigned int *nbuffers, unsigned int *nplanes,
+							 unsigned int sizes[], struct device *alloc_devs[]) {
+	if (*nplanes)
+		return sizes[0] < IR_WIDTH * IR_HEIGHT ? -EINVAL : 0;
+	*nplanes = 1;
+	sizes[0] = IR_WIDTH * IR_HEIGHT;
+	return 0;
+}
+
+static int ircam_buf_prepare(struct vb2_buffer *vb) {
+	if (vb2_plane_size(vb, 0) < IR_WIDTH * IR_HEIGHT)
+		return -EINVAL;
+	vb2_set_plane_payload(vb, 0, IR_WIDTH * IR_HEIGHT);
+	return 0;
+}
+
+static void ircam_buf_queue(struct vb2_buffer *vb) {
+	struct nswitch_ircam *ir = vb2_get_drv_priv(vb->vb2_queue);
+	nswitch_ircam_buf *buf = container_of(to_vb2_v4l2_buffer(vb),
+										  nswitch_ircam_buf, vb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ir->buf_lock, flags);
+	list_add_tail(&buf->list, &ir->bufs);
+	spin_unlock_irqrestore(&ir->buf_lock, flags);
+}
+
+static void ircam_return_bufs(struct nswitch_ircam *ir,
+							  enum vb2_buffer_state state) {
+	nswitch_ircam_buf *buf;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ir->buf_lock, flags);
+	if (ir->cur) {
+		vb2_buffer_done(&ir->cur->vb.vb2_buf, state);
+		ir->cur = NULL;
+	}
+	while ((buf = ircam_next_buf(ir)))
+		vb2_buffer_done(&buf->vb.vb2_buf, state);
+	spin_unlock_irqrestore(&ir->buf_lock, flags);
+}
+
+/* Called with vb_lock held */
+static int ircam_start_streaming(struct vb2_queue *vq, unsigned int count) {
+	struct nswitch_ircam *ir = vb2_get_drv_priv(vq);
+	nswitch_dev *ndev = ir->ndev;
+	unsigned long flags;
+	int ret;
+
+	if (!ndev) {
+		ret = -ENODEV;
+		goto err;
+	}
+	ret = ircam_configure(ndev);
+	if (ret) {
+		ircam_shutdown(ndev);
+		goto err;
+	}
+
+	spin_lock_irqsave(&ir->buf_lock, flags);
+	ir->sequence = 0;
+	ir->frames = ir->fragments = ir->dropped = ir->bytes = 0;
+	ir->start = ktime_get();
+	ir->resend = 0;
+	/* Acking the last fragment requests the first one */
+	ir->prev_frag = IR_MAX_FRAG;
+	ir->streaming = 1;
+	spin_unlock_irqrestore(&ir->buf_lock, flags);
+	queue_work(nswitch_wq, &ir->ack_worker);
+	hid_info(ndev->hdev, "IR camera streaming");
+	return 0;
+
+err:
+	ircam_return_bufs(ir, VB2_BUF_STATE_QUEUED);
+	return ret;
+}
+
+/* Called with vb_lock held */
+static void ircam_stop_streaming(struct vb2_queue *vq) {
+	struct nswitch_ircam *ir = vb2_get_drv_priv(vq);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ir->buf_lock, flags);
+	ir->streaming = 0;
+	spin_unlock_irqrestore(&ir->buf_lock, flags);
+	cancel_work_sync(&ir->ack_worker);
+
+	if (ir->ndev)
+		ircam_shutdown(ir->ndev);
+	ircam_return_bufs(ir, VB2_BUF_STATE_ERROR);
+}
+
+static const struct vb2_ops ircam_vb2_ops = {
+	.queue_setup = ircam_queue_setup,
+	.buf_prepare = ircam_buf_prepare,
+	.buf_queue = ircam_buf_queue,
+	.start_streaming = ircam_start_streaming,
+	.stop_streaming = ircam_stop_streaming,
+};
+
+static int ircam_querycap(struct file *file, void *priv,
+						  struct v4l2_capability *cap) {
+	struct nswitch_ircam *ir = video_drvdata(file);
+
+	strscpy(cap->driver, "nswitch", sizeof(cap->driver));
+	strscpy(cap->card, "Joy-Con IR camera", sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "hid:%s",
+			 dev_name(ir->v4l2.dev));
+	return 0;
+}
+
+static int ircam_enum_fmt(struct file *file, void *priv,
+						  struct v4l2_fmtdesc *f) {
+	if (f->index)
+		return -EINVAL;
+	f->pixelformat = V4L2_PIX_FMT_GREY;
+	return 0;
+}
+
+static int ircam_fmt(struct file *file, void *priv, struct v4l2_format *f) {
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+
+	pix->width = IR_WIDTH;
+	pix->height = IR_HEIGHT;
+	pix->pixelformat = V4L2_PIX_FMT_GREY;
+	pix->field = V4L2_FIELD_NONE;
+	pix->bytesperline = IR_WIDTH;
+	pix->sizeimage = IR_WIDTH * IR_HEIGHT;
+	pix->colorspace = V4L2_COLORSPACE_RAW;
+	return 0;
+}
+
+static int ircam_enum_input(struct file *file, void *priv,
+							struct v4l2_input *i) {
+	if (i->index)
+		return -EINVAL;
+	i->type = V4L2_INPUT_TYPE_CAMERA;
+	strscpy(i->name, "IR", sizeof(i->name));
+	return 0;
+}
+
+static int ircam_g_input(struct file *file, void *priv, unsigned int *i) {
+	*i = 0;
+	return 0;
+}
+
+static int ircam_s_input(struct file *file, void *priv, unsigned int i) {
+	return i ? -EINVAL : 0;
+}
+
+static const struct v4l2_ioctl_ops ircam_ioctl_ops = {
+	.vidioc_querycap = ircam_querycap,
+	.vidioc_enum_fmt_vid_cap = ircam_enum_fmt,
+	.vidioc_g_fmt_vid_cap = ircam_fmt,
+	.vidioc_s_fmt_vid_cap = ircam_fmt,
+	.vidioc_try_fmt_vid_cap = ircam_fmt,
+	.vidioc_enum_input = ircam_enum_input,
+	.vidioc_g_input = ircam_g_input,
+	.vidioc_s_input = ircam_s_input,
+	.vidioc_reqbufs = vb2_ioctl_reqbufs,
+	.vidioc_create_bufs = vb2_ioctl_create_bufs,
+	.vidioc_prepare_buf = vb2_ioctl_prepare_buf,
+	.vidioc_querybuf = vb2_ioctl_querybuf,
+	.vidioc_qbuf = vb2_ioctl_qbuf,
+	.vidioc_dqbuf = vb2_ioctl_dqbuf,
+	.vidioc_expbuf = vb2_ioctl_expbuf,
+	.vidioc_streamon = vb2_ioctl_streamon,
+	.vidioc_streamoff = vb2_ioctl_streamoff,
+};
+
+static const struct v4l2_file_operations ircam_fops = {
+	.owner = THIS_MODULE,
+	.open = v4l2_fh_open,
+	.release = vb2_fop_release,
+	.read = vb2_fop_read,
+	.poll = vb2_fop_poll,
+	.mmap = vb2_fop_mmap,
+	.unlocked_ioctl = video_ioctl2,
+};
+
+/*
+  The camera may outlive the hid device while userspace holds it open
+ */
+static void ircam_release(struct video_device *vdev) {
+	struct nswitch_ircam *ir = container_of(vdev, struct nswitch_ircam, vdev);
+
+	v4l2_device_unregister(&ir->v4l2);
+	kfree(ir);
+}
+
+static ssize_t ir_stats_show(struct device *dev,
+							 struct device_attribute *attr,
+							 char *buf) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+	struct nswitch_ircam *ir = ndev->ircam;
+	unsigned long flags;
+	__u64 frames, fragments, dropped, bytes;
+	__s64 elapsed;
+
+	spin_lock_irqsave(&ir->buf_lock, flags);
+	frames = ir->frames;
+	fragments = ir->fragments;
+	dropped = ir->dropped;
+	bytes = ir->bytes;
+	elapsed = ir->streaming ? ktime_ms_delta(ktime_get(), ir->start) : 0;
+	spin_unlock_irqrestore(&ir->buf_lock, flags);
+
+	return sprintf(buf, "frames: %llu\nfragments: %llu\n"
+				   "dropped_fragments: %llu\nbytes_per_sec: %llu\n",
+				   frames, fragments, dropped,
+				   elapsed > 0 ? div64_u64(bytes * 1000, elapsed) : 0);
+}
+
+static DEVICE_ATTR(ir_stats, S_IRUGO, ir_stats_show, NULL);
+
+/* Worker Thread */
+int init_ir_cam(nswitch_dev *ndev) {
+	struct nswitch_ircam *ir;
+	int ret;
+
+	ir = kzalloc(sizeof(*ir), GFP_KERNEL);
+	if (!ir)
+		return -ENOMEM;
+
+	ir->ndev = ndev;
+	mutex_init(&ir->vb_lock);
+	spin_lock_init(&ir->buf_lock);
+	INIT_LIST_HEAD(&ir->bufs);
+	INIT_WORK(&ir->ack_worker, ircam_ack_worker);
+
+	ret = v4l2_device_register(&ndev->hdev->dev, &ir->v4l2);
+	if (ret)
+		goto err_free;
+
+	ir->queue.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	ir->queue.io_modes = VB2_MMAP | VB2_READ;
+	ir->queue.drv_priv = ir;
+	ir->queue.buf_struct_size = sizeof(nswitch_ircam_buf);
+	ir->queue.ops = &ircam_vb2_ops;
+	ir->queue.mem_ops = &vb2_vmalloc_memops;
+	ir->queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	ir->queue.lock = &ir->vb_lock;
+	ret = vb2_queue_init(&ir->queue);
+	if (ret)
+		goto err_v4l2;
+
+	strscpy(ir->vdev.name, "Joy-Con IR camera", sizeof(ir->vdev.name));
+	ir->vdev.v4l2_dev = &ir->v4l2;
+	ir->vdev.fops = &ircam_fops;
+	ir->vdev.ioctl_ops = &ircam_ioctl_ops;
+	ir->vdev.release = ircam_release;
+	ir->vdev.lock = &ir->vb_lock;
+	ir->vdev.queue = &ir->queue;
+	ir->vdev.device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING |
+		V4L2_CAP_READWRITE;
+	video_set_drvdata(&ir->vdev, ir);
+
+	ret = video_register_device(&ir->vdev, VFL_TYPE_VIDEO, -1);
+	if (ret)
+		goto err_v4l2;
+
+	ndev->ircam = ir;
+	ret = device_create_file(&ndev->hdev->dev, &dev_attr_ir_stats);
+	if (ret)
+		hid_warn(ndev->hdev, "cannot create IR stats attribute\n");
+	hid_info(ndev->hdev, "IR camera registered as %s\n",
+			 video_device_node_name(&ir->vdev));
+	return 0;
+
+err_v4l2:
+	v4l2_device_unregister(&ir->v4l2);
+err_free:
+	kfree(ir);
+	return ret;
+}
+
+/*
+  Must be called once no more input report can be received
+ */
+/* Event Handler */
+void deinit_ir_cam(nswitch_dev *ndev) {
+	struct nswitch_ircam *ir = ndev->ircam;
+	unsigned long flags;
+
+	device_remove_file(&ndev->hdev->dev, &dev_attr_ir_stats);
+	mutex_lock(&ir->vb_lock);
+	spin_lock_irqsave(&ir->buf_lock, flags);
+	ir->ndev = NULL;
+	spin_unlock_irqrestore(&ir->buf_lock, flags);
+	mutex_unlock(&ir->vb_lock);
+	cancel_work_sync(&ir->ack_worker);
+	/* Stopping the stream may have scheduled it after deinit_stream */
+	cancel_work_sync(&ndev->stream_worker);
+
+	ndev->ircam = NULL;
+	vb2_video_unregister_device(&ir->vdev);
+}
@@ -0,0 +1,635 @@
+#include "hid-nswitch.h"
+
+#include <kunit/test.h>
+
+/*
+  KUnit suite, built with make CONFIG_NSWITCH_KUNIT_TEST=y and run when
+  the module loads on a kernel with CONFIG_KUNIT.
+  Under UML, from a kernel tree with this directory as drivers/hid/nswitch
+  (source its Kconfig from drivers/hid/Kconfig, add obj-y += nswitch/
+  to drivers/hid/Makefile):
+
+	./tools/testing/kunit/kunit.py run --kunitconfig=drivers/hid/nswitch
+
+  Raw reports go through raw_event, then are handled as by the device
+  thread, on devices without hardware whose input device is opened by
+  a test input handler recording every event it gets.
+  nswitch_report_bench prints the cost of the report path, from the
+  raw report to the input events, in ns/report, and
+  nswitch_fusion_bench the cost of ns_fusion_update, in ns/sample.
+ */
+
+#define KUNIT_MAX_EVENTS 64
+#define KUNIT_BENCH_REPORTS 100000
+#define KUNIT_BENCH_SAMPLES 100000
+#define KUNIT_IMU_RATE (NSEC_PER_SEC / NS_IMU_PERIOD_NS) /* Samples/s */
+/* NS_QUAT_ONE * sin(0.5 deg) */
+#define KUNIT_SIN_HALF_DEG 9370046LL
+/* NS_QUAT_ONE * sqrt(2) * sin(1 deg) */
+#define KUNIT_SQRT2_SIN_DEG 26501484
+
+typedef struct {
+	unsigned int type;
+	unsigned int code;
+	int value;
+} nswitch_kunit_event;
+
+typedef struct {
+	nswitch_dev *ndev;
+	nswitch_dev *partner; /* Of ndev in dual mode */
+	struct input_dev *input;
+	__u8 timer;
+	struct input_handler handler;
+	__u8 opened;
+	/* Since the last report fed, without EV_SYN */
+	nswitch_kunit_event events[KUNIT_MAX_EVENTS];
+	int nevents;
+} nswitch_kunit_ctx;
+
+/* Test running, tests do not run concurrently */
+static nswitch_kunit_ctx *kunit_ctx;
+
+static const struct input_device_id nswitch_kunit_ids[] = {
+	{ .driver_info = 1 },
+	{ }
+};
+
+static void nswitch_kunit_input_event(struct input_handle *handle,
+									  unsigned int type, unsigned int code,
+									  int value) {
+	nswitch_kunit_ctx *ctx = handle->private;
+
+	if (type == EV_SYN || ctx->nevents == KUNIT_MAX_EVENTS)
+		return;
+	ctx->events[ctx->nevents].type = type;
+	ctx->events[ctx->nevents].code = code;
+	ctx->events[ctx->nevents++].value = value;
+}
+
+static bool nswitch_kunit_match(struct input_handler *handler,
+								struct input_dev *dev) {
+	return kunit_ctx && dev == kunit_ctx->input;
+}
+
+static int nswitch_kunit_connect(struct input_handler *handler,
+								 struct input_dev *dev,
+								 const struct input_device_id *id) {
+	struct input_handle *handle;
+	int ret;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "nswitch-kunit";
+	handle->private = kunit_ctx;
+	ret = input_register_handle(handle);
+	if (ret)
+		goto err_free;
+	ret = input_open_device(handle);
+	if (ret)
+		goto err_unregister;
+	kunit_ctx->opened = 1;
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return ret;
+}
+
+static void nswitch_kunit_disconnect(struct input_handle *handle) {
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+/*
+  As nswitch_dev_create, without hardware
+ */
+static nswitch_dev *nswitch_kunit_dev(struct kunit *test) {
+	struct hid_device *hdev;
+	nswitch_dev *ndev;
+
+	hdev = kunit_kzalloc(test, sizeof(*hdev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, hdev);
+	ndev = kunit_kzalloc(test, sizeof(*ndev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ndev);
+	strscpy(hdev->name, "nswitch-kunit", sizeof(hdev->name));
+	hid_set_drvdata(hdev, ndev);
+	ndev->hdev = hdev;
+
+	spin_lock_init(&ndev->state_lock);
+	spin_lock_init(&ndev->cmd_lock);
+	mutex_init(&ndev->exchange_lock);
+	init_completion(&ndev->cmd_pending);
+	init_completion(&ndev->state_pending);
+	INIT_LIST_HEAD(&ndev->cmd_queue);
+	INIT_LIST_HEAD(&ndev->poll_entry);
+	ns_default_calibration(&ndev->calibration);
+	ndev->state_calibration = ndev->calibration;
+	ndev->filter_params = (ns_filter_params) NS_FILTER_DEFAULTS;
+	ns_fusion_init(&ndev->fusion);
+	ndev->aim = (ns_aim_params) NS_AIM_DEFAULTS;
+	return ndev;
+}
+
+static int nswitch_kunit_init(struct kunit *test) {
+	nswitch_kunit_ctx *ctx;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+	ctx->ndev = nswitch_kunit_dev(test);
+
+	ctx->handler.event = nswitch_kunit_input_event;
+	ctx->handler.match = nswitch_kunit_match;
+	ctx->handler.connect = nswitch_kunit_connect;
+	ctx->handler.disconnect = nswitch_kunit_disconnect;
+	ctx->handler.name = "nswitch-kunit";
+	ctx->handler.id_table = nswitch_kunit_ids;
+	kunit_ctx = ctx;
+	test->priv = ctx;
+	return input_register_handler(&ctx->handler);
+}
+
+static void nswitch_kunit_exit(struct kunit *test) {
+	nswitch_kunit_ctx *ctx = test->priv;
+
+	if (ctx->input)
+		input_unregister_device(ctx->input);
+	input_unregister_handler(&ctx->handler);
+	kunit_ctx = NULL;
+	/* raw_event may have queued them for a batched wakeup */
+	poll_cancel(ctx->ndev);
+	if (ctx->partner)
+		poll_cancel(ctx->partner);
+}
+
+/*
+  Input device reporting for the device under test, set up by setup,
+  then registered and opened by the test handler
+ */
+static struct input_dev *nswitch_kunit_input(struct kunit *test,
+											 void (*setup)(nswitch_dev *ndev,
+														   struct input_dev *input)) {
+	nswitch_kunit_ctx *ctx = test->priv;
+	struct input_dev *input;
+	int ret;
+
+	input = input_allocate_device();
+	KUNIT_ASSERT_NOT_NULL(test, input);
+	input->name = "nswitch-kunit";
+	input_set_drvdata(input, ctx->ndev);
+	setup(ctx->ndev, input);
+	/* Matched by the test handler */
+	ctx->input = input;
+	ret = input_register_device(input);
+	if (ret) {
+		ctx->input = NULL;
+		input_free_device(input);
+	}
+	KUNIT_ASSERT_EQ(test, ret, 0);
+	KUNIT_ASSERT_TRUE(test, ctx->opened);
+	return input;
+}
+
+/* As prepare_projoypad, without force feedback */
+static void nswitch_kunit_setup_pro(nswitch_dev *ndev, struct input_dev *input) {
+	calibration_data *cd = &ndev->calibration;
+	unsigned int i;
+
+	set_bit(EV_KEY, input->evbit);
+	for (i = 0; i < ARRAY_SIZE(ns_pro_buttons); ++i)
+		if (ns_pro_buttons[i])
+			set_bit(ns_pro_buttons[i], input->keybit);
+	nd_setup_remap_keys(input);
+	set_bit(EV_ABS, input->evbit);
+	set_stick_abs(input, ABS_X, ABS_Y, cd->left_stick);
+	set_stick_abs(input, ABS_RX, ABS_RY, cd->right_stick);
+	input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
+	input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
+}
+
+/* As setup_gamepad, for a left joycon */
+static void nswitch_kunit_setup_gamepad(nswitch_dev *ndev,
+										struct input_dev *input) {
+	unsigned int i;
+
+	set_bit(EV_KEY, input->evbit);
+	for (i = 0; i < ARRAY_SIZE(ns_simple_buttons); ++i)
+		set_bit(ns_simple_buttons[i], input->keybit);
+	nd_setup_remap_keys(input);
+	set_bit(EV_ABS, input->evbit);
+	set_stick_abs(input, ABS_X, ABS_Y, ndev->calibration.left_stick);
+}
+
+/* As setup_dual_joypad */
+static void nswitch_kunit_setup_dual(nswitch_dev *ndev,
+									 struct input_dev *input) {
+	calibration_data *cd = &ndev->calibration;
+	unsigned int i;
+
+	set_bit(EV_KEY, input->evbit);
+	for (i = 0; i < ARRAY_SIZE(ns_buttons); ++i)
+		set_bit(ns_buttons[i], input->keybit);
+	nd_setup_remap_keys(input);
+	set_bit(EV_ABS, input->evbit);
+	set_stick_abs(input, ABS_X, ABS_Y, cd->left_stick);
+	set_stick_abs(input, ABS_RX, ABS_RY, cd->right_stick);
+}
+
+/* As setup_mouse */
+static void nswitch_kunit_setup_mouse(nswitch_dev *ndev,
+									  struct input_dev *input) {
+	set_bit(EV_KEY, input->evbit);
+	set_bit(EV_REL, input->evbit);
+	set_bit(BTN_LEFT, input->keybit);
+	set_bit(BTN_MIDDLE, input->keybit);
+	set_bit(BTN_RIGHT, input->keybit);
+	set_bit(REL_X, input->relbit);
+	set_bit(REL_Y, input->relbit);
+}
+
+/*
+  STANDARD report with buttons, sticks and a device lying still,
+  returns its size
+ */
+static int nswitch_kunit_standard(__u8 *raw, __u8 timer, __u32 buttons,
+								  const __u16 sticks[4]) {
+	nswitch_dev_input_report *rep = (void*)raw;
+	int i;
+
+	memset(rep, 0, sizeof(*rep));
+	rep->input_report = STANDARD;
+	rep->full.timer = timer;
+	raw[3] = buttons;
+	raw[4] = buttons >> 8;
+	raw[5] = buttons >> 16;
+	rep->full.left_stick.x = sticks[0];
+	rep->full.left_stick.y = sticks[1];
+	rep->full.right_stick.x = sticks[2];
+	rep->full.right_stick.y = sticks[3];
+	/* 1g on z, factory sensitivity of 4g */
+	for (i = 0; i < 3; ++i)
+		rep->full.ax6[i][0][2] = NS_ACCEL_RES;
+	return sizeof(*rep);
+}
+
+/*
+  Hands raw to the raw_event of ndev, then handles it as the device
+  thread. Full reports get the next timer value.
+ */
+static void nswitch_kunit_feed_dev(nswitch_kunit_ctx *ctx, nswitch_dev *ndev,
+								   const __u8 *raw, int size) {
+	__u8 buf[sizeof(nswitch_dev_input_report)];
+
+	memcpy(buf, raw, size);
+	if (buf[0] != SIMPLE) {
+		ctx->timer += 3;
+		buf[1] = ctx->timer;
+	}
+	ctx->nevents = 0;
+	nd_kunit_feed(ndev, buf, size);
+}
+
+static void nswitch_kunit_feed(nswitch_kunit_ctx *ctx, const __u8 *raw,
+							   int size) {
+	nswitch_kunit_feed_dev(ctx, ctx->ndev, raw, size);
+}
+
+/*
+  Number of code events of type since the last report, value set to
+  the last one
+ */
+static int nswitch_kunit_find(nswitch_kunit_ctx *ctx, unsigned int type,
+							  unsigned int code, int *value) {
+	int i, n = 0;
+
+	for (i = 0; i < ctx->nevents; ++i) {
+		if (ctx->events[i].type != type || ctx->events[i].code != code)
+			continue;
+		*value = ctx->events[i].value;
+		++n;
+	}
+	return n;
+}
+
+static void nswitch_decode_test(struct kunit *test) {
+	static const __u16 sticks[4] = { 100, 4000, 2048, 1 };
+	__u8 raw[sizeof(nswitch_dev_input_report)];
+	__u8 simple[] = { SIMPLE, 0x02, 0x40, NEUTRAL };
+	ns_frame f;
+	int size;
+
+	size = nswitch_kunit_standard(raw, 7, BIT(NS_BTN_A) | BIT(NS_BTN_ZL), sticks);
+	KUNIT_EXPECT_EQ(test, ns_decode_report(raw, size, &f), 49);
+	KUNIT_EXPECT_EQ(test, (int)f.type, STANDARD);
+	KUNIT_EXPECT_EQ(test, f.timer, 7);
+	KUNIT_EXPECT_EQ(test, f.buttons, BIT(NS_BTN_A) | BIT(NS_BTN_ZL));
+	KUNIT_EXPECT_EQ(test, f.sticks[0], 100);
+	KUNIT_EXPECT_EQ(test, f.sticks[1], 4000);
+	KUNIT_EXPECT_EQ(test, f.sticks[2], 2048);
+	KUNIT_EXPECT_EQ(test, f.sticks[3], 1);
+	KUNIT_EXPECT_TRUE(test, f.has_imu);
+	KUNIT_EXPECT_EQ(test, f.imu[2][2], NS_ACCEL_RES);
+
+	/* Without the IMU samples */
+	KUNIT_EXPECT_EQ(test, ns_decode_report(raw, 13, &f), 13);
+	KUNIT_EXPECT_FALSE(test, f.has_imu);
+	KUNIT_EXPECT_EQ(test, ns_decode_report(raw, 12, &f), 0);
+
+	KUNIT_EXPECT_EQ(test, ns_decode_report(simple, sizeof(simple), &f), 3);
+	KUNIT_EXPECT_EQ(test, (int)f.type, SIMPLE);
+	KUNIT_EXPECT_EQ(test, f.buttons, 0x4002);
+}
+
+static void nswitch_pro_test(struct kunit *test) {
+	nswitch_kunit_ctx *ctx = test->priv;
+	__u16 sticks[4] = { 3048, 2048, 2048, 2048 };
+	__u8 raw[sizeof(nswitch_dev_input_report)];
+	int size, v = 0;
+
+	nswitch_kunit_input(test, nswitch_kunit_setup_pro);
+	ctx->ndev->siminput = ctx->input;
+	atomic_set(&ctx->ndev->mode, NSWITCH_PRO);
+
+	size = nswitch_kunit_standard(raw, 0, BIT(NS_BTN_A) | BIT(NS_BTN_RIGHT),
+								  sticks);
+	nswitch_kunit_feed(ctx, raw, size);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, BTN_A, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_HAT0X, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_X, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 3048);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_RY, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 2048);
+
+	/* Nothing moved */
+	nswitch_kunit_feed(ctx, raw, size);
+	KUNIT_EXPECT_EQ(test, ctx->nevents, 0);
+
+	/* Only the button, the stick jitter is filtered out */
+	sticks[0] += 3;
+	size = nswitch_kunit_standard(raw, 0, BIT(NS_BTN_RIGHT), sticks);
+	nswitch_kunit_feed(ctx, raw, size);
+	KUNIT_EXPECT_EQ(test, ctx->nevents, 1);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, BTN_A, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 0);
+}
+
+static void nswitch_filter_test(struct kunit *test) {
+	nswitch_kunit_ctx *ctx = test->priv;
+	__u16 sticks[4] = { 3048, 2048, 2048, 2048 };
+	__u8 raw[sizeof(nswitch_dev_input_report)];
+	int i, size, v = 0, moves = 0;
+
+	nswitch_kunit_input(test, nswitch_kunit_setup_pro);
+	ctx->ndev->siminput = ctx->input;
+	atomic_set(&ctx->ndev->mode, NSWITCH_PRO);
+	size = nswitch_kunit_standard(raw, 0, 0, sticks);
+	nswitch_kunit_feed(ctx, raw, size);
+
+	/* Resting off center, and near the center */
+	for (i = 0; i < 100; ++i) {
+		sticks[0] = 3048 + (i & 1 ? 3 : -3);
+		sticks[3] = 2048 + (i & 2 ? 10 : -10);
+		size = nswitch_kunit_standard(raw, 0, 0, sticks);
+		nswitch_kunit_feed(ctx, raw, size);
+		moves += ctx->nevents;
+	}
+	KUNIT_EXPECT_EQ(test, moves, 0);
+
+	sticks[0] = 3248;
+	size = nswitch_kunit_standard(raw, 0, 0, sticks);
+	nswitch_kunit_feed(ctx, raw, size);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_X, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 3248);
+	KUNIT_EXPECT_EQ(test, ctx->nevents, 1);
+}
+
+static void nswitch_gamepad_test(struct kunit *test) {
+	nswitch_kunit_ctx *ctx = test->priv;
+	__u16 sticks[4] = { 2048, 1048, 2048, 2048 };
+	__u8 raw[sizeof(nswitch_dev_input_report)];
+	int size, v = 0;
+
+	ctx->ndev->info.type = LEFT_JOYCON;
+	ctx->ndev->pinputs[NSWITCH_GAMEPAD] =
+		nswitch_kunit_input(test, nswitch_kunit_setup_gamepad);
+	ctx->ndev->personalities = BIT(NSWITCH_GAMEPAD);
+	atomic_set(&ctx->ndev->mode, NSWITCH_SINGLE);
+
+	/* Held sideway, down is the first button */
+	size = nswitch_kunit_standard(raw, 0, BIT(NS_BTN_DOWN), sticks);
+	nswitch_kunit_feed(ctx, raw, size);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, ns_simple_buttons[0], &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_Y, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1048);
+	/* The right stick is not this joycon's */
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_RX, &v), 0);
+}
+
+/*
+  Both halves report through the input device of the left one, each
+  with its own buttons and stick, keeping the other half's buttons
+ */
+static void nswitch_dual_test(struct kunit *test) {
+	nswitch_kunit_ctx *ctx = test->priv;
+	nswitch_dev *left = ctx->ndev, *right;
+	__u16 sticks[4] = { 3048, 2048, 1048, 2048 };
+	__u8 raw[sizeof(nswitch_dev_input_report)];
+	int size, v = 0;
+
+	right = ctx->partner = nswitch_kunit_dev(test);
+	left->info.type = LEFT_JOYCON;
+	right->info.type = RIGHT_JOYCON;
+	left->siminput = nswitch_kunit_input(test, nswitch_kunit_setup_dual);
+	/* As nd_link, then setup_dual_joypad */
+	rcu_assign_pointer(left->right, right);
+	rcu_assign_pointer(right->right, left);
+	atomic_set(&left->mode, NSWITCH_DUAL_LEFT);
+	atomic_set(&right->mode, NSWITCH_DUAL_RIGHT);
+
+	size = nswitch_kunit_standard(raw, 0, BIT(NS_BTN_L), sticks);
+	nswitch_kunit_feed_dev(ctx, left, raw, size);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, BTN_TL, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_X, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 3048);
+	/* The right stick is the right half's */
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_RX, &v), 0);
+
+	size = nswitch_kunit_standard(raw, 0, BIT(NS_BTN_A), sticks);
+	nswitch_kunit_feed_dev(ctx, right, raw, size);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, BTN_A, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_RX, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1048);
+	/* L is still held, the left stick is not the right half's */
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, BTN_TL, &v), 0);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_X, &v), 0);
+
+	size = nswitch_kunit_standard(raw, 0, 0, sticks);
+	nswitch_kunit_feed_dev(ctx, left, raw, size);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, BTN_TL, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 0);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, BTN_A, &v), 0);
+}
+
+/*
+  The left joycon mouse moves with the gyroscope while ZL is held
+ */
+static void nswitch_mouse_test(struct kunit *test) {
+	nswitch_kunit_ctx *ctx = test->priv;
+	nswitch_dev_input_report *rep;
+	__u16 sticks[4] = { 2048, 2048, 2048, 2048 };
+	__u8 raw[sizeof(nswitch_dev_input_report)];
+	int i, size, v = 0;
+
+	ctx->ndev->info.type = LEFT_JOYCON;
+	ctx->ndev->pinputs[NSWITCH_MOUSE] =
+		nswitch_kunit_input(test, nswitch_kunit_setup_mouse);
+	ctx->ndev->personalities = BIT(NSWITCH_MOUSE);
+	atomic_set(&ctx->ndev->mode, NSWITCH_SINGLE);
+
+	/* Turning, about 14 deg/s on z and -7 deg/s on y */
+	size = nswitch_kunit_standard(raw, 0, BIT(NS_BTN_RIGHT), sticks);
+	rep = (void*)raw;
+	for (i = 0; i < 3; ++i) {
+		rep->full.ax6[i][1][1] = -100;
+		rep->full.ax6[i][1][2] = 200;
+	}
+	nswitch_kunit_feed(ctx, raw, size);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_KEY, BTN_LEFT, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_REL, REL_X, &v), 0);
+
+	/* ZL held too */
+	raw[5] |= BIT(NS_BTN_ZL - 16);
+	nswitch_kunit_feed(ctx, raw, size);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_REL, REL_X, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 10);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_REL, REL_Y, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 5);
+}
+
+/*
+  A half of a dual joypad only accounts for its own stick
+ */
+static void nswitch_dual_sticks_test(struct kunit *test) {
+	static const int codes[4] = { ABS_X, ABS_Y, ABS_RX, ABS_RY };
+	nswitch_kunit_ctx *ctx = test->priv;
+	__u16 sticks[4] = { 3048, 2048, 1048, 2048 };
+	int v = 0;
+
+	nswitch_kunit_input(test, nswitch_kunit_setup_pro);
+	nd_report_sticks(ctx->ndev, NSWITCH_REMAP_DUAL, ctx->input, codes, sticks,
+					 0xc, 0x4);
+	input_sync(ctx->input);
+	KUNIT_EXPECT_EQ(test, nswitch_kunit_find(ctx, EV_ABS, ABS_RX, &v), 1);
+	KUNIT_EXPECT_EQ(test, v, 1048);
+	KUNIT_EXPECT_EQ(test, ctx->nevents, 1);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&ctx->ndev->stick_events), 1);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&ctx->ndev->stick_suppressed), 1);
+}
+
+/*
+  Pro controller reports alternating between two states, every one of
+  them moving a stick and a button
+ */
+static void nswitch_report_bench(struct kunit *test) {
+	nswitch_kunit_ctx *ctx = test->priv;
+	__u8 raw[2][sizeof(nswitch_dev_input_report)];
+	__u16 sticks[4] = { 2048, 2048, 2048, 2048 };
+	__u64 start, elapsed;
+	int i, size;
+
+	nswitch_kunit_input(test, nswitch_kunit_setup_pro);
+	ctx->ndev->siminput = ctx->input;
+	atomic_set(&ctx->ndev->mode, NSWITCH_PRO);
+	size = nswitch_kunit_standard(raw[0], 0, 0, sticks);
+	sticks[0] = 3048;
+	sticks[2] = 1048;
+	nswitch_kunit_standard(raw[1], 0, BIT(NS_BTN_A), sticks);
+
+	start = ktime_get_ns();
+	for (i = 0; i < KUNIT_BENCH_REPORTS; ++i)
+		nswitch_kunit_feed(ctx, raw[i & 1], size);
+	elapsed = ktime_get_ns() - start;
+	KUNIT_EXPECT_EQ(test, ctx->nevents, 3);
+	kunit_info(test, "%llu ns/report\n", div_u64(elapsed, KUNIT_BENCH_REPORTS));
+}
+
+/*
+  6 s still, then 1 s at 90 deg/s around z: the heading must be 90 deg
+  within 2, the tilt under 1 deg
+ */
+static void nswitch_fusion_test(struct kunit *test) {
+	__s32 imu[6] = { 0, 0, NS_ACCEL_RES, 0, 0, 0 };
+	__s32 *q;
+	ns_fusion fu;
+	__u64 t = 0;
+	int i;
+
+	ns_fusion_init(&fu);
+	for (i = 0; i < 7 * KUNIT_IMU_RATE; ++i) {
+		imu[5] = i >= 6 * KUNIT_IMU_RATE ? 90 * NS_GYRO_RES : 0;
+		t += NS_IMU_PERIOD_NS;
+		ns_fusion_update(&fu, imu, t);
+	}
+	q = fu.q;
+	/* Around z only, q is (cos(h / 2), 0, 0, sin(h / 2)) */
+	KUNIT_EXPECT_GT(test, q[0], 0);
+	KUNIT_EXPECT_GT(test, q[3], 0);
+	KUNIT_EXPECT_LT(test, abs(q[3] - q[0]), KUNIT_SQRT2_SIN_DEG);
+	/* x^2 + y^2 is sin(tilt / 2)^2 */
+	KUNIT_EXPECT_LT(test, (__s64)q[1] * q[1] + (__s64)q[2] * q[2],
+					KUNIT_SIN_HALF_DEG * KUNIT_SIN_HALF_DEG);
+}
+
+/*
+  A device turning on every axis, with gravity off the accelerometer
+  axes so that the correction runs
+ */
+static void nswitch_fusion_bench(struct kunit *test) {
+	__s32 imu[6] = { 1000, -2000, 3000, 30000, -20000, 10000 };
+	ns_fusion fu;
+	__u64 start, elapsed, t = 0;
+	int i;
+
+	ns_fusion_init(&fu);
+	start = ktime_get_ns();
+	for (i = 0; i < KUNIT_BENCH_SAMPLES; ++i) {
+		t += NS_IMU_PERIOD_NS;
+		ns_fusion_update(&fu, imu, t);
+	}
+	elapsed = ktime_get_ns() - start;
+	KUNIT_EXPECT_NE(test, fu.q[0] | fu.q[1] | fu.q[2] | fu.q[3], 0);
+	kunit_info(test, "%llu ns/sample\n", div_u64(elapsed, KUNIT_BENCH_SAMPLES));
+}
+
+static struct kunit_case nswitch_kunit_cases[] = {
+	KUNIT_CASE(nswitch_decode_test),
+	KUNIT_CASE(nswitch_pro_test),
+	KUNIT_CASE(nswitch_filter_test),
+	KUNIT_CASE(nswitch_gamepad_test),
+	KUNIT_CASE(nswitch_dual_test),
+	KUNIT_CASE(nswitch_dual_sticks_test),
+	KUNIT_CASE(nswitch_mouse_test),
+	KUNIT_CASE(nswitch_report_bench),
+	KUNIT_CASE(nswitch_fusion_test),
+	KUNIT_CASE(nswitch_fusion_bench),
+	{ }
+};
+
+static struct kunit_suite nswitch_kunit_suite = {
+	.name = "nswitch",
+	.init = nswitch_kunit_init,
+	.exit = nswitch_kunit_exit,
+	.test_cases = nswitch_kunit_cases
+};
+kunit_test_suite(nswitch_kunit_suite);
@@ -0,0 +1,283 @@
+#include "hid-nswitch.h"
+
+#include <linux/rcupdate.h>
+
+/*
+  Per device state machine, selecting the handler of its reports.
+  The device thread only loads the mode and calls the handler from
+  nswitch_mode_handlers.
+  Modes only change through nd_set_mode, which fails when another
+  context changed the mode first, so each transition happens once.
+
+  Pairing two joycons touches both devices, from either thread or
+  from the removal of one of them. pair_lock serializes it: partners
+  are linked, confirmed and split with it held, so a partner found
+  with it held stays alive until it is released.
+  The dual handlers read the partner under RCU, and nd_unpair waits
+  for them before returning.
+
+  Full reports and the IMU are only enabled while an input device of
+  the personality is opened: the device otherwise stays in SIMPLE
+  mode, only reporting button changes. The IR camera needs STD_NFCIR
+  reports whatever the mode. Opening or closing an input device,
+  changing the mode or starting the IR camera schedules the stream
+  worker of the devices reporting through it, which alone sends the
+  report mode commands.
+ */
+
+DEFINE_MUTEX(pair_lock);
+
+static const char *const nswitch_mode_names[NSWITCH_MODES] = {
+	"unconfigured", "selecting", "validating simple", "validating dual",
+	"single", "dual left", "dual right", "pro"
+};
+
+/* Event Handler */
+static void nswitch_idle(nswitch_dev *ndev) {
+}
+
+/* Event Handler */
+static void nswitch_select(nswitch_dev *ndev) {
+	if (ndev->info.type == PRO_CONTROLLER)
+		projc_prepare(ndev);
+	else
+		simplejc_prepare(ndev);
+}
+
+const update_fun_t nswitch_mode_handlers[NSWITCH_MODES] = {
+	[NSWITCH_UNCONFIGURED] = nswitch_idle,
+	[NSWITCH_SELECTING] = nswitch_select,
+	[NSWITCH_VALIDATING_SIMPLE] = validate_simple,
+	[NSWITCH_VALIDATING_DUAL] = validate_dual,
+	[NSWITCH_SINGLE] = report_single,
+	[NSWITCH_DUAL_LEFT] = report_dual_left,
+	[NSWITCH_DUAL_RIGHT] = report_dual_right,
+	[NSWITCH_PRO] = report_pro
+};
+
+/*
+  Returns 0 when ndev was not in mode from anymore
+ */
+int nd_set_mode(nswitch_dev *ndev, enum nswitch_mode from,
+				enum nswitch_mode to) {
+	if (atomic_cmpxchg(&ndev->mode, from, to) != from)
+		return 0;
+	hid_info(ndev->hdev, "Mode %s -> %s",
+			 nswitch_mode_names[from], nswitch_mode_names[to]);
+	return 1;
+}
+
+/*
+  Requires pair_lock.
+  Links two selecting joycons, both then validate the dual mode.
+  Returns 0 when either was not selecting anymore.
+ */
+int nd_link(nswitch_dev *left, nswitch_dev *right) {
+	/* A selecting joycon has no partner, only pair_lock holders give one */
+	rcu_assign_pointer(right->right, left);
+	rcu_assign_pointer(left->right, right);
+	if (!nd_set_mode(right, NSWITCH_SELECTING, NSWITCH_VALIDATING_DUAL))
+		goto undo;
+	if (!nd_set_mode(left, NSWITCH_SELECTING, NSWITCH_VALIDATING_DUAL)) {
+		nd_set_mode(right, NSWITCH_VALIDATING_DUAL, NSWITCH_SELECTING);
+		goto undo;
+	}
+	return 1;
+
+undo:
+	RCU_INIT_POINTER(right->right, NULL);
+	RCU_INIT_POINTER(left->right, NULL);
+	return 0;
+}
+
+/*
+  Pairs a selecting left joycon with a selecting right joycon holding
+  R or ZR, both then validate the dual mode.
+  Returns the right joycon, or NULL when there is none.
+ */
+/* Worker Thread */
+nswitch_dev *nd_pair(nswitch_dev *left) {
+	nswitch_dev *right = NULL;
+	unsigned long flags;
+	nswitch_list *nl;
+
+	mutex_lock(&pair_lock);
+	spin_lock_irqsave(&global_lock, flags);
+	list_for_each_entry(nl, &rjoycons, list) {
+		if (atomic_read(&nl->ndev->mode) == NSWITCH_SELECTING &&
+			nl->ndev->frame.type == SIMPLE &&
+			(nl->ndev->state.simple.lr || nl->ndev->state.simple.z)) {
+			right = nl->ndev;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&global_lock, flags);
+	if (right && !nd_link(left, right))
+		right = NULL;
+	mutex_unlock(&pair_lock);
+	return right;
+}
+
+/*
+  Requires pair_lock.
+  Splits ndev from its partner, both go back to selecting, in simple
+  report mode.
+  Once it returns, the partner handlers no longer use ndev.
+ */
+/* Worker Thread */
+void nd_unlink(nswitch_dev *ndev) {
+	nswitch_dev *partner;
+
+	partner = rcu_dereference_protected(ndev->right,
+										lockdep_is_held(&pair_lock));
+	if (!partner)
+		return;
+	RCU_INIT_POINTER(partner->right, NULL);
+	RCU_INIT_POINTER(ndev->right, NULL);
+	/* Pair modes only change with pair_lock held */
+	atomic_set(&partner->mode, NSWITCH_SELECTING);
+	atomic_set(&ndev->mode, NSWITCH_SELECTING);
+	synchronize_rcu();
+	hid_info(ndev->hdev, "Unpaired from %s", partner->hdev->name);
+
+	nd_stream_update(partner);
+	nd_stream_update(ndev);
+}
+
+/* Worker Thread */
+void nd_unpair(nswitch_dev *ndev) {
+	mutex_lock(&pair_lock);
+	nd_unlink(ndev);
+	mutex_unlock(&pair_lock);
+}
+
+/*
+  Whether the input device ndev reports through is opened.
+  Selection needs the SIMPLE reports.
+ */
+static int nd_wants_streaming(nswitch_dev *ndev) {
+	nswitch_dev *left;
+	int ret;
+
+	switch (atomic_read(&ndev->mode)) {
+	case NSWITCH_SINGLE:
+	case NSWITCH_DUAL_LEFT:
+	case NSWITCH_PRO:
+		return atomic_read(&ndev->users) > 0;
+	case NSWITCH_DUAL_RIGHT:
+		rcu_read_lock();
+		left = rcu_dereference(ndev->right);
+		ret = left && atomic_read(&left->users) > 0;
+		rcu_read_unlock();
+		return ret;
+	default:
+		return 0;
+	}
+}
+
+/*
+  Input report mode ndev needs
+ */
+static enum input_report_type nd_wanted_report_mode(nswitch_dev *ndev) {
+	if (READ_ONCE(ndev->ir_active))
+		return STD_NFCIR;
+	return nd_wants_streaming(ndev) ? STANDARD : SIMPLE;
+}
+
+/*
+  Also follows wants_imu while streaming, personalities toggle it
+ */
+/* Worker Thread */
+static void nswitch_stream_worker(struct work_struct *work) {
+	nswitch_dev *ndev = container_of(work, nswitch_dev, stream_worker);
+	enum input_report_type mode;
+	__u8 imu;
+
+	while (!ndev->deinit) {
+		mode = nd_wanted_report_mode(ndev);
+		imu = nd_wants_streaming(ndev) && READ_ONCE(ndev->wants_imu);
+		if (mode == ndev->report_mode && imu == ndev->imu_on)
+			break;
+		if (imu && !ndev->imu_on) {
+			ns_exchange(ndev, &(output_command) {
+					BASIC, 0, 0, {}, SET_IMU, {
+						.imu_state = 1
+			}});
+			ndev->imu_on = 1;
+		}
+		if (mode != ndev->report_mode) {
+			ns_exchange(ndev, &(output_command) {
+					BASIC, 0, 0, {}, SET_INPUT_REPORT_MODE, {
+						.mode = mode
+			}});
+			ndev->report_mode = mode;
+			hid_info(ndev->hdev, "Input report mode %02x", mode);
+		}
+		if (!imu && ndev->imu_on) {
+			ns_exchange(ndev, &(output_command) {
+					BASIC, 0, 0, {}, SET_IMU, {
+						.imu_state = 0
+			}});
+			ndev->imu_on = 0;
+		}
+	}
+}
+
+/*
+  Safe from any context
+ */
+void nd_stream_update(nswitch_dev *ndev) {
+	queue_work(nswitch_wq, &ndev->stream_worker);
+}
+
+/*
+  Updates ndev and its partner, reporting through the same input device
+ */
+static void nd_stream_update_pair(nswitch_dev *ndev) {
+	nswitch_dev *partner;
+
+	nd_stream_update(ndev);
+	rcu_read_lock();
+	partner = rcu_dereference(ndev->right);
+	if (partner)
+		nd_stream_update(partner);
+	rcu_read_unlock();
+}
+
+/*
+  Open and close callbacks of the input devices of all the
+  personalities. In dual mode, the left joycon owns the input device.
+ */
+/* Worker Thread */
+int nd_input_open(struct input_dev *input) {
+	nswitch_dev *ndev = input_get_drvdata(input);
+
+	atomic_inc(&ndev->users);
+	nd_stream_update_pair(ndev);
+	return 0;
+}
+
+/* Worker Thread */
+void nd_input_close(struct input_dev *input) {
+	nswitch_dev *ndev = input_get_drvdata(input);
+
+	atomic_dec(&ndev->users);
+	nd_stream_update_pair(ndev);
+}
+
+/* Event Handler */
+void init_stream(nswitch_dev *ndev) {
+	atomic_set(&ndev->users, 0);
+	/* Until the device is told otherwise */
+	ndev->report_mode = SIMPLE;
+	INIT_WORK(&ndev->stream_worker, nswitch_stream_worker);
+}
+
+/*
+  Must be called once the input devices are unregistered, and the
+  partner split
+ */
+/* Event Handler */
+void deinit_stream(nswitch_dev *ndev) {
+	cancel_work_sync(&ndev->stream_worker);
+}
@@ -0,0 +1,422 @@
+#include "hid-nswitch.h"
+
+/*
+  Personalities of a single joycon.
+  Each report is decoded once into ndev->frame, which is handed to
+  every enabled personality: a joypad, a gyro mouse, motion sensors
+  and a keyboard, any number of them at once.
+  They are enabled by the selection buttons (joypad or mouse), then
+  through the personalities sysfs attribute at any time, for example:
+
+	echo "gamepad motion" > /sys/bus/hid/devices/<device>/personalities
+
+  Writing "none" gives the joycon back to selection.
+  The input device of a personality is registered when it is first
+  enabled and kept until the joycon goes away, disabling it only stops
+  its reports.
+  Personalities change with pair_lock held, like pair modes: a joycon
+  is either single with its personalities, or half of a pair.
+ */
+
+/*
+  Orientation axes of the motion sensors: ABS_THROTTLE, ABS_RUDDER,
+  ABS_WHEEL and ABS_GAS for the quaternion w, x, y and z
+ */
+#define MOTION_QUAT_ABS ABS_THROTTLE
+#define MOTION_QUAT_SHIFT 14
+#define MOTION_QUAT_ONE (1 << MOTION_QUAT_SHIFT)
+
+/* Gyroscope speed per mouse unit, 1.4 deg/s */
+#define MOUSE_GYRO_SCALE (1400 * NS_GYRO_RES / 1000)
+
+/* Calibrated stick deflection that presses an arrow key */
+#define KEYBOARD_STICK_THRESHOLD 16384
+
+typedef struct {
+	const char *name;
+	const char *kind; /* Appended to the device name */
+	__u8 imu; /* Needs the IMU enabled */
+	void (*setup)(nswitch_dev *ndev, struct input_dev *input);
+	void (*report)(nswitch_dev *ndev, struct input_dev *input,
+				   const ns_frame *f);
+} nswitch_personality_ops;
+
+/*
+  Keys of the buttons of a joycon held sideway, in ns_simple_buttons order
+ */
+const short ns_keyboard_keys[11] = {
+	KEY_ENTER, KEY_SPACE, KEY_ESC, KEY_BACKSPACE,
+	KEY_LEFTSHIFT, KEY_LEFTCTRL,
+	KEY_TAB, KEY_LEFTALT,
+	KEY_PAGEUP, KEY_PAGEDOWN,
+	KEY_HOME
+};
+
+static const int gamepad_sticks[2] = { ABS_X, ABS_Y };
+
+/* Event Handler */
+struct input_dev *nd_alloc_input(nswitch_dev *ndev, const char *kind) {
+	struct input_dev *input;
+
+	input = input_allocate_device();
+	if (!input)
+		return NULL;
+	input_set_drvdata(input, ndev);
+	input->dev.parent = &ndev->hdev->dev;
+	input->id.bustype = ndev->hdev->bus;
+	input->id.vendor = ndev->hdev->vendor;
+	input->id.product = ndev->hdev->product;
+	input->id.version = ndev->hdev->version;
+	input->name = kasprintf(GFP_KERNEL, "%s %s", ndev->hdev->name, kind);
+	input->open = nd_input_open;
+	input->close = nd_input_close;
+	return input;
+}
+
+/* Event Handler */
+void nd_setup_motion(struct input_dev *input) {
+	int i;
+
+	set_bit(INPUT_PROP_ACCELEROMETER, input->propbit);
+	set_bit(EV_ABS, input->evbit);
+	/* 8g and 2000 deg/s at the default sensitivities */
+	for (i = 0; i < 3; ++i) {
+		input_set_abs_params(input, ABS_X + i, -8 * NS_ACCEL_RES,
+							 8 * NS_ACCEL_RES, 0, 0);
+		input_abs_set_res(input, ABS_X + i, NS_ACCEL_RES);
+		input_set_abs_params(input, ABS_RX + i, -2000 * NS_GYRO_RES,
+							 2000 * NS_GYRO_RES, 0, 0);
+		input_abs_set_res(input, ABS_RX + i, NS_GYRO_RES);
+	}
+	/* Orientation quaternion, w x y z */
+	for (i = 0; i < 4; ++i)
+		input_set_abs_params(input, MOTION_QUAT_ABS + i, -MOTION_QUAT_ONE,
+							 MOTION_QUAT_ONE, 0, 0);
+}
+
+/*
+  Reports the 3 IMU samples of the report and their orientation, each
+  at its own time
+ */
+/* Event Handler */
+void nd_report_motion(nswitch_dev *ndev, struct input_dev *input,
+					  const ns_frame *f) {
+	int i, j;
+
+	if (!f->has_imu)
+		return;
+	for (i = 0; i < 3; ++i) {
+		for (j = 0; j < 3; ++j) {
+			input_report_abs(input, ABS_X + j, ndev->imu[i][j]);
+			input_report_abs(input, ABS_RX + j, ndev->imu[i][3 + j]);
+		}
+		for (j = 0; j < 4; ++j)
+			input_report_abs(input, MOTION_QUAT_ABS + j,
+							 ndev->quat[i][j] >> (NS_QUAT_SHIFT - MOTION_QUAT_SHIFT));
+		input_set_timestamp(input, ns_to_ktime(ndev->imu_time[i]));
+		input_sync(input);
+	}
+}
+
+/*
+  Index in ns_frame sticks of the x axis of the joycon stick
+ */
+static int single_stick(nswitch_dev *ndev) {
+	return ndev->info.type == LEFT_JOYCON ? 0 : 2;
+}
+
+/* Event Handler */
+static void setup_gamepad(nswitch_dev *ndev, struct input_dev *input) {
+	calibration_data *cd = &ndev->calibration;
+	unsigned int i;
+
+	set_bit(EV_KEY, input->evbit);
+	for (i = 0; i < ARRAY_SIZE(ns_simple_buttons); ++i)
+		set_bit(ns_simple_buttons[i], input->keybit);
+	nd_setup_remap_keys(input);
+
+	set_bit(EV_ABS, input->evbit);
+	if (ndev->info.type == LEFT_JOYCON)
+		set_stick_abs(input, ABS_X, ABS_Y, cd->left_stick);
+	else
+		set_stick_abs(input, ABS_X, ABS_Y, cd->right_stick);
+}
+
+/* Event Handler */
+static void report_gamepad(nswitch_dev *ndev, struct input_dev *input,
+						   const ns_frame *f) {
+	__u16 mask = ns_simple_button_mask(ndev->info.type, f->buttons);
+
+	nd_report_keys(ndev, NSWITCH_REMAP_GAMEPAD, input, mask);
+	nd_report_sticks(ndev, NSWITCH_REMAP_GAMEPAD, input, gamepad_sticks,
+					 f->sticks + single_stick(ndev), 0x3,
+					 ndev->sticks_changed >> single_stick(ndev));
+	input_set_timestamp(input, ns_to_ktime(ndev->state_time));
+	input_sync(input);
+}
+
+/* Event Handler */
+static void setup_mouse(nswitch_dev *ndev, struct input_dev *input) {
+	set_bit(INPUT_PROP_POINTER, input->propbit);
+
+	set_bit(EV_KEY, input->evbit);
+	set_bit(EV_REL, input->evbit);
+
+	set_bit(BTN_LEFT, input->keybit);
+	set_bit(BTN_MIDDLE, input->keybit);
+	set_bit(BTN_RIGHT, input->keybit);
+	set_bit(REL_X, input->relbit);
+	set_bit(REL_Y, input->relbit);
+}
+
+/*
+  Moves while ZL or ZR is held
+ */
+/* Event Handler */
+static void report_mouse(nswitch_dev *ndev, struct input_dev *input,
+						 const ns_frame *f) {
+	__u8 report_rel;
+
+	if (ndev->info.type == LEFT_JOYCON) {
+		input_report_key(input, BTN_LEFT, ns_button(f, NS_BTN_RIGHT));
+		input_report_key(input, BTN_MIDDLE, ns_button(f, NS_BTN_UP));
+		input_report_key(input, BTN_RIGHT, ns_button(f, NS_BTN_DOWN));
+		report_rel = ns_button(f, NS_BTN_ZL);
+	} else {
+		input_report_key(input, BTN_LEFT, ns_button(f, NS_BTN_A));
+		input_report_key(input, BTN_MIDDLE, ns_button(f, NS_BTN_Y));
+		input_report_key(input, BTN_RIGHT, ns_button(f, NS_BTN_B));
+		report_rel = ns_button(f, NS_BTN_ZR);
+	}
+
+	if (report_rel && f->has_imu) {
+		input_report_rel(input, REL_X, ndev->imu[0][5] / MOUSE_GYRO_SCALE);
+		input_report_rel(input, REL_Y, -(ndev->imu[0][4] / MOUSE_GYRO_SCALE));
+	}
+	/* Moves from the first IMU sample */
+	input_set_timestamp(input, ns_to_ktime(f->has_imu ? ndev->imu_time[0] :
+										   ndev->state_time));
+	input_sync(input);
+}
+
+/* Event Handler */
+static void setup_motion(nswitch_dev *ndev, struct input_dev *input) {
+	nd_setup_motion(input);
+}
+
+/* Event Handler */
+static void setup_keyboard(nswitch_dev *ndev, struct input_dev *input) {
+	unsigned int i;
+
+	set_bit(EV_KEY, input->evbit);
+	set_bit(EV_REP, input->evbit);
+	for (i = 0; i < ARRAY_SIZE(ns_keyboard_keys); ++i)
+		set_bit(ns_keyboard_keys[i], input->keybit);
+	set_bit(KEY_UP, input->keybit);
+	set_bit(KEY_DOWN, input->keybit);
+	set_bit(KEY_LEFT, input->keybit);
+	set_bit(KEY_RIGHT, input->keybit);
+	nd_setup_remap_keys(input);
+}
+
+/*
+  Buttons as keys, the stick as arrows
+ */
+/* Event Handler */
+static void report_keyboard(nswitch_dev *ndev, struct input_dev *input,
+							const ns_frame *f) {
+	__u16 mask = ns_simple_button_mask(ndev->info.type, f->buttons);
+	int x = single_stick(ndev);
+	__s16 s[4];
+
+	nd_report_keys(ndev, NSWITCH_REMAP_KEYBOARD, input, mask);
+	ns_calibrate_sticks(&ndev->calibration, f, s);
+	input_report_key(input, KEY_RIGHT, s[x] > KEYBOARD_STICK_THRESHOLD);
+	input_report_key(input, KEY_LEFT, s[x] < -KEYBOARD_STICK_THRESHOLD);
+	input_report_key(input, KEY_UP, s[x + 1] > KEYBOARD_STICK_THRESHOLD);
+	input_report_key(input, KEY_DOWN, s[x + 1] < -KEYBOARD_STICK_THRESHOLD);
+	input_set_timestamp(input, ns_to_ktime(ndev->state_time));
+	input_sync(input);
+}
+
+static const nswitch_personality_ops nswitch_personalities[NSWITCH_PERSONALITIES] = {
+	[NSWITCH_GAMEPAD] = {
+		"gamepad", "Simple Emulated Joypad", 0, setup_gamepad, report_gamepad
+	},
+	[NSWITCH_MOUSE] = {
+		"mouse", "Simple Emulated Mouse", 1, setup_mouse, report_mouse
+	},
+	[NSWITCH_MOTION] = {
+		"motion", "Motion Sensors", 1, setup_motion, nd_report_motion
+	},
+	[NSWITCH_KEYBOARD] = {
+		"keyboard", "Keyboard", 0, setup_keyboard, report_keyboard
+	}
+};
+
+/*
+  Hands the report to every enabled personality
+ */
+/* Event Handler */
+void report_single(nswitch_dev *ndev) {
+	const ns_frame *f = &ndev->frame;
+	unsigned long mask;
+	int i;
+
+	switch (f->type) {
+	case STANDARD:
+	case STD_NFCIR:
+	case STD_UNKNOWN0:
+	case STD_UNKNOWN1:
+		break;
+	default:
+		return;
+	}
+
+	mask = READ_ONCE(ndev->personalities);
+	/* Pairs with nd_set_personalities */
+	smp_rmb();
+	for_each_set_bit(i, &mask, NSWITCH_PERSONALITIES)
+		nswitch_personalities[i].report(ndev, ndev->pinputs[i], f);
+}
+
+/*
+  Requires pair_lock
+ */
+static int nd_enable_personality(nswitch_dev *ndev, int p) {
+	struct input_dev *input;
+	int ret;
+
+	if (ndev->pinputs[p])
+		return 0;
+	input = nd_alloc_input(ndev, nswitch_personalities[p].kind);
+	if (!input)
+		return -ENOMEM;
+	nswitch_personalities[p].setup(ndev, input);
+	ret = input_register_device(input);
+	if (ret) {
+		input_free_device(input);
+		return ret;
+	}
+	ndev->pinputs[p] = input;
+	hid_info(ndev->hdev, "Personality %s registered", nswitch_personalities[p].name);
+	return 0;
+}
+
+/*
+  Requires pair_lock.
+  Makes ndev a single joycon reporting through the personalities of
+  mask, or gives it back to selection when mask is empty.
+  Returns -EBUSY when ndev is not a joycon being selected or single.
+ */
+int nd_set_personalities(nswitch_dev *ndev, unsigned long mask) {
+	enum nswitch_mode mode = atomic_read(&ndev->mode);
+	__u8 imu = 0;
+	int i, ret;
+
+	switch (mode) {
+	case NSWITCH_SELECTING:
+	case NSWITCH_VALIDATING_SIMPLE:
+	case NSWITCH_SINGLE:
+		break;
+	default:
+		return -EBUSY;
+	}
+	if (ndev->info.type != LEFT_JOYCON && ndev->info.type != RIGHT_JOYCON)
+		return -EBUSY;
+
+	for_each_set_bit(i, &mask, NSWITCH_PERSONALITIES) {
+		ret = nd_enable_personality(ndev, i);
+		if (ret)
+			return ret;
+		imu |= nswitch_personalities[i].imu;
+	}
+	WRITE_ONCE(ndev->wants_imu, imu);
+	/* Publishes the input devices before the thread reports through them */
+	smp_wmb();
+	WRITE_ONCE(ndev->personalities, mask);
+
+	if (mask && mode != NSWITCH_SINGLE &&
+		!nd_set_mode(ndev, mode, NSWITCH_SINGLE))
+		return -EBUSY;
+	if (!mask && mode == NSWITCH_SINGLE)
+		nd_set_mode(ndev, NSWITCH_SINGLE, NSWITCH_SELECTING);
+	/* Full reports once opened */
+	nd_stream_update(ndev);
+	return 0;
+}
+
+static ssize_t personalities_show(struct device *dev,
+								  struct device_attribute *attr,
+								  char *buf) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+	unsigned long mask = READ_ONCE(ndev->personalities);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < NSWITCH_PERSONALITIES; ++i)
+		len += sprintf(buf + len, test_bit(i, &mask) ? "[%s] " : "%s ",
+					   nswitch_personalities[i].name);
+	buf[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t personalities_store(struct device *dev,
+								   struct device_attribute *attr,
+								   const char *buf, size_t count) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(dev));
+	unsigned long mask = 0;
+	char *copy, *s, *name;
+	int i, ret = 0;
+
+	copy = kstrndup(buf, count, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+	s = copy;
+	while ((name = strsep(&s, " \t\n"))) {
+		if (!*name || !strcmp(name, "none"))
+			continue;
+		for (i = 0; i < NSWITCH_PERSONALITIES; ++i)
+			if (!strcmp(name, nswitch_personalities[i].name))
+				break;
+		if (i == NSWITCH_PERSONALITIES) {
+			ret = -EINVAL;
+			break;
+		}
+		set_bit(i, &mask);
+	}
+	kfree(copy);
+	if (ret)
+		return ret;
+
+	mutex_lock(&pair_lock);
+	ret = nd_set_personalities(ndev, mask);
+	mutex_unlock(&pair_lock);
+	return ret ? ret : count;
+}
+
+static DEVICE_ATTR(personalities, S_IRUGO | S_IWUSR,
+				   personalities_show, personalities_store);
+
+/* Event Handler */
+int init_personalities(nswitch_dev *ndev) {
+	return device_create_file(&ndev->hdev->dev, &dev_attr_personalities);
+}
+
+/*
+  Must be called once the device thread is gone
+ */
+/* Event Handler */
+void deinit_personalities(nswitch_dev *ndev) {
+	int i;
+
+	device_remove_file(&ndev->hdev->dev, &dev_attr_personalities);
+	mutex_lock(&pair_lock);
+	WRITE_ONCE(ndev->personalities, 0);
+	for (i = 0; i < NSWITCH_PERSONALITIES; ++i) {
+		if (ndev->pinputs[i])
+			input_unregister_device(ndev->pinputs[i]);
+		ndev->pinputs[i] = NULL;
+	}
+	mutex_unlock(&pair_lock);
+}
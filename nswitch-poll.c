@@ -0,0 +1,171 @@
+#include "hid-nswitch.h"
+
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+/*
+  Adaptive batching of the device thread wakeups.
+  While all devices together send less than poll_threshold reports per
+  second, each report wakes its device thread right away.
+  Above it, raw_event only queues its device on a per CPU poller, and
+  a pass every poll_interval_us wakes the threads of all the queued
+  devices at once. Each thread then drains everything received since
+  the previous pass; with stick and IMU updates coalesced by the event
+  queue, that is usually a single handler run and input_sync per pass.
+  Reports wait at most poll_interval_us more.
+  Reports of a device may arrive on any CPU: a device is only queued
+  on one poller at a time, the one that set its poll_queued bit, which
+  is cleared under that poller's lock once it leaves the list.
+ */
+
+static unsigned int poll_threshold = 1000;
+module_param(poll_threshold, uint, 0644);
+MODULE_PARM_DESC(poll_threshold, "Reports per second over all devices above which wakeups are batched, 0 to never batch");
+
+static unsigned int poll_interval_us = 1000;
+module_param(poll_interval_us, uint, 0644);
+MODULE_PARM_DESC(poll_interval_us, "Delay between two batched passes, in us");
+
+/* Report rate estimation period */
+#define POLL_WINDOW_NS (100 * NSEC_PER_MSEC)
+
+struct nswitch_poller {
+	struct hrtimer timer;
+	/* Protects everything below */
+	struct spinlock lock;
+	struct list_head devices; /* Devices with reports for their thread */
+	__u8 armed;
+};
+
+static DEFINE_PER_CPU(struct nswitch_poller, nswitch_pollers);
+
+static atomic_t poll_reports;
+static atomic64_t poll_window_ns;
+static atomic64_t poll_passes;
+static unsigned int poll_rate;
+static __u8 poll_batching;
+
+/* Event Handler */
+static enum hrtimer_restart nswitch_poll_pass(struct hrtimer *timer) {
+	struct nswitch_poller *p = container_of(timer, struct nswitch_poller, timer);
+	nswitch_dev *ndev, *tmp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&p->lock, flags);
+	list_for_each_entry_safe(ndev, tmp, &p->devices, poll_entry) {
+		list_del_init(&ndev->poll_entry);
+		/* Before the wakeup, a report queued meanwhile is handled by it */
+		clear_bit_unlock(0, &ndev->poll_queued);
+		complete_all(&ndev->state_pending);
+	}
+	p->armed = 0;
+	spin_unlock_irqrestore(&p->lock, flags);
+	atomic64_inc(&poll_passes);
+	return HRTIMER_NORESTART;
+}
+
+/*
+  Updates the report rate estimation, and decides whether to batch.
+  Leaves batching below 3/4 of the threshold, so that it does not flap.
+ */
+/* Event Handler */
+static int nswitch_poll_should_batch(void) {
+	unsigned int threshold = READ_ONCE(poll_threshold);
+	__u64 now = ktime_get_ns();
+	__u64 start = atomic64_read(&poll_window_ns);
+	unsigned int rate;
+
+	atomic_inc(&poll_reports);
+	if (now - start >= POLL_WINDOW_NS &&
+		atomic64_cmpxchg(&poll_window_ns, start, now) == start) {
+		rate = div64_u64((__u64)atomic_xchg(&poll_reports, 0) * NSEC_PER_SEC,
+						 now - start);
+		WRITE_ONCE(poll_rate, rate);
+		if (READ_ONCE(poll_batching))
+			WRITE_ONCE(poll_batching, threshold && rate * 4 > threshold * 3);
+		else
+			WRITE_ONCE(poll_batching, threshold && rate > threshold);
+	}
+	return READ_ONCE(poll_batching);
+}
+
+/*
+  Hands the reports queued by raw_event over to the device thread
+ */
+/* Event Handler */
+void poll_report(nswitch_dev *ndev) {
+	struct nswitch_poller *p;
+	unsigned long flags;
+
+	if (!nswitch_poll_should_batch()) {
+		complete_all(&ndev->state_pending);
+		return;
+	}
+
+	p = get_cpu_ptr(&nswitch_pollers);
+	spin_lock_irqsave(&p->lock, flags);
+	/* Otherwise the pass of the poller it is queued on wakes it */
+	if (!test_and_set_bit(0, &ndev->poll_queued)) {
+		list_add_tail(&ndev->poll_entry, &p->devices);
+		WRITE_ONCE(ndev->poller, p);
+	}
+	if (!p->armed) {
+		p->armed = 1;
+		hrtimer_start(&p->timer,
+					  ns_to_ktime((__u64)READ_ONCE(poll_interval_us) * NSEC_PER_USEC),
+					  HRTIMER_MODE_REL_PINNED);
+	}
+	spin_unlock_irqrestore(&p->lock, flags);
+	put_cpu_ptr(p);
+}
+
+/*
+  Must be called once raw_event can no longer run for this device
+ */
+/* Event Handler */
+void poll_cancel(nswitch_dev *ndev) {
+	struct nswitch_poller *p = ndev->poller;
+	unsigned long flags;
+
+	if (!p)
+		return;
+	/* The last poller it was queued on, a pass may be running */
+	spin_lock_irqsave(&p->lock, flags);
+	if (test_bit(0, &ndev->poll_queued)) {
+		list_del_init(&ndev->poll_entry);
+		clear_bit_unlock(0, &ndev->poll_queued);
+	}
+	spin_unlock_irqrestore(&p->lock, flags);
+	ndev->poller = NULL;
+}
+
+void poll_show_stats(struct seq_file *s) {
+	seq_printf(s, "poll: %s, %u reports/s over all devices, %lld passes\n",
+			   READ_ONCE(poll_batching) ? "batched" : "immediate",
+			   READ_ONCE(poll_rate), (long long)atomic64_read(&poll_passes));
+}
+
+void nswitch_poll_register(void) {
+	struct nswitch_poller *p;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		p = per_cpu_ptr(&nswitch_pollers, cpu);
+		spin_lock_init(&p->lock);
+		INIT_LIST_HEAD(&p->devices);
+		hrtimer_init(&p->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+		p->timer.function = nswitch_poll_pass;
+	}
+	atomic64_set(&poll_window_ns, ktime_get_ns());
+}
+
+/*
+  Called once all the devices are gone
+ */
+void nswitch_poll_unregister(void) {
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		hrtimer_cancel(&per_cpu_ptr(&nswitch_pollers, cpu)->timer);
+}
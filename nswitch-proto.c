@@ -0,0 +1,581 @@
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#else
+#include <stdlib.h>
+#include <string.h>
+#define clamp_val(v, lo, hi) ((v) < (lo) ? (lo) : (v) > (hi) ? (hi) : (v))
+#define div64_s64(a, b) ((a) / (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+#include "nswitch-proto.h"
+
+/*
+  16, 17, 18, 19, 8, 21, 13, 20, 22, 23, 11, 5 bits per index
+ */
+static const __u64 ljc_bit_offsets = 0x2EF6A36A89CA30;
+
+/*
+  3, 0, 1, 2, 12, 5, 9, 4, 6, 7, 10, 5 bits per index
+ */
+static const __u64 rjc_bit_offsets = 0x28E6224AC10403;
+
+/*
+  For SIMPLE reports, only buttons is set, to the first two bytes of
+  nswitch_dev_simple_state.
+  Returns the number of bytes used, 0 if the report is truncated or
+  of an unknown type.
+ */
+int ns_decode_report(const __u8 *raw, int size, ns_frame *f) {
+	const nswitch_dev_input_report *rep = (const void*)raw;
+	const nswitch_dev_full_report *fr = &rep->full;
+	int used, imu_end;
+	int i;
+
+	memset(f, 0, sizeof(*f));
+	if (size < 1)
+		return 0;
+	f->type = rep->input_report;
+
+	switch (rep->input_report) {
+	case SIMPLE:
+		if (size < 3)
+			return 0;
+		f->buttons = raw[1] | (raw[2] << 8);
+		return 3;
+	case REPLY:
+	case STANDARD:
+	case STD_NFCIR:
+	case STD_UNKNOWN0:
+	case STD_UNKNOWN1:
+		break;
+	default:
+		return 0;
+	}
+
+	used = 1 + (int)((const __u8*)&fr->reply - (const __u8*)fr);
+	imu_end = used + sizeof(fr->ax6);
+	if (size < used)
+		return 0;
+	f->timer = fr->timer;
+	f->battery = fr->battery;
+	f->connection = fr->connection;
+	f->buttons = raw[3] | (raw[4] << 8) | (raw[5] << 16);
+	f->sticks[0] = fr->left_stick.x;
+	f->sticks[1] = fr->left_stick.y;
+	f->sticks[2] = fr->right_stick.x;
+	f->sticks[3] = fr->right_stick.y;
+
+	if (rep->input_report == REPLY || size < imu_end)
+		return used;
+	for (i = 0; i < 3; ++i) {
+		f->imu[i][0] = fr->ax6[i][0][0];
+		f->imu[i][1] = fr->ax6[i][0][1];
+		f->imu[i][2] = fr->ax6[i][0][2];
+		f->imu[i][3] = fr->ax6[i][1][0];
+		f->imu[i][4] = fr->ax6[i][1][1];
+		f->imu[i][5] = fr->ax6[i][1][2];
+	}
+	f->has_imu = 1;
+	return imu_end;
+}
+
+/*
+  Maps the buttons of a single joycon held sideway, in ns_simple_buttons
+  order.
+ */
+__u16 ns_simple_button_mask(enum nswitch_dev_type type, __u32 buttons) {
+	__u64 offsets;
+	__u16 mask = 0;
+	__u8 i;
+
+	switch (type) {
+	case LEFT_JOYCON:
+		offsets = ljc_bit_offsets;
+		break;
+	case RIGHT_JOYCON:
+		offsets = rjc_bit_offsets;
+		break;
+	default:
+		return 0;
+	}
+	for (i = 0; i < 11; ++i)
+		mask |= ((buttons >> ((offsets >> (i * 5)) & 0x1F)) & 1) << i;
+	return mask;
+}
+
+/*
+  Maps a raw stick value to -32767..32767 around its calibrated center
+ */
+__s16 ns_stick_scale(int v, int center, int min_offset, int max_offset) {
+	v -= center;
+	if (v < 0 && min_offset)
+		v = v * 32767 / min_offset;
+	else if (v > 0 && max_offset)
+		v = v * 32767 / max_offset;
+	else
+		v = 0;
+	return clamp_val(v, -32767, 32767);
+}
+
+void ns_calibrate_sticks(const calibration_data *cd, const ns_frame *f,
+						 __s16 out[4]) {
+	out[0] = ns_stick_scale(f->sticks[0], cd->left_stick.xcenter,
+							cd->left_stick.xmin_offset, cd->left_stick.xmax_offset);
+	out[1] = ns_stick_scale(f->sticks[1], cd->left_stick.ycenter,
+							cd->left_stick.ymin_offset, cd->left_stick.ymax_offset);
+	out[2] = ns_stick_scale(f->sticks[2], cd->right_stick.xcenter,
+							cd->right_stick.xmin_offset, cd->right_stick.xmax_offset);
+	out[3] = ns_stick_scale(f->sticks[3], cd->right_stick.ycenter,
+							cd->right_stick.ymin_offset, cd->right_stick.ymax_offset);
+}
+
+/*
+  Filters one raw sample into af->out.
+  Returns 1 when af->out changed.
+ */
+int ns_filter_axis(ns_axis_filter *af, const ns_filter_params *p,
+				   int raw, int center) {
+	int x = raw << 8, delta, smooth, v;
+
+	if (!af->primed) {
+		af->value = x;
+		af->primed = 1;
+		delta = 0;
+	} else {
+		delta = abs(x - af->value) >> 8;
+	}
+	smooth = p->strength;
+	if (p->speed)
+		smooth = delta >= p->speed ? 0 : smooth * (p->speed - delta) / p->speed;
+	af->value += (x - af->value) * (256 - smooth) / 256;
+
+	v = (af->value + 128) >> 8;
+	if (abs(v - center) <= p->rest)
+		v = center;
+	if (v == af->out ||
+		(v != center && abs(v - af->out) <= p->hysteresis))
+		return 0;
+	af->out = v;
+	return 1;
+}
+
+/*
+  Scales one IMU sample, accelerometer then gyroscope, to NS_ACCEL_RES
+  and NS_GYRO_RES units around the calibrated origins.
+  bias, from ns_gyro_bias, is removed from the gyroscope unless NULL.
+  The factory sensitivities are the raw values at 4g and 936 deg/s.
+ */
+void ns_calibrate_imu(const calibration_data *cd, const __s32 *bias,
+					  const __s16 raw[6], __s32 out[6]) {
+	const sax_calibration_data *sax = &cd->sax;
+	__s32 origin, range;
+	__s64 v;
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		origin = (__s16)sax->accelerometer_origin[i];
+		range = sax->accelerometer_sensitivity[i] - origin;
+		out[i] = range <= 0 ? raw[i] :
+			div64_s64((__s64)(raw[i] - origin) * 4 * NS_ACCEL_RES, range);
+
+		v = (__s64)(raw[3 + i] - (__s16)sax->gyroscope_origin[i]) << 8;
+		if (bias)
+			v -= bias[i];
+		out[3 + i] = (v * cd->gyro_coeff[i]) >> 24;
+	}
+}
+
+/*
+  Feeds one raw IMU sample to the estimator.
+  Returns 1 when the bias was updated.
+ */
+int ns_bias_update(ns_gyro_bias *b, const calibration_data *cd,
+				   const __s16 raw[6]) {
+	/* Variances of still samples, in raw units squared */
+	static const __s64 max_var[6] = { 400, 400, 400, 64, 64, 64 };
+	/* Bias larger than this is rotation, in raw units */
+	const __s64 max_bias = 256;
+	__s16 *old = b->samples[b->count % NS_BIAS_WINDOW];
+	__s64 mean, var;
+	int i, still = 1, shift;
+
+	for (i = 0; i < 6; ++i) {
+		if (b->count >= NS_BIAS_WINDOW) {
+			b->sum[i] -= old[i];
+			b->sumsq[i] -= old[i] * old[i];
+		}
+		old[i] = raw[i];
+		b->sum[i] += raw[i];
+		b->sumsq[i] += raw[i] * raw[i];
+	}
+	if (++b->count < NS_BIAS_WINDOW)
+		return 0;
+
+	/* N^2 var = N sumsq - sum^2 */
+	for (i = 0; i < 6 && still; ++i) {
+		var = NS_BIAS_WINDOW * b->sumsq[i] - b->sum[i] * b->sum[i];
+		still = var <= max_var[i] * NS_BIAS_WINDOW * NS_BIAS_WINDOW;
+	}
+	for (i = 3; i < 6 && still; ++i) {
+		mean = b->sum[i] - (__s64)(__s16)cd->sax.gyroscope_origin[i - 3] * NS_BIAS_WINDOW;
+		still = mean <= max_bias * NS_BIAS_WINDOW &&
+			mean >= -max_bias * NS_BIAS_WINDOW;
+	}
+	if (!still) {
+		if (b->confidence)
+			--b->confidence;
+		return 0;
+	}
+
+	/* Time constant of 16 samples, then 256 once confident */
+	shift = b->confidence < NS_BIAS_CONFIDENCE / 4 ? 4 : 8;
+	for (i = 0; i < 3; ++i) {
+		/* Window mean from the origin, 8 fractional bits */
+		mean = (b->sum[3 + i] -
+				(__s64)(__s16)cd->sax.gyroscope_origin[i] * NS_BIAS_WINDOW) *
+			256 / NS_BIAS_WINDOW;
+		b->bias[i] += ((__s32)(mean - b->bias[i]) + (1 << (shift - 1))) >> shift;
+	}
+	b->confidence = min(b->confidence + 4, NS_BIAS_CONFIDENCE);
+	++b->still;
+	return 1;
+}
+
+static __u64 ns_isqrt(__u64 x) {
+	__u64 r = 0, bit = 1ULL << 62;
+
+	while (bit > x)
+		bit >>= 2;
+	while (bit) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+	return r;
+}
+
+#define QMUL(a, b) ((__s32)(((__s64)(a) * (b)) >> NS_QUAT_SHIFT))
+
+/*
+  First order renormalization, the quaternion stays close to unit
+ */
+static void ns_quat_normalize(__s32 q[4]) {
+	__s64 n2 = 0, scale;
+	int i;
+
+	for (i = 0; i < 4; ++i)
+		n2 += (__s64)q[i] * q[i];
+	scale = ((3LL << NS_QUAT_SHIFT) - (n2 >> NS_QUAT_SHIFT)) / 2;
+	for (i = 0; i < 4; ++i)
+		q[i] = (q[i] * scale) >> NS_QUAT_SHIFT;
+}
+
+void ns_fusion_init(ns_fusion *fu) {
+	memset(fu, 0, sizeof(*fu));
+	fu->q[0] = NS_QUAT_ONE;
+	fu->kp = 128;
+}
+
+/*
+  imu is a sample from ns_calibrate_imu, sampled at time_ns
+ */
+void ns_fusion_update(ns_fusion *fu, const __s32 imu[6], __u64 time_ns) {
+	/* NS_QUAT_ONE * pi / 360: half angle per deg/s per s */
+	const __s64 half_rad = 9370165;
+	__s32 *q = fu->q;
+	__s32 a[3], v[3], e[3] = { 0, 0, 0 }, h[3], d[4];
+	__s64 dt, norm;
+	int i;
+
+	dt = time_ns - fu->last_ns;
+	if (!fu->last_ns || dt <= 0 || dt > 4 * NS_IMU_PERIOD_NS)
+		dt = NS_IMU_PERIOD_NS;
+	fu->last_ns = time_ns;
+
+	/* Only trust the accelerometer between 0.5g and 1.5g */
+	norm = ns_isqrt((__s64)imu[0] * imu[0] + (__s64)imu[1] * imu[1] +
+					(__s64)imu[2] * imu[2]);
+	if (norm > NS_ACCEL_RES / 2 && norm < NS_ACCEL_RES * 3 / 2) {
+		for (i = 0; i < 3; ++i)
+			a[i] = div64_s64((__s64)imu[i] << NS_QUAT_SHIFT, norm);
+		/* Gravity, as seen from the quaternion, over 2 */
+		v[0] = QMUL(q[1], q[3]) - QMUL(q[0], q[2]);
+		v[1] = QMUL(q[0], q[1]) + QMUL(q[2], q[3]);
+		v[2] = (QMUL(q[0], q[0]) - QMUL(q[1], q[1]) -
+				QMUL(q[2], q[2]) + QMUL(q[3], q[3])) / 2;
+		/* Over 2 as well */
+		e[0] = QMUL(a[1], v[2]) - QMUL(a[2], v[1]);
+		e[1] = QMUL(a[2], v[0]) - QMUL(a[0], v[2]);
+		e[2] = QMUL(a[0], v[1]) - QMUL(a[1], v[0]);
+	}
+
+	/* Half rotation over dt, with the correction at kp */
+	for (i = 0; i < 3; ++i)
+		h[i] = div64_s64((__s64)imu[3 + i] * 1000 / NS_GYRO_RES *
+						 (dt / 1000) * half_rad, 1000000000) +
+			div64_s64((__s64)e[i] * (dt / 1000) * fu->kp, 256 * 1000000);
+
+	d[0] = -QMUL(q[1], h[0]) - QMUL(q[2], h[1]) - QMUL(q[3], h[2]);
+	d[1] = QMUL(q[0], h[0]) + QMUL(q[2], h[2]) - QMUL(q[3], h[1]);
+	d[2] = QMUL(q[0], h[1]) - QMUL(q[1], h[2]) + QMUL(q[3], h[0]);
+	d[3] = QMUL(q[0], h[2]) + QMUL(q[1], h[1]) - QMUL(q[2], h[0]);
+	for (i = 0; i < 4; ++i)
+		q[i] += d[i];
+	ns_quat_normalize(q);
+}
+
+/*
+  Removes the rotation around the vertical axis: the twist of the
+  quaternion around z
+ */
+void ns_fusion_reset_heading(ns_fusion *fu) {
+	__s32 *q = fu->q, w, z, r[4];
+	__s64 norm;
+
+	norm = ns_isqrt((__s64)q[0] * q[0] + (__s64)q[3] * q[3]);
+	if (!norm)
+		return;
+	w = div64_s64((__s64)q[0] << NS_QUAT_SHIFT, norm);
+	z = div64_s64((__s64)q[3] << NS_QUAT_SHIFT, norm);
+	/* (w, 0, 0, -z) * q */
+	r[0] = QMUL(w, q[0]) + QMUL(z, q[3]);
+	r[1] = QMUL(w, q[1]) + QMUL(z, q[2]);
+	r[2] = QMUL(w, q[2]) - QMUL(z, q[1]);
+	r[3] = QMUL(w, q[3]) - QMUL(z, q[0]);
+	memcpy(q, r, sizeof(r));
+	ns_quat_normalize(q);
+}
+
+/*
+  Returns the deflection of rate, -32767 to 32767
+ */
+__s32 ns_aim_deflection(const ns_aim_params *p, __s32 rate) {
+	__s64 x;
+	__s32 r = rate < 0 ? -rate : rate;
+
+	if (r <= p->deadzone || p->sensitivity <= p->deadzone)
+		return 0;
+	x = min(div64_s64((__s64)(r - p->deadzone) * 32767,
+					  p->sensitivity - p->deadzone), 32767LL);
+	x = div64_s64(x * (100 - p->curve) + x * x / 32767 * p->curve, 100);
+	return rate < 0 ? -x : x;
+}
+
+/*
+  User calibration blocks start with a magic, that is missing
+  when the user never calibrated the device.
+  Returns the calibration data, or NULL when there is none.
+ */
+const __u8 *ns_user_calibration(const spi_read_reply *srr) {
+	if (srr->data[0] != 0xB2 || srr->data[1] != 0xA1)
+		return 0;
+	return srr->data + 2;
+}
+
+/*
+  Typical factory values, used until the calibration is read
+ */
+void ns_default_calibration(calibration_data *cd) {
+	__u8 i;
+
+	memset(cd, 0, sizeof(*cd));
+	cd->left_stick.xcenter = cd->left_stick.ycenter = 2048;
+	cd->left_stick.xmin_offset = cd->left_stick.ymin_offset = 1400;
+	cd->left_stick.xmax_offset = cd->left_stick.ymax_offset = 1400;
+	cd->right_stick.xcenter = cd->right_stick.ycenter = 2048;
+	cd->right_stick.xmin_offset = cd->right_stick.ymin_offset = 1400;
+	cd->right_stick.xmax_offset = cd->right_stick.ymax_offset = 1400;
+	for (i = 0; i < 3; ++i) {
+		cd->sax.accelerometer_sensitivity[i] = 16384;
+		cd->sax.gyroscope_sensitivity[i] = 13371;
+	}
+	ns_init_gyro_coeff(cd);
+}
+
+/*
+  The sensitivity is the raw value at 936 deg/s, 13371 by default
+ */
+void ns_init_gyro_coeff(calibration_data *cd) {
+	__s32 range;
+	__u8 i;
+
+	for (i = 0; i < 3; ++i) {
+		range = cd->sax.gyroscope_sensitivity[i] - (__s16)cd->sax.gyroscope_origin[i];
+		if (range <= 0)
+			range = 13371 - (__s16)cd->sax.gyroscope_origin[i];
+		cd->gyro_coeff[i] = div64_s64((__s64)936 * NS_GYRO_RES << 16, range);
+	}
+}
+
+/*
+  counter is the 4 bits global packet number, incremented by the
+  sender for each output report.
+ */
+void ns_cmd_prepare(output_command *oc, __u8 counter) {
+	oc->gpn = counter;
+}
+
+/*
+  USB commands are only the report id and the command
+ */
+void ns_usb_cmd_prepare(output_command *oc, enum usb_command_type cmd) {
+	memset(oc, 0, sizeof(*oc));
+	oc->report = USB_COMMAND;
+	((__u8*)oc)[1] = cmd;
+}
+
+/*
+  Bytes of oc to send
+ */
+int ns_output_size(const output_command *oc) {
+	if (oc->report == USB_COMMAND)
+		return 2;
+	return sizeof(*oc);
+}
+
+/*
+  Amplitude codes of magnitudes in 1/16 steps of the maximum, the
+  highest being the safe maximum
+ */
+static const __u8 rumble_amp_codes[17] = {
+	0, 1, 17, 27, 36, 46, 55, 62, 68, 73, 78, 83, 87, 90, 94, 97, 100
+};
+
+/*
+  Encodes the rumble of one motor, magnitude from 0 to 0xFFFF, both
+  bands at the resonant frequencies of the actuators: 320Hz for the
+  high band, 160Hz for the low band.
+ */
+void ns_encode_rumble(__u8 data[4], __u16 magnitude) {
+	__u8 amp = rumble_amp_codes[(magnitude + 0x7FF) >> 12];
+
+	data[0] = 0x00;
+	data[1] = 0x01 + amp * 2;
+	data[2] = 0x40 | (amp & 1) << 7;
+	data[3] = 0x40 + amp / 2;
+}
+
+/*
+  CRC-8 (polynomial 0x07) used by the NFC/IR MCU
+ */
+__u8 ns_mcu_crc8(const __u8 *buf, int size) {
+	__u8 crc = 0;
+	int i;
+
+	while (size--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; ++i)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+
+/* Weight of each report in the regression means: 1/CLOCK_EW */
+#define CLOCK_EW 64
+/* Reports needed before trusting the regression */
+#define CLOCK_WARMUP 16
+/* Reports over which the smallest timer step is taken */
+#define CLOCK_STEP_WINDOW 64
+/* Longer gaps may hide a timer wrap, the clock starts over */
+#define CLOCK_MAX_GAP_NS 500000000ULL
+
+static void ns_clock_reset(ns_clock *c, __u8 timer, __u64 now_ns) {
+	__u64 lost = c->lost, duplicated = c->duplicated;
+	__u8 step = c->step;
+
+	memset(c, 0, sizeof(*c));
+	c->origin_ns = now_ns;
+	c->last_ns = now_ns;
+	c->last_ts = now_ns;
+	c->timer = timer;
+	c->step = step;
+	c->step_min = 0xFF;
+	c->lost = lost;
+	c->duplicated = duplicated;
+	c->samples = 1;
+}
+
+/*
+  Counts the reports lost or duplicated since the previous one, from
+  the timer increment, and updates the regression.
+  Returns the reconstructed sample time of the report, never later
+  than its arrival and always after the previous one.
+ */
+__u64 ns_clock_update(ns_clock *c, __u8 timer, __u64 now_ns) {
+	__u8 delta = timer - c->timer;
+	__s64 x, y, dx, dy, t, r;
+	__u64 ts;
+
+	if (!c->samples || (__s64)(now_ns - c->last_ns) > (__s64)CLOCK_MAX_GAP_NS) {
+		ns_clock_reset(c, timer, now_ns);
+		return now_ns;
+	}
+	if (!delta) {
+		++c->duplicated;
+		return c->last_ts;
+	}
+
+	if (c->step && delta >= c->step + c->step / 2)
+		c->lost += (delta + c->step / 2) / c->step - 1;
+	if (!c->step || delta < c->step)
+		c->step = delta;
+	if (delta < c->step_min)
+		c->step_min = delta;
+	if (++c->window == CLOCK_STEP_WINDOW) {
+		/* Follows report rate decreases */
+		c->step = c->step_min;
+		c->step_min = 0xFF;
+		c->window = 0;
+	}
+
+	c->timer = timer;
+	c->last_ns = now_ns;
+	c->ticks += delta;
+	x = c->ticks * 256;
+	y = now_ns - c->origin_ns;
+	dx = x - c->mean_x;
+	dy = y - c->mean_y;
+	c->mean_x += dx / CLOCK_EW;
+	c->mean_y += dy / CLOCK_EW;
+	c->var_x += (dx * dx / 256 - c->var_x) / CLOCK_EW;
+	c->cov_xy += (dx * dy / 256 - c->cov_xy) / CLOCK_EW;
+	if (++c->samples < CLOCK_WARMUP || c->var_x <= 0) {
+		c->last_ts = now_ns;
+		return now_ns;
+	}
+
+	c->slope = div64_s64(c->cov_xy * 65536, c->var_x);
+	t = c->mean_y + (x - c->mean_x) * c->slope / 65536;
+	r = y - t;
+	if (c->samples == CLOCK_WARMUP || r < c->offset)
+		c->offset = r;
+	else
+		c->offset += (r - c->offset) / 1024;
+
+	ts = c->origin_ns + t + c->offset;
+	if (ts > now_ns)
+		ts = now_ns;
+	if (ts <= c->last_ts)
+		ts = c->last_ts + 1;
+	c->last_ts = ts;
+	return ts;
+}
+
+/*
+  Sample time of one of the 3 IMU samples of a report, oldest first,
+  from the report time ts. They are evenly spread over a report period.
+ */
+__u64 ns_clock_imu_time(const ns_clock *c, __u64 ts, int sample) {
+	__s64 period = c->step * c->slope / 256;
+
+	if (period <= 0)
+		return ts;
+	return ts - div64_s64((2 - sample) * period, 3);
+}
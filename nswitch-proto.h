@@ -0,0 +1,496 @@
+#ifndef __NSWITCH_PROTO_H
+#define __NSWITCH_PROTO_H
+
+/*
+ * HID driver for Nintendo Switch peripherals
+ * Copyright (c) 2018 Nabil Boutemeur <nabil.boutemeur@gmail.com>
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+  Wire protocol of the Nintendo Switch peripherals: report layouts,
+  calibration and button decoding, command encoding.
+  Kernel independent, also built as a user space library
+  (make tools/libnswitch-proto.a). Only use types from linux/types.h here.
+ */
+
+#include <linux/types.h>
+
+#define PACKED __attribute__((packed))
+
+/*
+  HCI states exposed by all the peripherals in this family
+  through the Bluetooth HID in subcommand 0xXX
+ */
+enum nswitch_dev_hci_state {
+	DISCONNECT,
+	REBOOT_RECONNECT,
+	REBOOT_PAIR,
+	REBOOT_RECONNECT_HOME
+};
+
+typedef struct {
+	__u16 xmax_offset	: 12;
+	__u16 ymax_offset	: 12;
+	__u16 xcenter		: 12;
+	__u16 ycenter		: 12;
+	__u16 xmin_offset	: 12;
+	__u16 ymin_offset	: 12;
+} PACKED left_stick_calibration_data;
+
+typedef struct {
+	__u16 xcenter		: 12;
+	__u16 ycenter		: 12;
+	__u16 xmin_offset	: 12;
+	__u16 ymin_offset	: 12;
+	__u16 xmax_offset	: 12;
+	__u16 ymax_offset	: 12;
+} PACKED right_stick_calibration_data;
+
+typedef struct {
+	__u16 accelerometer_origin[3];
+	__u16 accelerometer_sensitivity[3];
+	__u16 gyroscope_origin[3];
+	__u16 gyroscope_sensitivity[3];
+} PACKED sax_calibration_data;
+
+typedef struct {
+	left_stick_calibration_data left_stick;
+	right_stick_calibration_data right_stick;
+	sax_calibration_data sax;
+	/* NS_GYRO_RES units per raw gyroscope unit, 16 fractional bits */
+	__u32 gyro_coeff[3];
+} PACKED calibration_data;
+
+/*
+   Available stick directions (left joystick for the procontroller)
+   when holding the controller sideway with SR/SL on the top
+   when using 0x3F input reports.
+ */
+enum simple_stick_direction {
+	TOP,
+	TOP_RIGHT,
+	RIGHT,
+	BOTTOM_RIGHT,
+	BOTTOM,
+	BOTTOM_LEFT,
+	LEFT,
+	TOP_LEFT,
+	NEUTRAL
+};
+
+/*
+  HID input report types
+ */
+enum input_report_type {
+	/*
+	   Driver init peripherals to this type
+
+	*/
+	SIMPLE			= 0x3F,
+
+	REPLY			= 0x21,
+	STANDARD		= 0x30,
+	STD_NFCIR		= 0x31,
+	STD_UNKNOWN0	= 0x32,
+	STD_UNKNOWN1	= 0x33,
+
+	NFC_UPDATE		= 0x23,
+
+	/* Over USB, reply to a USB_COMMAND, echoing it in the second byte */
+	USB_REPLY		= 0x81
+};
+
+/*
+  State as reported by input report 0x3F
+ */
+typedef struct {
+	__u8  down		: 1;
+	__u8  right		: 1;
+	__u8  left		: 1;
+	__u8  up		: 1;
+	__u8  sl		: 1;
+	__u8  sr		: 1;
+	__u8  __res1	: 2;
+	__u8  minus		: 1;
+	__u8  plus		: 1;
+	__u8  ls		: 1;
+	__u8  rs		: 1;
+	__u8  home		: 1;
+	__u8  capture	: 1;
+	__u8  lr		: 1; /* L or R on the corresponding joycon */
+	__u8  z			: 1; /* ZL or ZR -- --- ------------- ------*/
+
+	enum  simple_stick_direction direction : 8;
+
+	__u64 padding;
+} PACKED nswitch_dev_simple_state;
+
+/*
+  State reported by the standard input report types
+*/
+typedef struct {
+	__u8 y		: 1;
+	__u8 x		: 1;
+	__u8 b		: 1;
+	__u8 a		: 1;
+	__u8 rsr	: 1;
+	__u8 rsl	: 1;
+	__u8 r		: 1;
+	__u8 zr		: 1;
+
+	__u8 minus			: 1;
+	__u8 plus			: 1;
+	__u8 rs				: 1;
+	__u8 ls				: 1;
+	__u8 home			: 1;
+	__u8 capture		: 1;
+	__u8 __res1			: 1;
+	__u8 charging_grip	: 1;
+
+	__u8 down	: 1;
+	__u8 up		: 1;
+	__u8 right	: 1;
+	__u8 left	: 1;
+	__u8 lsr	: 1;
+	__u8 lsl	: 1;
+	__u8 l		: 1;
+	__u8 zl		: 1;
+} PACKED standard_button_state;
+
+/*
+  Bits of standard_button_state, as in ns_frame buttons
+ */
+enum ns_button {
+	NS_BTN_Y, NS_BTN_X, NS_BTN_B, NS_BTN_A,
+	NS_BTN_RSR, NS_BTN_RSL, NS_BTN_R, NS_BTN_ZR,
+	NS_BTN_MINUS, NS_BTN_PLUS, NS_BTN_RS, NS_BTN_LS,
+	NS_BTN_HOME, NS_BTN_CAPTURE, NS_BTN_RES, NS_BTN_GRIP,
+	NS_BTN_DOWN, NS_BTN_UP, NS_BTN_RIGHT, NS_BTN_LEFT,
+	NS_BTN_LSR, NS_BTN_LSL, NS_BTN_L, NS_BTN_ZL
+};
+
+#define ns_button(f, b) (((f)->buttons >> (b)) & 1)
+
+/*
+  Only when the input report type is REPLY
+ */
+typedef struct {
+	__u8 ack;
+	__u8 reply_to;
+	__u8 data[35];
+} PACKED subcmd_input;
+
+typedef struct {
+	__u16 x : 12;
+	__u16 y : 12;
+} PACKED stick_state;
+
+typedef struct {
+	__u8  timer;
+	__u8  connection: 4;
+	__u8  battery: 4;
+	standard_button_state buttons;
+	stick_state left_stick;
+	stick_state right_stick;
+	__u8 vib;
+	union {
+		subcmd_input reply;
+		__u8 nfc_ir_mcu[37];
+		__u16 ax6[3][2][3];
+	};
+} PACKED nswitch_dev_full_report;
+
+enum nswitch_dev_type {
+	LEFT_JOYCON = 1,
+	RIGHT_JOYCON,
+	PRO_CONTROLLER
+};
+
+/*
+   Reply from subcmd 0x02
+ */
+typedef struct {
+	__u8 vmajor;
+	__u8 vminor;
+	enum nswitch_dev_type type : 8;
+	__u8 two;
+	__u8 mac[6];
+	__u8 one;
+	__u8 colored;
+} PACKED nswitch_devinfo;
+
+typedef struct {
+	enum input_report_type input_report : 8;
+	union {
+		nswitch_dev_simple_state simple;
+		nswitch_dev_full_report full;
+	};
+} PACKED nswitch_dev_input_report;
+
+enum report_type {
+	BASIC				= 0x1,
+	NFC_UPDATE_REPORT	= 0x3,
+	RUMBLE_REPORT		= 0x10,
+	MCU_REPORT			= 0x11,
+	UNKNOWN_REPORT		= 0x12,
+	USB_COMMAND			= 0x80
+};
+
+/*
+  Commands of the USB_COMMAND report, taking the joycons of the
+  Charging Grip from USB to their own HID protocol
+ */
+enum usb_command_type {
+	USB_STATUS			= 0x01,
+	USB_HANDSHAKE		= 0x02,
+	USB_BAUDRATE_3M		= 0x03,
+	USB_NO_TIMEOUT		= 0x04,
+	USB_ENABLE_TIMEOUT	= 0x05
+};
+
+typedef struct {
+	__u8 pair_type;
+	__u8 host_bd_addr[6];
+} PACKED manual_pair_args;
+
+typedef struct {
+	__u16 l, r, zl, zr, sl, sr, home;
+} PACKED elapsed_trigger_time;
+
+typedef struct {
+	__u32 addr;
+	__u8 size;
+} PACKED spi_read_args_t;
+
+typedef struct {
+	spi_read_args_t echo;
+	__u8 data[];
+} PACKED spi_read_reply;
+
+/* +2 for magic */
+#define USER_CALIBRATION_LEFT_STICK {0x8010, 9 + 2}
+#define USER_CALIBRATION_RIGHT_STICK {0x801B, 9 + 2}
+#define USER_CALIBRATION_6AXIS {0x8028, 0x18 + 2}
+
+#define FACTORY_CALIBRATION_LEFT_STICK {0x603D, 9}
+#define FACTORY_CALIBRATION_RIGHT_STICK {0x6046, 9}
+#define FACTORY_CALIBRATION_6AXIS {0x6020, 0x18}
+
+enum subcommand_type {
+	GET_CONTROLLER_STATE	= 0x00,
+	MANUAL_PAIR				= 0x01,
+	DEVICE_INFO				= 0x02,
+	SET_INPUT_REPORT_MODE	= 0x03,
+	ELAPSED_TRIGGER_TIME	= 0x04,
+	PAGE_LIST_STATE			= 0x05,
+	SET_HCI					= 0x06,
+	RESET_PAIRING			= 0x07,
+	SET_SHIPMENT			= 0x08,
+	SPI_FLASH_READ			= 0x10,
+	SPI_FLASH_WRITE			= 0x11,
+	SPI_FLASH_ERASE_SECTOR	= 0x12,
+	RESET_NFC_IR			= 0x20,
+	SET_NFC_IR				= 0x21,
+	SET_NFC_IR_STATE		= 0x22,
+	SET_PLAYER_LIGHTS		= 0x30,
+	GET_PLAYER_LIGHTS		= 0x31,
+	SET_HOME_LIGHT			= 0x38,
+	SET_IMU					= 0x40,
+	SET_IMU_SENSITIVITY		= 0x41,
+	SET_VIBRATION			= 0x48,
+	GET_VOLTAGE				= 0x50,
+};
+
+typedef struct {
+	enum report_type report : 8;
+	__u8 gpn : 4;
+	__u8 zero : 4;
+	__u8 rumble_data[8];
+	enum subcommand_type subcommand : 8;
+	union {
+		__u8 raw[54];
+		manual_pair_args manual_pair;
+		enum input_report_type mode : 8;
+		elapsed_trigger_time ett;
+		enum nswitch_dev_hci_state new_hci_state : 8;
+		__u8 shipment_mode;
+		spi_read_args_t spi_read;
+		__u8 player_lights;
+		__u8 imu_state;
+		__u8 vibrate;
+	};
+} PACKED output_command;
+
+/*
+  MCU payload appended to STD_NFCIR reports, starting at byte
+  NFC_IR_MCU_OFFSET of the raw report when streaming an IR image.
+ */
+#define NFC_IR_MCU_OFFSET 49
+#define IR_FRAGMENT_SIZE 300
+
+enum mcu_report_type {
+	MCU_STATUS	= 0x01,
+	MCU_IR_DATA	= 0x03
+};
+
+typedef struct {
+	enum mcu_report_type type : 8;
+	__u8 __res1[2];
+	__u8 frag;
+	__u8 __res2[6];
+	__u8 data[IR_FRAGMENT_SIZE];
+} PACKED ir_mcu_fragment;
+
+/* Calibrated accelerometer units per g */
+#define NS_ACCEL_RES 4096
+/* Calibrated gyroscope units per degree per second */
+#define NS_GYRO_RES 1000
+
+/*
+  Report decoded once, whatever consumes it
+ */
+typedef struct {
+	enum input_report_type type : 8;
+	__u8 timer;
+	__u8 battery;
+	__u8 connection;
+	__u32 buttons; /* standard_button_state bits */
+	__u16 sticks[4]; /* LX, LY, RX, RY, raw */
+	__s16 imu[3][6]; /* Oldest sample first, accelerometer then gyroscope */
+	__u8 has_imu;
+} ns_frame;
+
+/*
+  Reconstruction of the report sample times from the device timer byte.
+  Host arrival times are regressed against the unwrapped timer, with
+  exponentially weighted fixed point means, and the regression line is
+  shifted down to the earliest arrivals, removing the Bluetooth jitter
+  and bursts.
+ */
+typedef struct {
+	__u64 origin_ns; /* Host time of the first report */
+	__u64 last_ns; /* Host time of the previous report */
+	__u64 last_ts; /* Previous reconstructed time */
+	__s64 ticks; /* Unwrapped timer */
+	__s64 mean_x; /* Ticks, 8 fractional bits */
+	__s64 mean_y; /* ns since origin_ns */
+	__s64 var_x; /* Ticks^2, 8 fractional bits */
+	__s64 cov_xy; /* Ticks * ns */
+	__s64 slope; /* ns per tick, 8 fractional bits */
+	__s64 offset; /* ns, from the regression line to the earliest arrivals */
+	__u32 samples;
+	__u32 window;
+	__u8 step; /* Timer ticks between two reports */
+	__u8 step_min;
+	__u8 timer;
+	__u64 lost;
+	__u64 duplicated;
+} ns_clock;
+
+int ns_decode_report(const __u8 *raw, int size, ns_frame *f);
+/*
+  Stick axis filter, in raw units.
+  An exponential filter whose smoothing fades as the stick moves faster,
+  like a one euro filter, snapped to the center within rest, and only
+  output once it moves past the hysteresis.
+ */
+typedef struct {
+	__u16 strength; /* Smoothing at rest, 0 (none) to 255 */
+	__u16 speed; /* Movement per report without smoothing, 0: always smooth */
+	__u16 hysteresis;
+	__u16 rest; /* Around the center */
+} ns_filter_params;
+
+#define NS_FILTER_DEFAULTS { 192, 48, 4, 24 }
+
+typedef struct {
+	__s32 value; /* 8 fractional bits */
+	__u16 out;
+	__u8 primed;
+} ns_axis_filter;
+
+/*
+  Online gyroscope bias, on top of the factory origin.
+  Stillness is detected from the variance of every axis over a sliding
+  window of IMU samples; while still, the bias follows the window mean,
+  faster when its confidence is low.
+ */
+#define NS_BIAS_WINDOW 32 /* Power of two */
+#define NS_BIAS_CONFIDENCE 1024
+
+typedef struct {
+	__s16 samples[NS_BIAS_WINDOW][6];
+	__s64 sum[6];
+	__s64 sumsq[6];
+	__u32 count;
+	__s32 bias[3]; /* Raw units from the factory origin, 8 fractional bits */
+	__u16 confidence; /* 0 to NS_BIAS_CONFIDENCE */
+	__u64 still; /* Samples found still */
+} ns_gyro_bias;
+
+/*
+  Orientation from the calibrated IMU samples, a Mahony filter in fixed
+  point: the gyroscope rotates the quaternion, and the accelerometer
+  pulls it back toward gravity, at kp.
+  The quaternion (w, x, y, z) has NS_QUAT_ONE for 1.
+ */
+#define NS_QUAT_SHIFT 30
+#define NS_QUAT_ONE (1 << NS_QUAT_SHIFT)
+/* Nominal time between two IMU samples */
+#define NS_IMU_PERIOD_NS 5000000
+
+typedef struct {
+	__s32 q[4];
+	__u64 last_ns; /* Time of the previous sample */
+	__u16 kp; /* Accelerometer gain, in 1/s, 8 fractional bits */
+} ns_fusion;
+
+/*
+  Gyro aiming: the gyroscope rate as a stick deflection.
+  Rates below the deadzone are ignored, the rest is scaled so that
+  sensitivity gives a full deflection, through a curve blending the
+  linear response with a quadratic one.
+ */
+typedef struct {
+	__u8 enabled;
+	__u8 curve; /* 0 (linear) to 100 (quadratic) */
+	__u8 ratchet; /* standard_button_state bit suspending the aim, 0xff: none */
+	__s32 sensitivity; /* Rate of a full deflection, NS_GYRO_RES units */
+	__s32 deadzone; /* NS_GYRO_RES units */
+} ns_aim_params;
+
+#define NS_AIM_DEFAULTS { 0, 50, 0xff, 200 * NS_GYRO_RES, 1500 }
+
+__u64 ns_clock_update(ns_clock *c, __u8 timer, __u64 now_ns);
+__u64 ns_clock_imu_time(const ns_clock *c, __u64 ts, int sample);
+__u16 ns_simple_button_mask(enum nswitch_dev_type type, __u32 buttons);
+__s16 ns_stick_scale(int v, int center, int min_offset, int max_offset);
+void ns_calibrate_sticks(const calibration_data *cd, const ns_frame *f,
+						 __s16 out[4]);
+int ns_filter_axis(ns_axis_filter *af, const ns_filter_params *p,
+				   int raw, int center);
+void ns_calibrate_imu(const calibration_data *cd, const __s32 *bias,
+					  const __s16 raw[6], __s32 out[6]);
+int ns_bias_update(ns_gyro_bias *b, const calibration_data *cd,
+				   const __s16 raw[6]);
+void ns_fusion_init(ns_fusion *fu);
+void ns_fusion_update(ns_fusion *fu, const __s32 imu[6], __u64 time_ns);
+void ns_fusion_reset_heading(ns_fusion *fu);
+__s32 ns_aim_deflection(const ns_aim_params *p, __s32 rate);
+const __u8 *ns_user_calibration(const spi_read_reply *srr);
+void ns_default_calibration(calibration_data *cd);
+void ns_init_gyro_coeff(calibration_data *cd);
+void ns_cmd_prepare(output_command *oc, __u8 counter);
+void ns_usb_cmd_prepare(output_command *oc, enum usb_command_type cmd);
+int ns_output_size(const output_command *oc);
+void ns_encode_rumble(__u8 data[4], __u16 magnitude);
+__u8 ns_mcu_crc8(const __u8 *buf, int size);
+
+#endif
@@ -0,0 +1,388 @@
+#include "hid-nswitch.h"
+
+#include <linux/rcupdate.h>
+
+/*
+  Runtime remap tables, see nswitch-uapi.h for their format.
+  A table written to the remap sys file is validated and compiled into
+  a flat key per source bit, then swapped in with RCU: reporting costs
+  one lookup per changed bit.
+  Without a table, buttons report their default keys.
+
+  Every target declares all the keys a table may report when its input
+  device is registered, see nd_setup_remap_keys, so tables are not
+  limited to the default keys.
+
+  The compiled table also holds the reporting state (held chords,
+  toggled keys), reset by each new table. Keys held through the
+  previous table are released on the swap, unless the new one holds
+  them too. Both halves of a dual joypad report through the table of
+  the left one, so it is locked.
+ */
+
+struct nswitch_remap {
+	struct rcu_head rcu;
+	spinlock_t lock;
+	__u16 keys[32]; /* Key of each source bit, 0 when dropped */
+	__u32 toggles; /* Source bits flipping their key on each press */
+	__u32 chords[NSWITCH_REMAP_MAX_CHORDS]; /* Source bits of each chord */
+	__u16 chord_keys[NSWITCH_REMAP_MAX_CHORDS];
+	__u8 nchords;
+	__u8 axes[4]; /* Source axis of each output axis */
+	__u8 inverted; /* Bit per output axis */
+
+	/* Reporting state, under lock */
+	__u32 pressed; /* Source bits held, without the chorded ones */
+	__u32 out; /* Source bits whose key is down */
+	__u32 chords_on; /* Bit per chord */
+};
+
+typedef struct {
+	const short *keys;
+	__u8 nkeys;
+	__u8 naxes;
+} nswitch_remap_defaults;
+
+static const nswitch_remap_defaults remap_defaults[NSWITCH_REMAP_TARGETS] = {
+	[NSWITCH_REMAP_GAMEPAD] = { ns_simple_buttons, 11, 2 },
+	[NSWITCH_REMAP_KEYBOARD] = { ns_keyboard_keys, 11, 0 },
+	[NSWITCH_REMAP_DUAL] = { ns_buttons, 24, 4 },
+	[NSWITCH_REMAP_PRO] = { ns_pro_buttons, 24, 4 }
+};
+
+typedef struct {
+	__u16 first;
+	__u16 last;
+} nswitch_key_range;
+
+/* Keys a table may report */
+static const nswitch_key_range remap_keys[] = {
+	{ KEY_ESC, KEY_MICMUTE }, /* Keyboard */
+	{ BTN_MISC, BTN_9 },
+	{ BTN_JOYSTICK, BTN_THUMBR }, /* Joystick and gamepad */
+	{ BTN_DPAD_UP, BTN_DPAD_RIGHT },
+	{ BTN_TRIGGER_HAPPY1, BTN_TRIGGER_HAPPY40 }
+};
+
+static int remap_valid_key(__u16 code) {
+	unsigned int i;
+
+	if (!code)
+		return 1;
+	for (i = 0; i < ARRAY_SIZE(remap_keys); ++i)
+		if (code >= remap_keys[i].first && code <= remap_keys[i].last)
+			return 1;
+	return 0;
+}
+
+/*
+  Declares every key a table may report, on the input device of a
+  target before it is registered
+ */
+/* Event Handler */
+void nd_setup_remap_keys(struct input_dev *input) {
+	unsigned int i;
+
+	set_bit(EV_KEY, input->evbit);
+	for (i = 0; i < ARRAY_SIZE(remap_keys); ++i)
+		bitmap_set(input->keybit, remap_keys[i].first,
+				   remap_keys[i].last - remap_keys[i].first + 1);
+}
+
+/*
+  Returns the compiled table, NULL for the defaults, or an ERR_PTR
+ */
+static struct nswitch_remap *remap_compile(const nswitch_remap_defaults *d,
+										   const nswitch_remap_entry *e,
+										   int count) {
+	struct nswitch_remap *rm;
+	int i;
+
+	if (!count)
+		return NULL;
+	rm = kzalloc(sizeof(*rm), GFP_KERNEL);
+	if (!rm)
+		return ERR_PTR(-ENOMEM);
+	spin_lock_init(&rm->lock);
+	for (i = 0; i < d->nkeys; ++i)
+		rm->keys[i] = d->keys[i];
+	for (i = 0; i < d->naxes; ++i)
+		rm->axes[i] = i;
+
+	for (i = 0; i < count; ++i, ++e) {
+		if (!remap_valid_key(e->code))
+			goto err_inval;
+		switch (e->type) {
+		case NSWITCH_REMAP_KEY:
+			if (e->src >= d->nkeys)
+				goto err_inval;
+			rm->keys[e->src] = e->code;
+			break;
+		case NSWITCH_REMAP_TOGGLE:
+			if (e->src >= d->nkeys)
+				goto err_inval;
+			rm->toggles |= BIT(e->src);
+			if (e->code)
+				rm->keys[e->src] = e->code;
+			break;
+		case NSWITCH_REMAP_CHORD:
+			if (e->src >= d->nkeys || e->src2 >= d->nkeys ||
+				e->src == e->src2 || !e->code ||
+				rm->nchords == NSWITCH_REMAP_MAX_CHORDS)
+				goto err_inval;
+			rm->chords[rm->nchords] = BIT(e->src) | BIT(e->src2);
+			rm->chord_keys[rm->nchords++] = e->code;
+			break;
+		case NSWITCH_REMAP_AXIS:
+			if (e->src >= d->naxes || e->src2 >= d->naxes)
+				goto err_inval;
+			rm->axes[e->src] = e->src2;
+			if (e->flags & NSWITCH_REMAP_INVERT)
+				rm->inverted |= BIT(e->src);
+			break;
+		default:
+			goto err_inval;
+		}
+	}
+	return rm;
+
+err_inval:
+	kfree(rm);
+	return ERR_PTR(-EINVAL);
+}
+
+/*
+  Reports buttons, source bits of target, through input.
+  owner holds the table: the left joycon of a dual joypad.
+ */
+/* Event Handler */
+void nd_report_keys(nswitch_dev *owner, enum nswitch_remap_target target,
+					struct input_dev *input, __u32 buttons) {
+	const nswitch_remap_defaults *d = &remap_defaults[target];
+	struct nswitch_remap *rm;
+	unsigned long changed;
+	__u32 pressed, chords_on, rising;
+	unsigned long flags;
+	int i;
+
+	rcu_read_lock();
+	rm = rcu_dereference(owner->remap[target]);
+	if (!rm) {
+		for (i = 0; i < d->nkeys; ++i)
+			if (d->keys[i])
+				input_report_key(input, d->keys[i], (buttons >> i) & 1);
+		rcu_read_unlock();
+		return;
+	}
+
+	spin_lock_irqsave(&rm->lock, flags);
+	/* Chords take their buttons from the other mappings */
+	pressed = buttons;
+	chords_on = 0;
+	for (i = 0; i < rm->nchords; ++i) {
+		if ((buttons & rm->chords[i]) == rm->chords[i]) {
+			chords_on |= BIT(i);
+			pressed &= ~rm->chords[i];
+		}
+	}
+	changed = chords_on ^ rm->chords_on;
+	for_each_set_bit(i, &changed, NSWITCH_REMAP_MAX_CHORDS)
+		input_report_key(input, rm->chord_keys[i], (chords_on >> i) & 1);
+	rm->chords_on = chords_on;
+
+	rising = pressed & ~rm->pressed & rm->toggles;
+	rm->pressed = pressed;
+	pressed = (pressed & ~rm->toggles) | ((rm->out ^ rising) & rm->toggles);
+	changed = pressed ^ rm->out;
+	rm->out = pressed;
+	for_each_set_bit(i, &changed, 32)
+		if (rm->keys[i])
+			input_report_key(input, rm->keys[i], (pressed >> i) & 1);
+	spin_unlock_irqrestore(&rm->lock, flags);
+	rcu_read_unlock();
+}
+
+/*
+  Reports the raw stick values of target through the codes axes of
+  input, swapped and inverted within their calibrated range.
+  Only the axes whose source is in owned, bit per value, are up to the
+  caller, and of those only the ones whose source is in changed are
+  reported, the others count as suppressed.
+ */
+/* Event Handler */
+void nd_report_sticks(nswitch_dev *owner, enum nswitch_remap_target target,
+					  struct input_dev *input, const int *codes,
+					  const __u16 *values, unsigned long owned,
+					  unsigned long changed) {
+	const nswitch_remap_defaults *d = &remap_defaults[target];
+	struct nswitch_remap *rm;
+	int i, v, src, reported = 0, suppressed = 0;
+
+	rcu_read_lock();
+	rm = rcu_dereference(owner->remap[target]);
+	for (i = 0; i < d->naxes; ++i) {
+		src = rm ? rm->axes[i] : i;
+		if (!test_bit(src, &owned))
+			continue;
+		if (!test_bit(src, &changed)) {
+			++suppressed;
+			continue;
+		}
+		++reported;
+		if (!rm) {
+			input_report_abs(input, codes[i], values[i]);
+			continue;
+		}
+		v = values[src];
+		if (rm->inverted & BIT(i))
+			v = input_abs_get_min(input, codes[i]) +
+				input_abs_get_max(input, codes[i]) - v;
+		input_report_abs(input, codes[i], v);
+	}
+	rcu_read_unlock();
+	atomic64_add(reported, &owner->stick_events);
+	atomic64_add(suppressed, &owner->stick_suppressed);
+}
+
+/*
+  Requires the lock of rm, when not NULL
+ */
+static int remap_holds(const struct nswitch_remap *rm, __u16 code) {
+	unsigned long held;
+	int i;
+
+	if (!rm)
+		return 0;
+	held = rm->out;
+	for_each_set_bit(i, &held, 32)
+		if (rm->keys[i] == code)
+			return 1;
+	held = rm->chords_on;
+	for_each_set_bit(i, &held, NSWITCH_REMAP_MAX_CHORDS)
+		if (rm->chord_keys[i] == code)
+			return 1;
+	return 0;
+}
+
+/*
+  Releases the keys held through old, a table of target no report uses
+  anymore, NULL for the defaults, unless rm now holds them.
+  Requires pair_lock, for input.
+ */
+/* Worker Thread */
+static void remap_release(const nswitch_remap_defaults *d,
+						  struct nswitch_remap *old, struct nswitch_remap *rm,
+						  struct input_dev *input) {
+	unsigned long held, flags = 0;
+	int i;
+
+	if (rm)
+		spin_lock_irqsave(&rm->lock, flags);
+	if (!old) {
+		/* Unheld keys are filtered out by the input core */
+		for (i = 0; i < d->nkeys; ++i)
+			if (d->keys[i] && !remap_holds(rm, d->keys[i]))
+				input_report_key(input, d->keys[i], 0);
+	} else {
+		held = old->out;
+		for_each_set_bit(i, &held, 32)
+			if (old->keys[i] && !remap_holds(rm, old->keys[i]))
+				input_report_key(input, old->keys[i], 0);
+		held = old->chords_on;
+		for_each_set_bit(i, &held, NSWITCH_REMAP_MAX_CHORDS)
+			if (!remap_holds(rm, old->chord_keys[i]))
+				input_report_key(input, old->chord_keys[i], 0);
+	}
+	if (rm)
+		spin_unlock_irqrestore(&rm->lock, flags);
+	input_sync(input);
+}
+
+/*
+  Requires pair_lock.
+  Input device target reports through, NULL when not registered.
+ */
+static struct input_dev *remap_input(nswitch_dev *ndev,
+									 enum nswitch_remap_target target) {
+	switch (target) {
+	case NSWITCH_REMAP_GAMEPAD:
+		return ndev->pinputs[NSWITCH_GAMEPAD];
+	case NSWITCH_REMAP_KEYBOARD:
+		return ndev->pinputs[NSWITCH_KEYBOARD];
+	default:
+		/* Only the left joycon of a pair reports through it */
+		return ndev->siminput;
+	}
+}
+
+static ssize_t remap_write(struct file *file, struct kobject *kobj,
+						   struct bin_attribute *attr, char *buf,
+						   loff_t off, size_t count) {
+	nswitch_dev *ndev = hid_get_drvdata(to_hid_device(kobj_to_dev(kobj)));
+	const nswitch_remap_header *h = (const void*)buf;
+	struct nswitch_remap *rm, *old;
+	struct input_dev *input;
+
+	/* One table per write */
+	if (off || count < sizeof(*h))
+		return -EINVAL;
+	if (h->magic != NSWITCH_REMAP_MAGIC ||
+		h->target >= NSWITCH_REMAP_TARGETS ||
+		h->count > NSWITCH_REMAP_MAX_ENTRIES ||
+		count != sizeof(*h) + h->count * sizeof(nswitch_remap_entry))
+		return -EINVAL;
+	/* Never used by the handlers of other devices */
+	if ((h->target == NSWITCH_REMAP_DUAL && ndev->info.type != LEFT_JOYCON) ||
+		(h->target == NSWITCH_REMAP_PRO && ndev->info.type != PRO_CONTROLLER))
+		return -EINVAL;
+
+	rm = remap_compile(&remap_defaults[h->target],
+					   (const void*)(h + 1), h->count);
+	if (IS_ERR(rm))
+		return PTR_ERR(rm);
+
+	mutex_lock(&pair_lock);
+	old = rcu_dereference_protected(ndev->remap[h->target],
+									lockdep_is_held(&pair_lock));
+	rcu_assign_pointer(ndev->remap[h->target], rm);
+	input = remap_input(ndev, h->target);
+	if (input) {
+		/* No report uses old anymore */
+		synchronize_rcu();
+		remap_release(&remap_defaults[h->target], old, rm, input);
+	}
+	mutex_unlock(&pair_lock);
+	if (old)
+		kfree_rcu(old, rcu);
+	hid_info(ndev->hdev, "Remap table %d: %d entries", h->target, h->count);
+	return count;
+}
+
+static struct bin_attribute remap_attr = {
+	.attr = { .name = "remap", .mode = S_IWUSR },
+	.size = sizeof(nswitch_remap_header) +
+		NSWITCH_REMAP_MAX_ENTRIES * sizeof(nswitch_remap_entry),
+	.write = remap_write
+};
+
+/* Event Handler */
+int init_remap(nswitch_dev *ndev) {
+	return device_create_bin_file(&ndev->hdev->dev, &remap_attr);
+}
+
+/*
+  Must be called once the device thread is gone
+ */
+/* Event Handler */
+void deinit_remap(nswitch_dev *ndev) {
+	struct nswitch_remap *rm;
+	int i;
+
+	device_remove_bin_file(&ndev->hdev->dev, &remap_attr);
+	for (i = 0; i < NSWITCH_REMAP_TARGETS; ++i) {
+		rm = rcu_dereference_protected(ndev->remap[i], 1);
+		RCU_INIT_POINTER(ndev->remap[i], NULL);
+		if (rm)
+			kfree_rcu(rm, rcu);
+	}
+}
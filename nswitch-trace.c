@@ -0,0 +1,272 @@
+#include "hid-nswitch.h"
+#include "nswitch-uapi.h"
+
+#include <linux/debugfs.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+/*
+  Raw report capture, in <debugfs>/nswitch/<hid device>/trace.
+  While the file is open, input reports and output commands are
+  timestamped and queued, to be read in the format described in
+  nswitch-uapi.h and replayed through uhid by tools/nswitch-replay.
+  <debugfs>/nswitch/<hid device>/stats has tx, the time output reports
+  spend queued, per class. When built with CONFIG_NSWITCH_TIMING=y, it
+  also has the report path timings: event is the time spent in
+  raw_event, dispatch the delay until the worker picks the report up,
+  handler the time spent handling it, without the command exchanges.
+ */
+
+static unsigned int trace_buffer_kb = 256;
+module_param(trace_buffer_kb, uint, 0644);
+MODULE_PARM_DESC(trace_buffer_kb, "Size of each trace buffer, in KiB");
+
+static struct dentry *nswitch_debugfs;
+
+struct nswitch_trace {
+	struct kref ref;
+	struct dentry *dir;
+	struct mutex read_lock;
+
+	/* Protects everything below */
+	struct spinlock lock;
+	DECLARE_KFIFO_PTR(fifo, __u8);
+	__u8 active;
+	__u8 dead;
+	__u64 dropped;
+
+	wait_queue_head_t wait;
+	nswitch_trace_header hdr;
+	size_t hdr_pos;
+};
+
+static void nswitch_trace_free(struct kref *ref) {
+	kfree(container_of(ref, struct nswitch_trace, ref));
+}
+
+/*
+  Called from the transmit worker for output commands
+ */
+/* Event Handler */
+void trace_report(nswitch_dev *ndev, int dir, __u8 *data, int size) {
+	struct nswitch_trace *tr = ndev->trace;
+	nswitch_trace_record rec = {
+		.size = size,
+		.direction = dir
+	};
+	unsigned long flags;
+
+	if (!tr || READ_ONCE(tr->active) != 1)
+		return;
+
+	rec.timestamp = ktime_get_ns();
+	spin_lock_irqsave(&tr->lock, flags);
+	if (tr->active != 1) {
+		spin_unlock_irqrestore(&tr->lock, flags);
+		return;
+	}
+	if (kfifo_avail(&tr->fifo) < sizeof(rec) + size) {
+		++tr->dropped;
+	} else {
+		kfifo_in(&tr->fifo, (__u8*)&rec, sizeof(rec));
+		kfifo_in(&tr->fifo, data, size);
+	}
+	spin_unlock_irqrestore(&tr->lock, flags);
+	wake_up_interruptible(&tr->wait);
+}
+
+static int nswitch_trace_open(struct inode *inode, struct file *file) {
+	nswitch_dev *ndev = inode->i_private;
+	struct nswitch_trace *tr = ndev->trace;
+	struct hid_device *hdev = ndev->hdev;
+	nswitch_trace_header *hdr = &tr->hdr;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&tr->lock, flags);
+	ret = tr->active ? -EBUSY : 0;
+	tr->active = 2; /* Reserved, not recording yet */
+	spin_unlock_irqrestore(&tr->lock, flags);
+	if (ret)
+		return ret;
+
+	ret = kfifo_alloc(&tr->fifo, trace_buffer_kb * 1024, GFP_KERNEL);
+	if (ret) {
+		tr->active = 0;
+		return ret;
+	}
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, NSWITCH_TRACE_MAGIC, sizeof(hdr->magic));
+	hdr->version = NSWITCH_TRACE_VERSION;
+	hdr->bus = hdev->bus;
+	hdr->vendor = hdev->vendor;
+	hdr->product = hdev->product;
+	hdr->dev_version = hdev->version;
+	hdr->country = hdev->country;
+	strscpy(hdr->name, hdev->name, sizeof(hdr->name));
+	strscpy(hdr->phys, hdev->phys, sizeof(hdr->phys));
+	strscpy(hdr->uniq, hdev->uniq, sizeof(hdr->uniq));
+	hdr->rdesc_size = min_t(unsigned int, hdev->dev_rsize, sizeof(hdr->rdesc));
+	memcpy(hdr->rdesc, hdev->dev_rdesc, hdr->rdesc_size);
+	tr->hdr_pos = 0;
+	tr->dropped = 0;
+
+	kref_get(&tr->ref);
+	file->private_data = tr;
+	spin_lock_irqsave(&tr->lock, flags);
+	tr->active = 1;
+	spin_unlock_irqrestore(&tr->lock, flags);
+	return nonseekable_open(inode, file);
+}
+
+static int nswitch_trace_release(struct inode *inode, struct file *file) {
+	struct nswitch_trace *tr = file->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tr->lock, flags);
+	tr->active = 0;
+	if (tr->dropped)
+		pr_warn("nswitch: %llu trace records dropped\n", tr->dropped);
+	spin_unlock_irqrestore(&tr->lock, flags);
+	kfifo_free(&tr->fifo);
+	kref_put(&tr->ref, nswitch_trace_free);
+	return 0;
+}
+
+static ssize_t nswitch_trace_read(struct file *file, char __user *buf,
+								  size_t count, loff_t *ppos) {
+	struct nswitch_trace *tr = file->private_data;
+	unsigned int copied;
+	size_t n;
+	int ret;
+
+	if (tr->hdr_pos < sizeof(tr->hdr)) {
+		n = min(count, sizeof(tr->hdr) - tr->hdr_pos);
+		if (copy_to_user(buf, (__u8*)&tr->hdr + tr->hdr_pos, n))
+			return -EFAULT;
+		tr->hdr_pos += n;
+		return n;
+	}
+
+	for (;;) {
+		if (!kfifo_is_empty(&tr->fifo))
+			break;
+		if (tr->dead)
+			return 0;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(tr->wait,
+									 !kfifo_is_empty(&tr->fifo) || tr->dead))
+			return -ERESTARTSYS;
+	}
+
+	/* Producers only ever add to the fifo, under tr->lock */
+	mutex_lock(&tr->read_lock);
+	ret = kfifo_to_user(&tr->fifo, buf, count, &copied);
+	mutex_unlock(&tr->read_lock);
+	return ret ? ret : copied;
+}
+
+static const struct file_operations nswitch_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = nswitch_trace_open,
+	.release = nswitch_trace_release,
+	.read = nswitch_trace_read,
+	.llseek = no_llseek,
+};
+
+void nswitch_show_timing(struct seq_file *s, const char *name,
+						 nswitch_timing *t) {
+	__u64 count = READ_ONCE(t->count);
+
+	seq_printf(s, "%s: %llu reports, %llu ns/report, %llu ns max\n", name,
+			   count, count ? div64_u64(READ_ONCE(t->total_ns), count) : 0,
+			   READ_ONCE(t->max_ns));
+}
+
+static int nswitch_stats_show(struct seq_file *s, void *unused) {
+	nswitch_dev *ndev = s->private;
+	__u64 coalesced, overruns, lost, duplicated;
+	__s64 slope;
+	__u8 step;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	coalesced = ndev->events_coalesced;
+	overruns = ndev->events_overruns;
+	lost = ndev->clock.lost;
+	duplicated = ndev->clock.duplicated;
+	slope = ndev->clock.slope;
+	step = ndev->clock.step;
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+
+	if (IS_ENABLED(CONFIG_NSWITCH_TIMING)) {
+		nswitch_show_timing(s, "event", &ndev->event_timing);
+		nswitch_show_timing(s, "dispatch", &ndev->dispatch_timing);
+		nswitch_show_timing(s, "handler", &ndev->handler_timing);
+	}
+	seq_printf(s, "event queue: %llu coalesced, %llu overruns\n",
+			   coalesced, overruns);
+	seq_printf(s, "clock: %llu lost, %llu duplicated, %u ticks/report, %lld ns/tick\n",
+			   lost, duplicated, step, slope / 256);
+	seq_printf(s, "sticks: %lld axis events, %lld suppressed\n",
+			   (long long)atomic64_read(&ndev->stick_events),
+			   (long long)atomic64_read(&ndev->stick_suppressed));
+	seq_printf(s, "init: ready %llu us, first event %llu us, calibrated %llu us\n",
+			   div_u64(READ_ONCE(ndev->ready_ns), NSEC_PER_USEC),
+			   div_u64(READ_ONCE(ndev->first_event_ns), NSEC_PER_USEC),
+			   div_u64(READ_ONCE(ndev->calibrated_ns), NSEC_PER_USEC));
+	tx_show_stats(ndev, s);
+	poll_show_stats(s);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(nswitch_stats);
+
+/* Event Handler */
+int init_trace(nswitch_dev *ndev) {
+	struct nswitch_trace *tr;
+
+	if (IS_ERR_OR_NULL(nswitch_debugfs))
+		return -ENODEV;
+
+	tr = kzalloc(sizeof(*tr), GFP_KERNEL);
+	if (!tr)
+		return -ENOMEM;
+	kref_init(&tr->ref);
+	spin_lock_init(&tr->lock);
+	mutex_init(&tr->read_lock);
+	init_waitqueue_head(&tr->wait);
+
+	ndev->trace = tr;
+	tr->dir = debugfs_create_dir(dev_name(&ndev->hdev->dev), nswitch_debugfs);
+	debugfs_create_file("trace", 0400, tr->dir, ndev, &nswitch_trace_fops);
+	debugfs_create_file("stats", 0444, tr->dir, ndev, &nswitch_stats_fops);
+	return 0;
+}
+
+/*
+  Must be called once no more report can be sent or received.
+  A reader blocked in read() gets EOF, later reads fail with -EIO once
+  debugfs removed the file. The trace is freed when they close it.
+ */
+/* Event Handler */
+void deinit_trace(nswitch_dev *ndev) {
+	struct nswitch_trace *tr = ndev->trace;
+
+	tr->dead = 1;
+	wake_up_interruptible(&tr->wait);
+	debugfs_remove_recursive(tr->dir);
+	ndev->trace = NULL;
+	kref_put(&tr->ref, nswitch_trace_free);
+}
+
+void nswitch_trace_register(void) {
+	nswitch_debugfs = debugfs_create_dir("nswitch", NULL);
+}
+
+void nswitch_trace_unregister(void) {
+	debugfs_remove_recursive(nswitch_debugfs);
+}
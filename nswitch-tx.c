@@ -0,0 +1,336 @@
+#include "hid-nswitch.h"
+
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+
+/*
+  Output reports are copied to rings of preallocated slots, one per
+  device and per class. A scheduler shared by all the devices picks
+  the next report, and hands it to the send work of its device, which
+  sleeps in the transport: a slow device only delays its own reports.
+  Queuing never sleeps nor waits on the transport: it is safe from any
+  context, and the event handler never waits on a transmit.
+
+  The scheduler shares the output link between the devices:
+  - classes are served by deficit round robin, in priority order, each
+    sending up to tx_weights[class] reports per round, so that a busy
+    class cannot starve the others
+  - devices are served round robin within a class, skipping the ones
+    still sending their previous report
+  - each device gets at most one report every tx_interval_us, off by
+    default: IR camera acknowledgements and command exchanges are sent
+    as soon as possible
+  - all devices together get at most tx_budget reports per second
+ */
+
+enum tx_class {
+	TX_MODE,
+	TX_RUMBLE,
+	TX_LEDS,
+	TX_BULK,
+	TX_CLASSES
+};
+
+static const char *const tx_class_names[TX_CLASSES] = {
+	"mode", "rumble", "leds", "bulk"
+};
+
+static unsigned int tx_interval_us;
+module_param(tx_interval_us, uint, 0644);
+MODULE_PARM_DESC(tx_interval_us, "Minimum delay between two output reports to a device, in us, 0 for none");
+
+static unsigned int tx_budget;
+module_param(tx_budget, uint, 0644);
+MODULE_PARM_DESC(tx_budget, "Output reports per second over all devices, 0 for no limit");
+
+static unsigned int tx_weights[TX_CLASSES] = { 8, 4, 2, 1 };
+module_param_array(tx_weights, uint, NULL, 0644);
+MODULE_PARM_DESC(tx_weights, "Reports per round for mode changes, rumble, leds and other commands");
+
+#define NSWITCH_TX_SLOTS 16
+
+typedef struct {
+	output_command oc;
+	__u64 queued_ns;
+} nswitch_tx_slot;
+
+typedef struct {
+	nswitch_tx_slot slots[NSWITCH_TX_SLOTS];
+	unsigned int head;
+	unsigned int tail;
+	nswitch_timing timing; /* Only updated by the send work */
+} nswitch_tx_queue;
+
+struct nswitch_tx {
+	nswitch_dev *ndev;
+	struct list_head list; /* In tx_devices, empty once stopped */
+	struct work_struct work; /* Sends the report picked by the scheduler */
+	nswitch_tx_slot sending;
+	enum tx_class sending_class;
+	__u8 busy; /* From the pick to the end of the send */
+	__u64 next_ns;
+	nswitch_tx_queue queues[TX_CLASSES];
+	unsigned int depth;
+	unsigned int max_depth;
+	__u64 full;
+};
+
+static void nswitch_tx_schedule(struct work_struct *work);
+
+/* Protects everything below, and the devices queues and busy flags */
+static DEFINE_SPINLOCK(tx_lock);
+static LIST_HEAD(tx_devices);
+static int tx_credits[TX_CLASSES];
+static __u64 tx_next_ns;
+
+static DECLARE_WAIT_QUEUE_HEAD(tx_wait);
+static DECLARE_DELAYED_WORK(tx_scheduler, nswitch_tx_schedule);
+
+static enum tx_class tx_classify(const output_command *oc) {
+	switch (oc->report) {
+	case RUMBLE_REPORT:
+		return TX_RUMBLE;
+	case MCU_REPORT:
+		/* Acknowledges IR camera fragments */
+		return TX_MODE;
+	case USB_COMMAND:
+		/* The joycon does not answer anything else before them */
+		return TX_MODE;
+	case BASIC:
+		break;
+	default:
+		return TX_BULK;
+	}
+
+	switch (oc->subcommand) {
+	case SET_INPUT_REPORT_MODE:
+	case SET_HCI:
+	case SET_IMU:
+	case SET_IMU_SENSITIVITY:
+	case RESET_NFC_IR:
+	case SET_NFC_IR:
+	case SET_NFC_IR_STATE:
+		return TX_MODE;
+	case SET_VIBRATION:
+		return TX_RUMBLE;
+	case SET_PLAYER_LIGHTS:
+	case SET_HOME_LIGHT:
+		return TX_LEDS;
+	default:
+		return TX_BULK;
+	}
+}
+
+/*
+  Requires tx_lock.
+  Returns the device to send for, busy with its report in sending, or
+  NULL and the delay until a report may be sent in wait, 0 when none
+  is queued or all the devices with one are busy.
+ */
+static struct nswitch_tx *tx_pick(__u64 now, __u64 *wait) {
+	unsigned int budget = READ_ONCE(tx_budget);
+	struct nswitch_tx *tx;
+	nswitch_tx_queue *q;
+	__u64 next = U64_MAX;
+	int c, refilled = 0, starved;
+
+	*wait = 0;
+	if (budget && now < tx_next_ns) {
+		*wait = tx_next_ns - now;
+		return NULL;
+	}
+
+again:
+	starved = 0;
+	for (c = 0; c < TX_CLASSES; ++c) {
+		list_for_each_entry(tx, &tx_devices, list) {
+			q = &tx->queues[c];
+			if (q->head == q->tail || tx->busy)
+				continue;
+			if (now < tx->next_ns) {
+				next = min(next, tx->next_ns);
+				continue;
+			}
+			if (tx_credits[c] <= 0) {
+				starved = 1;
+				continue;
+			}
+			goto found;
+		}
+	}
+	if (starved && !refilled) {
+		for (c = 0; c < TX_CLASSES; ++c)
+			tx_credits[c] = max(READ_ONCE(tx_weights[c]), 1U);
+		refilled = 1;
+		goto again;
+	}
+	if (next != U64_MAX)
+		*wait = next - now;
+	return NULL;
+
+found:
+	--tx_credits[c];
+	tx->sending = q->slots[q->tail++ % NSWITCH_TX_SLOTS];
+	tx->sending_class = c;
+	tx->busy = 1;
+	--tx->depth;
+	tx->next_ns = now + (__u64)READ_ONCE(tx_interval_us) * NSEC_PER_USEC;
+	if (budget)
+		tx_next_ns = now + div_u64(NSEC_PER_SEC, budget);
+	/* Served last next time */
+	list_move_tail(&tx->list, &tx_devices);
+	return tx;
+}
+
+/*
+  Hands every report that may be sent now to the send work of its
+  device, never sleeps
+ */
+/* Worker Thread */
+static void nswitch_tx_schedule(struct work_struct *work) {
+	struct nswitch_tx *tx;
+	unsigned long flags;
+	__u64 wait;
+
+	for (;;) {
+		spin_lock_irqsave(&tx_lock, flags);
+		tx = tx_pick(ktime_get_ns(), &wait);
+		spin_unlock_irqrestore(&tx_lock, flags);
+		if (!tx)
+			break;
+		queue_work(system_highpri_wq, &tx->work);
+	}
+	if (wait)
+		queue_delayed_work(system_highpri_wq, &tx_scheduler,
+						   usecs_to_jiffies(div_u64(wait, NSEC_PER_USEC) + 1));
+}
+
+/* Worker Thread */
+static void nswitch_tx_send(struct work_struct *work) {
+	struct nswitch_tx *tx = container_of(work, struct nswitch_tx, work);
+	nswitch_tx_slot *slot = &tx->sending;
+	unsigned long flags;
+
+	nswitch_timing_add(&tx->queues[tx->sending_class].timing, slot->queued_ns);
+	trace_report(tx->ndev, NSWITCH_TRACE_OUT, (void*)&slot->oc,
+				 ns_output_size(&slot->oc));
+	hid_hw_output_report(tx->ndev->hdev, (void*)&slot->oc,
+						 ns_output_size(&slot->oc));
+
+	spin_lock_irqsave(&tx_lock, flags);
+	tx->busy = 0;
+	spin_unlock_irqrestore(&tx_lock, flags);
+	wake_up_all(&tx_wait);
+	/* Its next report, if any */
+	queue_delayed_work(system_highpri_wq, &tx_scheduler, 0);
+}
+
+/*
+  Safe from any context.
+  Returns -ENOSPC when all the slots of the report class are in use.
+ */
+int tx_queue(nswitch_dev *ndev, output_command *oc) {
+	struct nswitch_tx *tx = ndev->tx;
+	nswitch_tx_queue *q = &tx->queues[tx_classify(oc)];
+	nswitch_tx_slot *slot;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tx_lock, flags);
+	if (list_empty(&tx->list)) {
+		spin_unlock_irqrestore(&tx_lock, flags);
+		return -ENODEV;
+	}
+	if (q->head - q->tail == NSWITCH_TX_SLOTS) {
+		++tx->full;
+		spin_unlock_irqrestore(&tx_lock, flags);
+		return -ENOSPC;
+	}
+	slot = &q->slots[q->head++ % NSWITCH_TX_SLOTS];
+	slot->oc = *oc;
+	/* Once per output report, always timed */
+	slot->queued_ns = ktime_get_ns();
+	if (++tx->depth > tx->max_depth)
+		tx->max_depth = tx->depth;
+	spin_unlock_irqrestore(&tx_lock, flags);
+
+	/* Does not cut short a pacing delay */
+	queue_delayed_work(system_highpri_wq, &tx_scheduler, 0);
+	return 0;
+}
+
+void tx_show_stats(nswitch_dev *ndev, struct seq_file *s) {
+	struct nswitch_tx *tx = ndev->tx;
+	unsigned int depth, max_depth;
+	unsigned long flags;
+	char name[16];
+	__u64 full;
+	int c;
+
+	spin_lock_irqsave(&tx_lock, flags);
+	depth = tx->depth;
+	max_depth = tx->max_depth;
+	full = tx->full;
+	spin_unlock_irqrestore(&tx_lock, flags);
+
+	for (c = 0; c < TX_CLASSES; ++c) {
+		snprintf(name, sizeof(name), "tx %s", tx_class_names[c]);
+		nswitch_show_timing(s, name, &tx->queues[c].timing);
+	}
+	seq_printf(s, "tx queue: %u queued, %u max, %llu dropped\n",
+			   depth, max_depth, full);
+}
+
+/* Event Handler */
+int init_tx(nswitch_dev *ndev) {
+	struct nswitch_tx *tx;
+	unsigned long flags;
+
+	tx = kzalloc(sizeof(*tx), GFP_KERNEL);
+	if (!tx)
+		return -ENOMEM;
+	tx->ndev = ndev;
+	INIT_WORK(&tx->work, nswitch_tx_send);
+	ndev->tx = tx;
+	spin_lock_irqsave(&tx_lock, flags);
+	list_add_tail(&tx->list, &tx_devices);
+	spin_unlock_irqrestore(&tx_lock, flags);
+	return 0;
+}
+
+/*
+  Must be called once nothing can queue reports anymore.
+  Waits for the report being sent, reports still queued are dropped.
+ */
+/* Event Handler */
+void tx_stop(nswitch_dev *ndev) {
+	struct nswitch_tx *tx = ndev->tx;
+	unsigned long flags;
+	int c;
+
+	spin_lock_irqsave(&tx_lock, flags);
+	list_del_init(&tx->list);
+	for (c = 0; c < TX_CLASSES; ++c)
+		tx->queues[c].tail = tx->queues[c].head;
+	tx->depth = 0;
+	spin_unlock_irqrestore(&tx_lock, flags);
+	/* No longer picked, the scheduler may still be queuing the last one */
+	wait_event(tx_wait, !READ_ONCE(tx->busy));
+	flush_work(&tx->work);
+}
+
+/*
+  The queue statistics stay readable until then
+ */
+/* Event Handler */
+void deinit_tx(nswitch_dev *ndev) {
+	tx_stop(ndev);
+	kfree(ndev->tx);
+	ndev->tx = NULL;
+}
+
+/*
+  Called once all the devices are gone
+ */
+void nswitch_tx_unregister(void) {
+	cancel_delayed_work_sync(&tx_scheduler);
+}
@@ -0,0 +1,222 @@
+#ifndef __NSWITCH_UAPI_H
+#define __NSWITCH_UAPI_H
+
+/*
+ * HID driver for Nintendo Switch peripherals
+ * Copyright (c) 2018 Nabil Boutemeur <nabil.boutemeur@gmail.com>
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+  User space interface of the /dev/nswitchN character devices.
+  Shared with the driver, only use types from linux/types.h here.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* sizeof(nswitch_dev_input_report) */
+#define NSWITCH_REPORT_SIZE 50
+
+/*
+  mmap offsets.
+  The report ring is mapped at offset NSWITCH_MMAP_RING: a header page
+  followed by the records, at header->records_offset.
+  Only one reader at a time may map the ring.
+ */
+#define NSWITCH_MMAP_RING 0
+
+/*
+  The latest decoded state is mapped read-only, one page at offset
+  NSWITCH_MMAP_STATE. seq is odd while the driver updates the page:
+
+	do {
+		seq = page->seq;
+		rmb();
+		copy = *page;
+		rmb();
+	} while ((seq & 1) || seq != page->seq);
+ */
+#define NSWITCH_MMAP_STATE 0x10000000
+
+typedef struct {
+	__u64 timestamp; /* CLOCK_MONOTONIC, in ns, at reception */
+	__u8 report[NSWITCH_REPORT_SIZE];
+	__u8 __pad[6];
+} nswitch_ring_record;
+
+/*
+  Single producer (the driver), single consumer ring.
+  The reader consumes records between tail and head, then publishes
+  the new tail with a release store.
+  When the ring is full, new reports are dropped and counted in overruns.
+ */
+typedef struct {
+	__u32 head;
+	__u32 tail;
+	__u32 nrecords; /* Power of two */
+	__u32 records_offset;
+	__u64 produced;
+	__u64 overruns;
+} nswitch_ring_header;
+
+typedef struct {
+	__u32 seq;
+	__u8 report_type;
+	__u8 timer;
+	__u8 battery; /* 0 to 8 */
+	__u8 connection;
+	__u64 timestamp; /* CLOCK_MONOTONIC, in ns, at reception */
+	__u64 updates;
+	__u32 buttons; /* standard_button_state, little endian bitfield */
+	__s16 sticks[4]; /* LX, LY, RX, RY. Calibrated, -32767 to 32767 */
+	__s16 accel[3]; /* Latest IMU sample */
+	__s16 gyro[3]; /* Latest IMU sample, factory offset and bias removed */
+	/*
+	  CLOCK_MONOTONIC, in ns, when the device sampled the report,
+	  reconstructed from its timer without the Bluetooth jitter
+	 */
+	__u64 sample_time;
+	__u64 lost; /* Reports missed, from the device timer */
+	__u64 duplicated; /* Reports received twice */
+} nswitch_state_page;
+
+/*
+  Asynchronous commands.
+  Commands submitted with NSWITCH_IOC_SUBMIT are run in order by the
+  driver command path, and their completions are read() from the same
+  file descriptor, as nswitch_cmd_completion records.
+  The eventfd registered with NSWITCH_IOC_SET_EVENTFD is signaled
+  for each completion.
+  At most NSWITCH_MAX_INFLIGHT commands may be submitted or unread
+  per file descriptor; NSWITCH_IOC_SUBMIT returns the number of
+  commands it queued, or -EAGAIN when none could be.
+ */
+#define NSWITCH_MAX_INFLIGHT 64
+
+typedef struct {
+	__u64 user_data;
+	__u8 report; /* 0x01: subcommand, 0x10: rumble only, 0x11: MCU */
+	__u8 rumble[8];
+	__u8 subcommand;
+	__u8 args[54];
+} nswitch_cmd;
+
+typedef struct {
+	__u64 user_data;
+	__s32 status; /* 0 or -errno */
+	__u8 ack;
+	__u8 reply_to;
+	__u8 data[35];
+	__u8 __pad;
+} nswitch_cmd_completion;
+
+typedef struct {
+	__u64 cmds; /* Pointer to an array of nswitch_cmd */
+	__u32 count;
+	__u32 __pad;
+} nswitch_cmd_batch;
+
+/*
+  Trace format of <debugfs>/nswitch/<hid device>/trace.
+  A nswitch_trace_header, then nswitch_trace_record headers, each
+  followed by size bytes of raw report.
+ */
+#define NSWITCH_TRACE_MAGIC "NSWTRACE"
+#define NSWITCH_TRACE_VERSION 1
+#define NSWITCH_TRACE_RDESC_MAX 4096
+
+enum nswitch_trace_direction {
+	NSWITCH_TRACE_IN,
+	NSWITCH_TRACE_OUT
+};
+
+typedef struct {
+	char magic[8];
+	__u32 version;
+	__u16 bus;
+	__u16 __pad;
+	__u32 vendor;
+	__u32 product;
+	__u32 dev_version;
+	__u32 country;
+	char name[128];
+	char phys[64];
+	char uniq[64];
+	__u32 rdesc_size;
+	__u8 rdesc[NSWITCH_TRACE_RDESC_MAX];
+} nswitch_trace_header;
+
+typedef struct {
+	__u64 timestamp; /* CLOCK_MONOTONIC, in ns */
+	__u16 size;
+	__u8 direction;
+	__u8 __pad[5];
+} nswitch_trace_record;
+
+/*
+  Remap tables, written in a single write() to the remap sys file of
+  the HID device: a nswitch_remap_header then count entries.
+  A table replaces the previous one of its target; a table without
+  entries restores the default mapping. Dual tables go to the left
+  joycon, that reports for the pair, pro ones to a pro controller.
+  Sources are the button bits and the axes of the target:
+  - gamepad and keyboard: the 11 simple buttons, in the ns_simple_buttons
+    order, and the stick of the joypad (X, Y, gamepad only);
+  - dual and pro: the 24 standard_button_state bits, and the sticks
+    (X, Y, RX, RY).
+  Keys may be any keyboard key (KEY_ESC to KEY_MICMUTE) or joystick
+  button (BTN_MISC to BTN_9, BTN_JOYSTICK to BTN_THUMBR, BTN_DPAD_*,
+  BTN_TRIGGER_HAPPY1 to 40), every target declares them all; 0 drops a
+  button. Keys held when a table is replaced are released.
+  Buttons not listed keep their default key.
+ */
+#define NSWITCH_REMAP_MAGIC 0x4d52534e /* "NSRM" */
+#define NSWITCH_REMAP_MAX_ENTRIES 64
+#define NSWITCH_REMAP_MAX_CHORDS 8
+
+enum nswitch_remap_target {
+	NSWITCH_REMAP_GAMEPAD,
+	NSWITCH_REMAP_KEYBOARD,
+	NSWITCH_REMAP_DUAL,
+	NSWITCH_REMAP_PRO,
+	NSWITCH_REMAP_TARGETS
+};
+
+enum nswitch_remap_type {
+	NSWITCH_REMAP_KEY = 1, /* src reports code */
+	NSWITCH_REMAP_TOGGLE, /* Each press of src flips code, code 0 keeps its key */
+	NSWITCH_REMAP_CHORD, /* src and src2 held together report code instead */
+	NSWITCH_REMAP_AXIS /* Output axis src reports axis src2 */
+};
+
+/* nswitch_remap_entry flags */
+#define NSWITCH_REMAP_INVERT 0x01 /* Axis only */
+
+typedef struct {
+	__u32 magic;
+	__u8 target; /* enum nswitch_remap_target */
+	__u8 count;
+	__u16 __pad;
+} nswitch_remap_header;
+
+typedef struct {
+	__u8 type; /* enum nswitch_remap_type */
+	__u8 src;
+	__u8 src2;
+	__u8 flags;
+	__u16 code; /* Key code from linux/input-event-codes.h */
+	__u16 __pad;
+} nswitch_remap_entry;
+
+#define NSWITCH_IOC_MAGIC 'N'
+#define NSWITCH_IOC_SET_EVENTFD _IOW(NSWITCH_IOC_MAGIC, 0x01, __s32)
+#define NSWITCH_IOC_SUBMIT _IOW(NSWITCH_IOC_MAGIC, 0x02, nswitch_cmd_batch)
+
+#endif
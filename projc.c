@@ -0,0 +1,154 @@
+#include "hid-nswitch.h"
+
+/*
+  Pro controller personality: a joypad with both sticks, the d-pad as
+  a hat and rumble through force feedback, and a motion sensors device
+  with each IMU sample.
+  The pro controller has no partner, its reports are handled inline.
+  Both devices count as users of the full reports and the IMU.
+ */
+
+/*
+  Keys of the standard_button_state bits, as in dual joycon mode.
+  0 for the d-pad and the joycon only buttons.
+ */
+const short ns_pro_buttons[24] = {
+	BTN_Y, BTN_X, BTN_B, BTN_A,
+	0, 0, /* Right SL/SR buttons */
+	BTN_TR, BTN_TR2, /* R/ZR */
+	BTN_2, BTN_3, /* Plus/Minus */
+	BTN_THUMBR, BTN_THUMBL,
+	BTN_4, BTN_5, /* Home/Capture */
+	0, 0, /* Reserved/Charging Grip */
+	0, 0, 0, 0, /* D-pad */
+	0, 0, /* Left SL/SR buttons */
+	BTN_TL, BTN_TL2, /* L/ZL */
+};
+
+static const int pro_sticks[4] = { ABS_X, ABS_Y, ABS_RX, ABS_RY };
+
+/*
+  Called from the memless force feedback timer, only queues the report
+ */
+/* Event Handler */
+static int projc_play_effect(struct input_dev *input, void *data,
+							 struct ff_effect *effect) {
+	nswitch_dev *ndev = input_get_drvdata(input);
+	output_command oc = { RUMBLE_REPORT };
+	unsigned long flags;
+
+	if (effect->type != FF_RUMBLE)
+		return 0;
+	ns_encode_rumble(oc.rumble_data, effect->u.rumble.strong_magnitude);
+	ns_encode_rumble(oc.rumble_data + 4, effect->u.rumble.weak_magnitude);
+	spin_lock_irqsave(&ndev->cmd_lock, flags);
+	nd_send_cmd(ndev, &oc);
+	spin_unlock_irqrestore(&ndev->cmd_lock, flags);
+	return 0;
+}
+
+/* Event Handler */
+static int prepare_projoypad(nswitch_dev *ndev) {
+	calibration_data *cd = &ndev->calibration;
+	struct input_dev *input;
+	unsigned int i;
+	int ret;
+
+	input = nd_alloc_input(ndev, "Pro Controller");
+	if (!input)
+		return -ENOMEM;
+
+	set_bit(EV_KEY, input->evbit);
+	for (i = 0; i < ARRAY_SIZE(ns_pro_buttons); ++i)
+		if (ns_pro_buttons[i])
+			set_bit(ns_pro_buttons[i], input->keybit);
+	nd_setup_remap_keys(input);
+
+	set_bit(EV_ABS, input->evbit);
+	set_stick_abs(input, ABS_X, ABS_Y, cd->left_stick);
+	set_stick_abs(input, ABS_RX, ABS_RY, cd->right_stick);
+	input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
+	input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
+
+	set_bit(FF_RUMBLE, input->ffbit);
+	ret = input_ff_create_memless(input, NULL, projc_play_effect);
+	if (ret)
+		goto err_free;
+	ret = input_register_device(input);
+	if (ret)
+		goto err_free;
+	ndev->siminput = input;
+
+	input = nd_alloc_input(ndev, "Motion Sensors");
+	if (!input)
+		return 0;
+	nd_setup_motion(input);
+	if (input_register_device(input)) {
+		hid_warn(ndev->hdev, "cannot register the motion sensors\n");
+		input_free_device(input);
+		return 0;
+	}
+	ndev->axis = input;
+	return 0;
+
+err_free:
+	input_free_device(input);
+	return ret;
+}
+
+/* Event Handler */
+void projc_prepare(nswitch_dev *ndev) {
+	if (ndev->ledcache >> 4 != 0xF) {
+		set_leds(ndev, 0xF0);
+	}
+	/* Only SIMPLE reports have the selection buttons */
+	if (ndev->frame.type != SIMPLE)
+		return;
+	if (ndev->state.simple.right) {
+		hid_info(ndev->hdev, "ProJC validated");
+		if (prepare_projoypad(ndev)) {
+			hid_err(ndev->hdev, "cannot register the pro controller\n");
+			return;
+		}
+		ndev->wants_imu = 1;
+		nd_set_mode(ndev, NSWITCH_SELECTING, NSWITCH_PRO);
+		/* Full reports and IMU once opened */
+		nd_stream_update(ndev);
+	} else if (ndev->state.simple.down) {
+		hid_info(ndev->hdev, "ProJC unvalidated");
+	}
+}
+
+/* Event Handler */
+void report_pro(nswitch_dev *ndev) {
+	struct input_dev *siminput = ndev->siminput;
+	const ns_frame *f = &ndev->frame;
+	unsigned long changed;
+	__u16 sticks[4];
+	int hat_x, hat_y;
+
+	switch (f->type) {
+	case STANDARD:
+	case STD_NFCIR:
+	case STD_UNKNOWN0:
+	case STD_UNKNOWN1:
+		break;
+	default:
+		return;
+	}
+
+	nd_report_keys(ndev, NSWITCH_REMAP_PRO, siminput, f->buttons);
+	hat_x = (int)ns_button(f, NS_BTN_RIGHT) - (int)ns_button(f, NS_BTN_LEFT);
+	hat_y = (int)ns_button(f, NS_BTN_DOWN) - (int)ns_button(f, NS_BTN_UP);
+	input_report_abs(siminput, ABS_HAT0X, hat_x);
+	input_report_abs(siminput, ABS_HAT0Y, hat_y);
+	memcpy(sticks, f->sticks, sizeof(sticks));
+	changed = ndev->sticks_changed | nd_gyro_aim(ndev, sticks);
+	nd_report_sticks(ndev, NSWITCH_REMAP_PRO, siminput, pro_sticks, sticks,
+					 0xf, changed);
+	input_set_timestamp(siminput, ns_to_ktime(ndev->state_time));
+	input_sync(siminput);
+
+	if (ndev->axis)
+		nd_report_motion(ndev, ndev->axis, f);
+}
@@ -1,14 +1,6 @@
 #include "hid-nswitch.h"
 
-/*
-  16, 17, 18, 19, 8, 21, 13, 20, 22, 23, 11, 5 bits per index
- */
-const __u64 ljc_bit_offsets = 0x2EF6A36A89CA30;
-
-/*
-  3, 0, 1, 2, 12, 5, 9, 4, 6, 7, 10, 5 bits per index
- */
-const __u64 rjc_bit_offsets = 0x28E6224AC10403;
+#include <linux/rcupdate.h>
 
 const short ns_simple_buttons[] = {
 	BTN_A, BTN_X, BTN_B, BTN_Y,
@@ -31,380 +23,303 @@ const short ns_buttons[] = {
 	BTN_TL, BTN_TL2, /* L/ZL */
 };
 
-static void prepare_dual_joypad(nswitch_dev *ndev);
+static const int dual_sticks[4] = { ABS_X, ABS_Y, ABS_RX, ABS_RY };
+
+static void prepare_dual_joypad(nswitch_dev *rdev);
 
+/*
+  Applies the calibration read by the init sequence to the axes the
+  device reports, registered with the defaults
+ */
 /* Event Handler */
-static void report_simple_keys(nswitch_dev *ndev) {
-	struct input_dev *siminput = ndev->siminput;
-	__u64 offsets = 0;
-	nswitch_dev_full_report *fr;
-	int idx;
-	const short *ev = ns_simple_buttons;
-	stick_state *ss;
-	__u8 i;
-	calibration_data *cd;
-
-	union {
-		__u32 rbuttons;
-		standard_button_state sbs;
-	} buttons;
-
-	switch (ndev->state.input_report) {
-	case REPLY:
-	case SIMPLE:
-	case NFC_UPDATE:
-		hid_info(ndev->hdev, "I don't want this...");
-		return;
-	default:
+void update_stick_ranges(nswitch_dev *ndev) {
+	calibration_data *cd = &ndev->calibration;
+	nswitch_dev *partner;
+
+	mutex_lock(&pair_lock);
+	partner = rcu_dereference_protected(ndev->right, lockdep_is_held(&pair_lock));
+	switch (atomic_read(&ndev->mode)) {
+	case NSWITCH_SINGLE:
+		if (!ndev->pinputs[NSWITCH_GAMEPAD])
+			break;
+		if (ndev->info.type == LEFT_JOYCON)
+			set_stick_abs(ndev->pinputs[NSWITCH_GAMEPAD], ABS_X, ABS_Y, cd->left_stick);
+		else
+			set_stick_abs(ndev->pinputs[NSWITCH_GAMEPAD], ABS_X, ABS_Y, cd->right_stick);
 		break;
-	}
-
-	fr = &ndev->state.full;
-	buttons.rbuttons = 0;
-	buttons.sbs = fr->buttons;
-	cd = &ndev->calibration;
-	switch (ndev->info.type) {
-	case LEFT_JOYCON:
-		offsets = ljc_bit_offsets;
-		ss = &fr->left_stick;
+	case NSWITCH_DUAL_LEFT:
+		set_stick_abs(ndev->siminput, ABS_X, ABS_Y, cd->left_stick);
+		break;
+	case NSWITCH_DUAL_RIGHT:
+		if (partner)
+			set_stick_abs(partner->siminput, ABS_RX, ABS_RY, cd->right_stick);
 		break;
-	case RIGHT_JOYCON:
-		offsets = rjc_bit_offsets;
-		ss = &fr->right_stick;
+	case NSWITCH_PRO:
+		set_stick_abs(ndev->siminput, ABS_X, ABS_Y, cd->left_stick);
+		set_stick_abs(ndev->siminput, ABS_RX, ABS_RY, cd->right_stick);
 		break;
 	default:
-		return;
-	}
-	i = 0;
-	while (i < 11) {
-		idx = (offsets >> (i * 5)) & 0x1F;
-		input_report_key(siminput, *ev++, (buttons.rbuttons >> idx) & 1);
-		++i;
+		/* Set up from the calibration, when selected */
+		break;
 	}
-
-	input_report_abs(siminput, ABS_X, ss->x);
-	input_report_abs(siminput, ABS_Y, ss->y);
-	input_sync(siminput);
+	mutex_unlock(&pair_lock);
 }
 
+/*
+  The right joycon confirms or cancels the pairing
+ */
 /* Event Handler */
-static void report_simple_mouse(nswitch_dev *ndev) {
-	struct input_dev *siminput = ndev->siminput;
-	nswitch_dev_full_report *fr;
-	__u8 i;
-	__u8 report_rel = 0;
-	sax_calibration_data *sax = &ndev->calibration.sax;
-	__s16 m[3];
-
-	switch (ndev->state.input_report) {
-	case REPLY:
-	case SIMPLE:
-	case NFC_UPDATE:
-		hid_info(ndev->hdev, "I don't want this...");
+void validate_dual(nswitch_dev *ndev) {
+	if (ndev->info.type == LEFT_JOYCON || ndev->frame.type != SIMPLE)
 		return;
-	default:
-		break;
-	}
-
-	i = 0;
-	fr = &ndev->state.full;
-	switch (ndev->info.type) {
-	case LEFT_JOYCON:
-		input_report_key(siminput, BTN_LEFT, fr->buttons.right);
-		input_report_key(siminput, BTN_MIDDLE, fr->buttons.up);
-		input_report_key(siminput, BTN_RIGHT, fr->buttons.down);
-		report_rel = ndev->state.full.buttons.zl;
-		break;
-	case RIGHT_JOYCON:
-		input_report_key(siminput, BTN_LEFT, fr->buttons.a);
-		input_report_key(siminput, BTN_MIDDLE, fr->buttons.y);
-		input_report_key(siminput, BTN_RIGHT, fr->buttons.b);
-		report_rel = ndev->state.full.buttons.zr;
-		break;
-	default:
-		return;
-	}
-
-	if (report_rel) {
-		i = 0;
-		while (i < 3) {
-			m[i] = fr->ax6[0][1][i] - sax->gyroscope_origin[i];
-			//m[i] = m[i] * ndev->calibration.gyro_coeff[i];
-			++i;
-		}
-		input_report_rel(siminput, REL_X, m[2] / 20);
-		input_report_rel(siminput, REL_Y, -(m[1] / 20));
+	if (ndev->state.simple.down) {
+		prepare_dual_joypad(ndev);
+	} else if (ndev->state.simple.left) {
+		nd_unpair(ndev);
 	}
-	input_sync(siminput);
 }
 
+/*
+  Publishes the frame of ndev for its partner, and takes the partner's
+  one, written by the partner thread
+ */
 /* Event Handler */
-static void prepare_simple_joypad(nswitch_dev *ndev) {
-	calibration_data *cd;
-	unsigned int i;
+static void dual_exchange_frame(nswitch_dev *ndev, nswitch_dev *partner,
+								__u32 *buttons, __u16 sticks[4]) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	ndev->pair_buttons = ndev->frame.buttons;
+	memcpy(ndev->pair_sticks, ndev->frame.sticks, sizeof(ndev->pair_sticks));
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
+
+	spin_lock_irqsave(&partner->state_lock, flags);
+	*buttons = partner->pair_buttons;
+	memcpy(sticks, partner->pair_sticks, sizeof(partner->pair_sticks));
+	spin_unlock_irqrestore(&partner->state_lock, flags);
+}
 
-	cd = &ndev->calibration;
-	ndev->siminput = input_allocate_device();
-	input_set_drvdata(ndev->siminput, ndev);
-	ndev->siminput->dev.parent = &ndev->hdev->dev;
-	ndev->siminput->id.bustype = ndev->hdev->bus;
-	ndev->siminput->id.vendor = ndev->hdev->vendor;
-	ndev->siminput->id.product = ndev->hdev->product;
-	ndev->siminput->id.version = ndev->hdev->version;
-	ndev->siminput->name = kasprintf(GFP_KERNEL, "%s Simple Emulated Joypad" , ndev->hdev->name);
-
-	set_bit(EV_KEY, ndev->siminput->evbit);
-	for (i = 0; i < ARRAY_SIZE(ns_simple_buttons); ++i)
-		set_bit(ns_simple_buttons[i], ndev->siminput->keybit);
-
-	set_bit(EV_ABS, ndev->siminput->evbit);
-
-	set_bit(ABS_X, ndev->siminput->absbit);
-	set_bit(ABS_Y, ndev->siminput->absbit);
-
-	switch (ndev->info.type) {
-	case LEFT_JOYCON:
-		input_set_abs_params(ndev->siminput, ABS_X,
-							 cd->left_stick.xcenter - cd->left_stick.xmin_offset,
-							 cd->left_stick.xcenter + cd->left_stick.xmax_offset, 10, 0);
-		input_set_abs_params(ndev->siminput, ABS_Y,
-							 cd->left_stick.ycenter - cd->left_stick.ymin_offset,
-							 cd->left_stick.ycenter + cd->left_stick.ymax_offset, 10, 0);
-		break;
-	case RIGHT_JOYCON:
-		input_set_abs_params(ndev->siminput, ABS_X,
-							 cd->right_stick.xcenter - cd->right_stick.xmin_offset,
-							 cd->right_stick.xcenter + cd->right_stick.xmax_offset, 10, 0);
-		input_set_abs_params(ndev->siminput, ABS_Y,
-							 cd->right_stick.ycenter - cd->right_stick.ymin_offset,
-							 cd->right_stick.ycenter + cd->right_stick.ymax_offset, 10, 0);
+/*
+  Both halves report through the input device of the left one.
+  Requires rcu_read_lock, for the partner.
+ */
+/* Event Handler */
+static void report_dual_keys(nswitch_dev *ndev, nswitch_dev *left,
+							 nswitch_dev *right) {
+	struct input_dev *siminput = left->siminput;
+	unsigned long owned, changed;
+	__u16 sticks[4];
+	__u32 buttons;
+	int own = ndev == left ? 0 : 2;
+
+	switch (ndev->frame.type) {
+	case STANDARD:
+	case STD_NFCIR:
+	case STD_UNKNOWN0:
+	case STD_UNKNOWN1:
 		break;
 	default:
-		hid_info(ndev->hdev, "Unknown joycon type at %p...", ndev);
-		dump_mem(ndev->hdev, (void*)&ndev->info, sizeof(ndev->info));
 		return;
 	}
-	ndev->handler = report_simple_keys;
-	hid_info(ndev->hdev, "Handler set to report keys...");
-	input_register_device(ndev->siminput);
-	/* HAI CHIGAIMASU */
-	ns_exchange(ndev, &(output_command) {
-			BASIC, 0, 0, {}, SET_INPUT_REPORT_MODE, {
-				.mode = STANDARD
-			}
-	});
-}
 
-/* Event handler */
-static void prepare_simple_mouse(nswitch_dev *ndev) {
-	ndev->siminput = input_allocate_device();
-	input_set_drvdata(ndev->siminput, ndev);
-	ndev->siminput->dev.parent = &ndev->hdev->dev;
-	ndev->siminput->id.bustype = ndev->hdev->bus;
-	ndev->siminput->id.vendor = ndev->hdev->vendor;
-	ndev->siminput->id.product = ndev->hdev->product;
-	ndev->siminput->id.version = ndev->hdev->version;
-	ndev->siminput->name = kasprintf(GFP_KERNEL, "%s Simple Emulated Mouse" , ndev->hdev->name);
-
-	set_bit(INPUT_PROP_POINTER, ndev->siminput->propbit);
-
-	set_bit(EV_KEY, ndev->siminput->evbit);
-	set_bit(EV_REL, ndev->siminput->evbit);
-
-	set_bit(BTN_LEFT, ndev->siminput->keybit);
-	set_bit(BTN_MIDDLE, ndev->siminput->keybit);
-	set_bit(BTN_RIGHT, ndev->siminput->keybit);
-	set_bit(REL_X, ndev->siminput->relbit);
-	set_bit(REL_Y, ndev->siminput->relbit);
-
-	ndev->handler = report_simple_mouse;
-	hid_info(ndev->hdev, "Handler set to report movements...");
-	input_register_device(ndev->siminput);
-	/* HAI CHIGAIMASU */
-	ns_exchange(ndev, &(output_command) {
-		BASIC, 0, 0, {}, SET_IMU, {
-			.imu_state = 1
-		}
-	});
-	/* HAI CHIGAIMASU */
-	ns_exchange(ndev, &(output_command) {
-		BASIC, 0, 0, {}, SET_INPUT_REPORT_MODE, {
-			.mode = STANDARD
-		}
-	});
+	dual_exchange_frame(ndev, ndev == left ? right : left, &buttons, sticks);
+	/* Each half sets its own bits, the other ones are clear */
+	buttons |= ndev->frame.buttons;
+	nd_report_keys(left, NSWITCH_REMAP_DUAL, siminput, buttons);
+	sticks[own] = ndev->frame.sticks[own];
+	sticks[own + 1] = ndev->frame.sticks[own + 1];
+	/* Each half reports its own stick, the right one aims */
+	owned = ndev == left ? 0x3 : 0xc;
+	changed = ndev->sticks_changed & owned;
+	if (ndev == right)
+		changed |= nd_gyro_aim(right, sticks);
+	nd_report_sticks(left, NSWITCH_REMAP_DUAL, siminput, dual_sticks, sticks,
+					 owned, changed);
+	input_set_timestamp(siminput, ns_to_ktime(ndev->state_time));
+	input_sync(siminput);
 }
 
 /* Event Handler */
-static void validate_dual(nswitch_dev *ndev) {
-	if (ndev->info.type == LEFT_JOYCON)
-		return;
-	if (ndev->state.simple.down) {
-		prepare_dual_joypad(ndev->right);
-	} else if (ndev->state.simple.left) {
-		ndev->right->handler = simplejc_prepare;
-		ndev->handler = simplejc_prepare;
-		ndev->right->right = 0;
-		ndev->right = 0;
-	}
+void report_dual_left(nswitch_dev *ndev) {
+	nswitch_dev *right;
+
+	rcu_read_lock();
+	right = rcu_dereference(ndev->right);
+	if (right)
+		report_dual_keys(ndev, ndev, right);
+	rcu_read_unlock();
 }
 
 /* Event Handler */
-static void report_dual_keys(nswitch_dev *ndev) {
-	struct input_dev *siminput = ndev->siminput;
-	nswitch_dev_full_report *fr;
-	stick_state *lss, *rss;
-	__u8 i;
-	const short *ev = ns_buttons;
-	
-	union {
-		__u32 rbuttons;
-		standard_button_state sbs;
-	} buttons;
-
-	switch (ndev->state.input_report) {
-	case REPLY:
-	case SIMPLE:
-	case NFC_UPDATE:
-		hid_info(ndev->hdev, "I don't want this...");
-		return;
-	default:
-		break;
-	}
-
-	lss = &ndev->state.full.left_stick;
-	rss = &ndev->right->state.full.right_stick;
-	fr = &ndev->state.full;
-	buttons.rbuttons = 0;
-	buttons.sbs = fr->buttons;
+void report_dual_right(nswitch_dev *ndev) {
+	nswitch_dev *left;
+
+	rcu_read_lock();
+	left = rcu_dereference(ndev->right);
+	if (left)
+		report_dual_keys(ndev, left, ndev);
+	rcu_read_unlock();
+}
 
-	i = 0;
-	while (i < 24) {
-		input_report_key(siminput, *ev++, (buttons.rbuttons >> i) & 1);
-		++i;
-	}
-	input_report_abs(siminput, ABS_X, lss->x);
-	input_report_abs(siminput, ABS_Y, lss->y);
-	input_report_abs(siminput, ABS_RX, rss->x);
-	input_report_abs(siminput, ABS_RY, rss->y);
-	input_sync(siminput);
+/*
+  Nothing held nor moved until the first report of the pair
+ */
+/* Worker Thread */
+static void dual_reset_frame(nswitch_dev *ndev) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&ndev->state_lock, flags);
+	ndev->pair_buttons = 0;
+	ndev->pair_sticks[0] = ndev->calibration.left_stick.xcenter;
+	ndev->pair_sticks[1] = ndev->calibration.left_stick.ycenter;
+	ndev->pair_sticks[2] = ndev->calibration.right_stick.xcenter;
+	ndev->pair_sticks[3] = ndev->calibration.right_stick.ycenter;
+	spin_unlock_irqrestore(&ndev->state_lock, flags);
 }
 
-/* Event Handler */
-static void prepare_dual_joypad(nswitch_dev *ndev) {
+/*
+  Requires pair_lock, so that the pair cannot be split meanwhile.
+  Called for the right joycon, sets up the input device of the left one.
+  On error, both joycons go back to selecting.
+ */
+/* Worker Thread */
+int setup_dual_joypad(nswitch_dev *rdev) {
 	calibration_data *lcd, *rcd;
-	nswitch_dev *rdev = ndev->right;
+	struct input_dev *input, *old;
+	nswitch_dev *ndev;
 	unsigned int i;
+	int ret;
+
+	ndev = rcu_dereference_protected(rdev->right, lockdep_is_held(&pair_lock));
+	if (!ndev || atomic_read(&ndev->mode) != NSWITCH_VALIDATING_DUAL)
+		return -ENODEV;
+	input = input_allocate_device();
+	if (!input) {
+		ret = -ENOMEM;
+		goto err_unlink;
+	}
+	input_set_drvdata(input, ndev);
 
 	lcd = &ndev->calibration;
 	rcd = &rdev->calibration;
-	ndev->siminput = input_allocate_device();
-	input_set_drvdata(ndev->siminput, ndev);
 
-	ndev->siminput->dev.parent = &ndev->hdev->dev;
-	ndev->siminput->id.bustype = ndev->hdev->bus;
-	ndev->siminput->id.vendor = ndev->hdev->vendor;
-	ndev->siminput->id.product = ndev->hdev->product;
-	ndev->siminput->id.version = ndev->hdev->version;
-	ndev->siminput->name = kasprintf(GFP_KERNEL, "%s Dual Joycon Controller" , ndev->hdev->name);
+	input->dev.parent = &ndev->hdev->dev;
+	input->id.bustype = ndev->hdev->bus;
+	input->id.vendor = ndev->hdev->vendor;
+	input->id.product = ndev->hdev->product;
+	input->id.version = ndev->hdev->version;
+	input->name = kasprintf(GFP_KERNEL, "%s Dual Joycon Controller" , ndev->hdev->name);
 
-	set_bit(EV_KEY, ndev->siminput->evbit);
+	set_bit(EV_KEY, input->evbit);
 	for (i = 0; i < ARRAY_SIZE(ns_buttons); ++i)
-		set_bit(ns_buttons[i], ndev->siminput->keybit);
-
-	set_bit(EV_ABS, ndev->siminput->evbit);
-
-	set_bit(ABS_X, ndev->siminput->absbit);
-	set_bit(ABS_Y, ndev->siminput->absbit);
-	set_bit(ABS_RX, ndev->siminput->absbit);
-	set_bit(ABS_RY, ndev->siminput->absbit);
-
-	input_set_abs_params(ndev->siminput, ABS_X,
-						 lcd->left_stick.xcenter - lcd->left_stick.xmin_offset,
-						 lcd->left_stick.xcenter + lcd->left_stick.xmax_offset, 10, 0);
-	input_set_abs_params(ndev->siminput, ABS_Y,
-						 lcd->left_stick.ycenter - lcd->left_stick.ymin_offset,
-						 lcd->left_stick.ycenter + lcd->left_stick.ymax_offset, 10, 0);
-	input_set_abs_params(ndev->siminput, ABS_RX,
-						 rcd->right_stick.xcenter - rcd->right_stick.xmin_offset,
-						 rcd->right_stick.xcenter + rcd->right_stick.xmax_offset, 10, 0);
-	input_set_abs_params(ndev->siminput, ABS_RY,
-						 rcd->right_stick.ycenter - rcd->right_stick.ymin_offset,
-						 rcd->right_stick.ycenter + rcd->right_stick.ymax_offset, 10, 0);
-
-	rdev->handler = ndev->handler = report_dual_keys;
+		set_bit(ns_buttons[i], input->keybit);
+	nd_setup_remap_keys(input);
+
+	set_bit(EV_ABS, input->evbit);
+
+	set_bit(ABS_X, input->absbit);
+	set_bit(ABS_Y, input->absbit);
+	set_bit(ABS_RX, input->absbit);
+	set_bit(ABS_RY, input->absbit);
+
+	set_stick_abs(input, ABS_X, ABS_Y, lcd->left_stick);
+	set_stick_abs(input, ABS_RX, ABS_RY, rcd->right_stick);
+	input->open = nd_input_open;
+	dual_reset_frame(ndev);
+	dual_reset_frame(rdev);
+	input->close = nd_input_close;
 
 	hid_info(ndev->hdev, "Handler set to report keys...");
-	input_register_device(ndev->siminput);
-	/* HAI CHIGAIMASU */
-	ns_exchange(ndev, &(output_command) {
-			BASIC, 0, 0, {}, SET_INPUT_REPORT_MODE, {
-				.mode = STANDARD
-	}});
-	/* HAI CHIGAIMASU */
-	ns_exchange(rdev, &(output_command) {
-			BASIC, 0, 0, {}, SET_INPUT_REPORT_MODE, {
-				.mode = STANDARD
-	}});
+	ret = input_register_device(input);
+	if (ret)
+		goto err_free;
+	old = ndev->siminput;
+	ndev->siminput = input;
+	ndev->wants_imu = 0;
+	/* The right joycon aims with its gyroscope */
+	rdev->wants_imu = READ_ONCE(rdev->aim.enabled);
+	/* Publishes siminput before the right joycon reports through it */
+	nd_set_mode(ndev, NSWITCH_VALIDATING_DUAL, NSWITCH_DUAL_LEFT);
+	nd_set_mode(rdev, NSWITCH_VALIDATING_DUAL, NSWITCH_DUAL_RIGHT);
+	/* From an earlier pairing, no handler uses it in this mode */
+	if (old)
+		input_unregister_device(old);
+	/* Full reports once opened */
+	nd_stream_update(ndev);
+	nd_stream_update(rdev);
+	return 0;
+
+err_free:
+	kfree(input->name);
+	input_free_device(input);
+err_unlink:
+	hid_err(ndev->hdev, "cannot set up the dual joypad: %d\n", ret);
+	nd_unlink(rdev);
+	return ret;
+}
+
+/* Event Handler */
+static void prepare_dual_joypad(nswitch_dev *rdev) {
+	mutex_lock(&pair_lock);
+	setup_dual_joypad(rdev);
+	mutex_unlock(&pair_lock);
+}
+
+/*
+  Enables a single personality, more through sysfs afterwards
+ */
+/* Event Handler */
+static void select_personality(nswitch_dev *ndev, int p) {
+	int ret;
+
+	mutex_lock(&pair_lock);
+	ret = nd_set_personalities(ndev, BIT(p));
+	mutex_unlock(&pair_lock);
+	if (ret)
+		hid_err(ndev->hdev, "cannot enable the personality: %d\n", ret);
 }
 
 /* Event Handler */
-static void validate_simple(nswitch_dev *ndev) {
+void validate_simple(nswitch_dev *ndev) {
+	if (ndev->frame.type != SIMPLE)
+		return;
 	if (ndev->state.simple.right) {
 		hid_info(ndev->hdev, "RIGHT pressed...preparing joypad...");
 		
 		/* HAI CHIGAIMASU */
 		handshake_rumble(ndev);
 		/* HAI CHIGAIMASU */
-		prepare_simple_joypad(ndev);
+		select_personality(ndev, NSWITCH_GAMEPAD);
 	} else if (ndev->state.simple.up) {
 		hid_info(ndev->hdev, "UP pressed...preparing mouse...");
 		/* HAI CHIGAIMASU */
 		handshake_rumble(ndev);
-		/* TODO: Implement mouse:
-		   Use rel coord or abs coords?
-		   compute x/y rel speed from Gyro speed
-		 */
-		prepare_simple_mouse(ndev);
+		select_personality(ndev, NSWITCH_MOUSE);
 	} else if (ndev->state.simple.down) {
 		hid_info(ndev->hdev, "DOWN pressed... canceling association...");
-		ndev->handler = simplejc_prepare;
+		nd_set_mode(ndev, NSWITCH_VALIDATING_SIMPLE, NSWITCH_SELECTING);
 	}
 }
 
+/*
+  The selection buttons are only in SIMPLE reports, the full ones have
+  the timer and battery at their place
+ */
 /* Event Handler */
 void simplejc_prepare(nswitch_dev *ndev) {
-	nswitch_list *nl;
-	struct list_head *t;
-	__u8 found = 0;
-
+	if (ndev->frame.type != SIMPLE)
+		return;
 	if (ndev->state.simple.sl &&
 		ndev->state.simple.sr) {
 		hid_info(ndev->hdev, "SR+SL, validating simple mode...");
-		ndev->handler = validate_simple;
+		nd_set_mode(ndev, NSWITCH_SELECTING, NSWITCH_VALIDATING_SIMPLE);
 		/* HAI CHIGAIMASU */
 		handshake_rumble(ndev);
 	} else if (ndev->info.type == LEFT_JOYCON &&
 			   (ndev->state.simple.lr || ndev->state.simple.z)) {
 		hid_info(ndev->hdev, "L or Z pressed on left joycon, searching for a right joycon...");
-		nl = 0;
-		t = &rjoycons;
-		/**/
-		list_for_each_entry(nl, t, list) {
-			if (nl->ndev->handler != simplejc_prepare) {
-				continue;
-			}
-			if (nl->ndev->state.simple.lr || nl->ndev->state.simple.z) {
-				found = 1;
-				break;
-			}
-		}
-		if (found) {
+		if (nd_pair(ndev)) {
 			hid_info(ndev->hdev, "L and R, validating dual mode...");
-			/* TODO: Lock here */
-			ndev->right = nl->ndev;
-			ndev->right->right = ndev;
-			ndev->handler = validate_dual;
-			nl->ndev->handler = validate_dual;
 			/* SOSHITE CHIGAIMAAAAAAAAAASU */
 			handshake_rumble(ndev);
 		}
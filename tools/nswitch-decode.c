@@ -0,0 +1,276 @@
+/*
+ * Decoder of hid-nswitch traces
+ * Copyright (c) 2018 Nabil Boutemeur <nabil.boutemeur@gmail.com>
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+  Decodes the input reports of a trace with the driver protocol code,
+  printing them with the sample times reconstructed by the driver clock,
+  or measuring the decoding throughput (-b loops).
+  With -f, runs the driver IMU path instead, with the default
+  calibration: gyroscope bias estimation and orientation fusion,
+  printing the orientation of each report and the cost per sample,
+  then the final heading and tilt.
+  With -H, only checks the final orientation instead: the heading must
+  be within -t degrees of -H, and the tilt under -T degrees, otherwise
+  it exits with 1. make check runs it on the traces of tools/traces.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../nswitch-proto.h"
+#include "../nswitch-uapi.h"
+
+typedef struct {
+	__u8 data[512];
+	int size;
+	__u64 timestamp;
+} trace_report;
+
+static __u64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static trace_report *load_trace(const char *path, size_t *count) {
+	nswitch_trace_header hdr;
+	nswitch_trace_record rec;
+	trace_report *reports = NULL, *tmp;
+	size_t cap = 0;
+	__u8 skip[512];
+	FILE *f;
+
+	*count = 0;
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+		memcmp(hdr.magic, NSWITCH_TRACE_MAGIC, sizeof(hdr.magic)) ||
+		hdr.version != NSWITCH_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a nswitch trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (rec.size > sizeof(skip))
+			break;
+		if (rec.direction != NSWITCH_TRACE_IN) {
+			if (fread(skip, rec.size, 1, f) != 1)
+				break;
+			continue;
+		}
+		if (*count == cap) {
+			cap = cap ? cap * 2 : 1024;
+			tmp = realloc(reports, cap * sizeof(*reports));
+			if (!tmp)
+				break;
+			reports = tmp;
+		}
+		if (fread(reports[*count].data, rec.size, 1, f) != 1)
+			break;
+		reports[*count].size = rec.size;
+		reports[*count].timestamp = rec.timestamp;
+		++*count;
+	}
+	fclose(f);
+	return reports;
+}
+
+static void print_frame(const ns_frame *f, __u64 arrival, __u64 sample) {
+	int i;
+
+	printf("%llu.%06llu (%+6lld us) %02x t=%3u bat=%u buttons=%06x sticks=%4u,%4u %4u,%4u",
+		   (unsigned long long)(sample / 1000000000ULL),
+		   (unsigned long long)(sample % 1000000000ULL / 1000),
+		   (long long)(sample - arrival) / 1000,
+		   f->type, f->timer, f->battery, f->buttons,
+		   f->sticks[0], f->sticks[1], f->sticks[2], f->sticks[3]);
+	if (f->has_imu)
+		for (i = 0; i < 6; ++i)
+			printf(" %6d", f->imu[2][i]);
+	printf("\n");
+}
+
+typedef struct {
+	int enabled;
+	double heading;
+	double tolerance;
+	double tilt;
+} fusion_check;
+
+/*
+  Heading around the vertical axis and tilt from it, in degrees
+ */
+static void orientation(const ns_fusion *fu, double *heading, double *tilt) {
+	double w = (double)fu->q[0] / NS_QUAT_ONE, x = (double)fu->q[1] / NS_QUAT_ONE;
+	double y = (double)fu->q[2] / NS_QUAT_ONE, z = (double)fu->q[3] / NS_QUAT_ONE;
+	double c = 1 - 2 * (x * x + y * y);
+
+	*heading = atan2(2 * (w * z + x * y), 1 - 2 * (y * y + z * z)) * 180 / M_PI;
+	*tilt = acos(c > 1 ? 1 : c < -1 ? -1 : c) * 180 / M_PI;
+}
+
+static int fuse_trace(const trace_report *reports, size_t count,
+					  const fusion_check *check) {
+	calibration_data cd;
+	ns_gyro_bias bias;
+	ns_fusion fu;
+	ns_clock clock;
+	ns_frame f;
+	__s32 imu[6];
+	__u64 ts, start, elapsed = 0, samples = 0;
+	double heading, tilt, error;
+	size_t i;
+	int j;
+
+	ns_default_calibration(&cd);
+	memset(&bias, 0, sizeof(bias));
+	memset(&clock, 0, sizeof(clock));
+	ns_fusion_init(&fu);
+	for (i = 0; i < count; ++i) {
+		if (!ns_decode_report(reports[i].data, reports[i].size, &f) ||
+			!f.has_imu)
+			continue;
+		ts = ns_clock_update(&clock, f.timer, reports[i].timestamp);
+		start = now_ns();
+		for (j = 0; j < 3; ++j) {
+			ns_bias_update(&bias, &cd, f.imu[j]);
+			ns_calibrate_imu(&cd, bias.bias, f.imu[j], imu);
+			ns_fusion_update(&fu, imu, ns_clock_imu_time(&clock, ts, j));
+		}
+		elapsed += now_ns() - start;
+		samples += 3;
+		if (check->enabled)
+			continue;
+		printf("%llu.%06llu q=%+.4f %+.4f %+.4f %+.4f bias=%d,%d,%d (%u%%)\n",
+			   (unsigned long long)(ts / 1000000000ULL),
+			   (unsigned long long)(ts % 1000000000ULL / 1000),
+			   (double)fu.q[0] / NS_QUAT_ONE, (double)fu.q[1] / NS_QUAT_ONE,
+			   (double)fu.q[2] / NS_QUAT_ONE, (double)fu.q[3] / NS_QUAT_ONE,
+			   bias.bias[0] / 256, bias.bias[1] / 256, bias.bias[2] / 256,
+			   bias.confidence * 100 / NS_BIAS_CONFIDENCE);
+	}
+	printf("%llu IMU samples, %llu ns/sample\n", (unsigned long long)samples,
+		   (unsigned long long)(samples ? elapsed / samples : 0));
+	orientation(&fu, &heading, &tilt);
+	printf("heading %.1f deg, tilt %.1f deg\n", heading, tilt);
+	if (!check->enabled)
+		return 0;
+	error = fmod(fabs(heading - check->heading), 360);
+	if (error > 180)
+		error = 360 - error;
+	if (error > check->tolerance || tilt > check->tilt) {
+		printf("FAIL: expected heading %.1f +- %.1f deg, tilt under %.1f deg\n",
+			   check->heading, check->tolerance, check->tilt);
+		return 1;
+	}
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-b loops | -f [-H heading [-t deg] [-T deg]]] trace\n"
+			"\t-H\texpected final heading, in degrees\n"
+			"\t-t\theading tolerance, in degrees (2)\n"
+			"\t-T\tmaximum final tilt, in degrees (1)\n", name);
+}
+
+int main(int argc, char **argv) {
+	trace_report *reports;
+	size_t count, i;
+	ns_frame f;
+	ns_clock clock;
+	__u64 ts;
+	fusion_check check = { 0, 0, 2, 1 };
+	int loops = 0, fuse = 0, loop, c, ret;
+	__u64 start, elapsed, decoded;
+	volatile __u32 sink = 0;
+
+	while ((c = getopt(argc, argv, "b:fH:t:T:")) != -1) {
+		switch (c) {
+		case 'b':
+			loops = atoi(optarg);
+			break;
+		case 'f':
+			fuse = 1;
+			break;
+		case 'H':
+			check.enabled = 1;
+			check.heading = atof(optarg);
+			break;
+		case 't':
+			check.tolerance = atof(optarg);
+			break;
+		case 'T':
+			check.tilt = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || (check.enabled && !fuse)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	reports = load_trace(argv[optind], &count);
+	if (!reports)
+		return 1;
+
+	if (fuse) {
+		ret = fuse_trace(reports, count, &check);
+		free(reports);
+		return ret;
+	}
+
+	if (!loops) {
+		memset(&clock, 0, sizeof(clock));
+		for (i = 0; i < count; ++i) {
+			if (!ns_decode_report(reports[i].data, reports[i].size, &f))
+				continue;
+			ts = reports[i].timestamp;
+			if (f.type != SIMPLE)
+				ts = ns_clock_update(&clock, f.timer, ts);
+			print_frame(&f, reports[i].timestamp, ts);
+		}
+		printf("%llu lost, %llu duplicated\n",
+			   (unsigned long long)clock.lost,
+			   (unsigned long long)clock.duplicated);
+		free(reports);
+		return 0;
+	}
+
+	decoded = 0;
+	start = now_ns();
+	for (loop = 0; loop < loops; ++loop) {
+		for (i = 0; i < count; ++i) {
+			if (ns_decode_report(reports[i].data, reports[i].size, &f))
+				++decoded;
+			sink += f.buttons;
+		}
+	}
+	elapsed = now_ns() - start;
+	printf("%llu reports in %llu us, %llu reports/s\n",
+		   (unsigned long long)decoded,
+		   (unsigned long long)(elapsed / 1000),
+		   (unsigned long long)(elapsed ? decoded * 1000000000ULL / elapsed : 0));
+	free(reports);
+	return 0;
+}
@@ -0,0 +1,1162 @@
+/*
+ * Load generator for hid-nswitch, emulating peripherals through uhid
+ * Copyright (c) 2018 Nabil Boutemeur <nabil.boutemeur@gmail.com>
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+  Creates left joycons, right joycons and pro controllers with
+  /dev/uhid, answers the driver commands like the hardware does,
+  presses the buttons that select a personality (L+R then DOWN for
+  pairs, SL+SR then RIGHT for single joycons, RIGHT for pro
+  controllers), then streams input reports at a fixed rate.
+  Joycons in a Charging Grip are created as its two USB interfaces,
+  answering the USB handshake, with reports padded to the USB packet
+  size. The driver pairs them on its own, without buttons.
+
+  Each standard report carries a sequence number in its stick X axis,
+  that is matched against the evdev events of the personality to
+  measure the end to end latency, from the uhid write to the input
+  event timestamp.
+
+  With -i, right joycons also emulate the IR camera MCU: once the
+  driver configures it, each fragment acknowledgement is answered with
+  the next fragment, filled with a pattern. A child process streams
+  the V4L2 device of each of them during the measurement, checks every
+  pixel of the frames it gets, and prints the frame rate; the run fails
+  when a frame is wrong or none arrives.
+
+  Once the personalities are set up, prints how long the driver took
+  from probe to accepting input, to handling the first report and to
+  the end of its init sequence.
+  At the end of the run, prints the CPU time spent per report, the
+  driver transmit queue timings from <debugfs>/nswitch/<hid device>/stats,
+  and the report path ones when it is built with
+  CONFIG_NSWITCH_TIMING=y, the deepest transmit queue and the reports
+  dropped from full ones, and the driver lock statistics when the
+  kernel has CONFIG_LOCK_STAT.
+  Run it with increasing device counts to find the scaling limits:
+
+	for n in 1 2 4 8; do nswitch-load -l $n -r $n; done
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include "../nswitch-proto.h"
+
+#define MAX_DEVS 64
+#define SEQ_RING 128
+#define SEQ_BASE 0x100
+#define SEQ_STEP 24 /* More than twice the driver fuzz */
+#define QUIET_NS 300000000ULL
+#define SCRIPT_TICKS 60
+#define DEBUGFS_STATS "/sys/kernel/debug/nswitch"
+#define GRIP_REPORT_SIZE 64
+#define IR_REPORT_SIZE 362
+#define IR_WIDTH 320
+#define IR_HEIGHT 240
+#define IR_BUFFERS 4
+
+typedef struct emu_dev emu_dev;
+struct emu_dev {
+	int fd;
+	int evfd; /* evdev node of the personality, owned by the left half */
+	enum nswitch_dev_type type;
+	char name[64];
+	emu_dev *partner;
+	int grip; /* Charging Grip number, from 1, 0 over Bluetooth */
+	int ir; /* Emulates the IR camera MCU */
+	int opened;
+	__u8 mode;
+	__u8 timer;
+	__u8 lights;
+	__u8 seq;
+	unsigned long outputs;
+	__u64 last_output;
+	int step;
+	__u64 sent[SEQ_RING];
+	unsigned long reports;
+	unsigned long streamed; /* Standard reports */
+	unsigned long matched;
+	unsigned long ir_fragments;
+};
+
+/*
+  Aggregate of one line of the driver stats files
+ */
+typedef struct {
+	char name[16];
+	__u64 count;
+	__u64 total_ns;
+	__u64 max_ns;
+} stage_stats;
+
+#define MAX_STAGES 8
+
+static emu_dev devs[MAX_DEVS];
+static int ndevs;
+
+static __u64 *latencies;
+static size_t nlatencies, latencies_cap;
+
+static int ir_children, ir_failed;
+
+/*
+  Vendor defined descriptor with the reports used by the driver,
+  so that hid-core passes them to raw_event
+ */
+static const struct {
+	__u8 id;
+	__u16 size;
+	__u8 dir; /* 0x81 input, 0x91 output */
+} rdesc_reports[] = {
+	{ REPLY, 49, 0x81 },
+	{ STANDARD, 49, 0x81 },
+	{ STD_NFCIR, 361, 0x81 },
+	{ SIMPLE, 11, 0x81 },
+	{ BASIC, 48, 0x91 },
+	{ RUMBLE_REPORT, 9, 0x91 },
+	{ MCU_REPORT, 48, 0x91 },
+	{ USB_REPLY, GRIP_REPORT_SIZE - 1, 0x81 },
+	{ USB_COMMAND, 1, 0x91 },
+};
+
+static __u64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int build_rdesc(__u8 *rd) {
+	__u8 *p = rd;
+	size_t i;
+
+	*p++ = 0x06; *p++ = 0x00; *p++ = 0xFF; /* Usage Page (Vendor) */
+	*p++ = 0x09; *p++ = 0x01; /* Usage (1) */
+	*p++ = 0xA1; *p++ = 0x01; /* Collection (Application) */
+	for (i = 0; i < sizeof(rdesc_reports) / sizeof(*rdesc_reports); ++i) {
+		*p++ = 0x85; *p++ = rdesc_reports[i].id; /* Report ID */
+		*p++ = 0x09; *p++ = 0x01;
+		*p++ = 0x15; *p++ = 0x00; /* Logical Minimum (0) */
+		*p++ = 0x26; *p++ = 0xFF; *p++ = 0x00; /* Logical Maximum (255) */
+		*p++ = 0x75; *p++ = 0x08; /* Report Size (8) */
+		*p++ = 0x96; /* Report Count */
+		*p++ = rdesc_reports[i].size & 0xFF;
+		*p++ = rdesc_reports[i].size >> 8;
+		*p++ = rdesc_reports[i].dir; *p++ = 0x02; /* (Data, Var, Abs) */
+	}
+	*p++ = 0xC0;
+	return p - rd;
+}
+
+static int uhid_send(emu_dev *d, struct uhid_event *ev) {
+	if (write(d->fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+		perror("uhid write");
+		return -1;
+	}
+	return 0;
+}
+
+static int uhid_create(emu_dev *d) {
+	struct uhid_event ev;
+	static const __u32 products[] = {
+		[LEFT_JOYCON] = 0x2006,
+		[RIGHT_JOYCON] = 0x2007,
+		[PRO_CONTROLLER] = 0x2009
+	};
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char*)ev.u.create2.name, sizeof(ev.u.create2.name), "%s", d->name);
+	snprintf((char*)ev.u.create2.uniq, sizeof(ev.u.create2.uniq),
+			 "98:b6:e9:00:00:%02x", (int)(d - devs));
+	ev.u.create2.rd_size = build_rdesc(ev.u.create2.rd_data);
+	ev.u.create2.bus = BUS_BLUETOOTH;
+	ev.u.create2.vendor = 0x057E;
+	ev.u.create2.product = products[d->type];
+	if (d->grip) {
+		/* The driver pairs the interfaces of the same grip */
+		snprintf((char*)ev.u.create2.phys, sizeof(ev.u.create2.phys),
+				 "nswitch-load/grip%d/input%d", d->grip,
+				 d->type == RIGHT_JOYCON);
+		ev.u.create2.bus = BUS_USB;
+		ev.u.create2.product = 0x200E;
+	}
+	return uhid_send(d, &ev);
+}
+
+/*
+  Enough of the SPI flash for the driver calibration reads.
+  User calibrations are left blank, without their magic.
+ */
+static void flash_read(__u32 addr, __u8 *buf, __u8 size) {
+	left_stick_calibration_data lc;
+	right_stick_calibration_data rc;
+	sax_calibration_data sax;
+	const __u8 *src = NULL;
+	int i;
+
+	memset(buf, 0xFF, size);
+	switch (addr) {
+	case 0x603D:
+		lc.xmax_offset = lc.ymax_offset = 0x500;
+		lc.xmin_offset = lc.ymin_offset = 0x500;
+		lc.xcenter = lc.ycenter = 0x800;
+		src = (__u8*)&lc;
+		size = size < sizeof(lc) ? size : sizeof(lc);
+		break;
+	case 0x6046:
+		rc.xmax_offset = rc.ymax_offset = 0x500;
+		rc.xmin_offset = rc.ymin_offset = 0x500;
+		rc.xcenter = rc.ycenter = 0x800;
+		src = (__u8*)&rc;
+		size = size < sizeof(rc) ? size : sizeof(rc);
+		break;
+	case 0x6020:
+		for (i = 0; i < 3; ++i) {
+			sax.accelerometer_origin[i] = 0;
+			sax.accelerometer_sensitivity[i] = 16384;
+			sax.gyroscope_origin[i] = 0;
+			sax.gyroscope_sensitivity[i] = 13371;
+		}
+		src = (__u8*)&sax;
+		size = size < sizeof(sax) ? size : sizeof(sax);
+		break;
+	default:
+		return;
+	}
+	memcpy(buf, src, size);
+}
+
+static void fill_header(emu_dev *d, nswitch_dev_input_report *rep,
+						enum input_report_type type) {
+	memset(rep, 0, sizeof(*rep));
+	rep->input_report = type;
+	rep->full.timer = d->timer++;
+	rep->full.battery = 8;
+	rep->full.connection = 0xE;
+	rep->full.left_stick.x = rep->full.left_stick.y = 0x800;
+	rep->full.right_stick.x = rep->full.right_stick.y = 0x800;
+	rep->full.vib = 0x0B;
+}
+
+static int send_report(emu_dev *d, const void *rep, int size) {
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = size;
+	memcpy(ev.u.input2.data, rep, size);
+	if (d->grip && size < GRIP_REPORT_SIZE)
+		ev.u.input2.size = GRIP_REPORT_SIZE;
+	return uhid_send(d, &ev);
+}
+
+/*
+  Byte i of IR fragment frag, so that pixel p of a frame is
+  (p / IR_FRAGMENT_SIZE + p % IR_FRAGMENT_SIZE) & 0xFF
+ */
+static __u8 ir_pattern(int frag, int i) {
+	return (frag + i) & 0xFF;
+}
+
+/*
+  Sends fragment frag in a STD_NFCIR report, as the MCU does once the
+  previous one was acknowledged
+ */
+static int send_ir_fragment(emu_dev *d, __u8 frag) {
+	__u8 buf[IR_REPORT_SIZE];
+	nswitch_dev_input_report rep;
+	ir_mcu_fragment *f = (void*)(buf + NFC_IR_MCU_OFFSET);
+	int i;
+
+	fill_header(d, &rep, STD_NFCIR);
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &rep, NFC_IR_MCU_OFFSET);
+	f->type = MCU_IR_DATA;
+	f->frag = frag;
+	for (i = 0; i < IR_FRAGMENT_SIZE; ++i)
+		f->data[i] = ir_pattern(frag, i);
+	++d->ir_fragments;
+	return send_report(d, buf, sizeof(buf));
+}
+
+/*
+  Fragment acknowledgements, in MCU_REPORT output reports: raw[3] is
+  the fragment received, or raw[1] is set and raw[2] is the fragment
+  to send again
+ */
+static int handle_ir_ack(emu_dev *d, const output_command *oc) {
+	if (oc->raw[1] == 1)
+		return send_ir_fragment(d, oc->raw[2]);
+	return send_ir_fragment(d, oc->raw[3] + 1);
+}
+
+/*
+  Answers a subcommand the way the hardware does
+ */
+static int handle_output(emu_dev *d, const __u8 *data, int size) {
+	const output_command *oc = (const void*)data;
+	nswitch_dev_input_report rep;
+	subcmd_input *reply = &rep.full.reply;
+	spi_read_reply *srr = (void*)reply->data;
+	nswitch_devinfo info;
+
+	++d->outputs;
+	d->last_output = now_ns();
+	if (d->grip && size >= 2 && oc->report == USB_COMMAND) {
+		memset(&rep, 0, sizeof(rep));
+		rep.input_report = USB_REPLY;
+		((__u8*)&rep)[1] = data[1];
+		return send_report(d, &rep, 2);
+	}
+	if (d->ir && size >= 11 + 4 && oc->report == MCU_REPORT)
+		return handle_ir_ack(d, oc);
+	if (size < 11 || oc->report != BASIC)
+		return 0;
+
+	fill_header(d, &rep, REPLY);
+	reply->ack = 0x80;
+	reply->reply_to = oc->subcommand;
+	switch (oc->subcommand) {
+	case DEVICE_INFO:
+		memset(&info, 0, sizeof(info));
+		info.vmajor = 3;
+		info.vminor = 0x48;
+		info.type = d->type;
+		info.two = 2;
+		info.mac[0] = 0x98;
+		info.mac[1] = 0xB6;
+		info.mac[2] = 0xE9;
+		info.mac[5] = d - devs;
+		info.one = 1;
+		info.colored = 1;
+		memcpy(reply->data, &info, sizeof(info));
+		reply->ack = 0x82;
+		break;
+	case SPI_FLASH_READ:
+		reply->ack = 0x90;
+		srr->echo = oc->spi_read;
+		if (srr->echo.size > sizeof(reply->data) - sizeof(srr->echo))
+			srr->echo.size = sizeof(reply->data) - sizeof(srr->echo);
+		flash_read(srr->echo.addr, srr->data, srr->echo.size);
+		break;
+	case SET_INPUT_REPORT_MODE:
+		d->mode = oc->mode;
+		break;
+	case SET_PLAYER_LIGHTS:
+		d->lights = oc->player_lights;
+		break;
+	case GET_PLAYER_LIGHTS:
+		reply->ack = 0xB0;
+		reply->data[0] = d->lights;
+		break;
+	case GET_VOLTAGE:
+		reply->ack = 0xD0;
+		reply->data[0] = 1600 & 0xFF;
+		reply->data[1] = 1600 >> 8;
+		break;
+	case SET_NFC_IR:
+		/* MCU commands are acknowledged with their MCU state */
+		if (!d->ir)
+			reply->ack = 0x00;
+		else
+			reply->ack = 0xA0;
+		break;
+	default:
+		break;
+	}
+	return send_report(d, &rep, 1 + sizeof(rep.full));
+}
+
+static int uhid_poll(emu_dev *d) {
+	struct uhid_event ev;
+	struct uhid_event reply;
+
+	if (read(d->fd, &ev, sizeof(ev)) <= 0)
+		return -1;
+
+	switch (ev.type) {
+	case UHID_OPEN:
+		d->opened = 1;
+		break;
+	case UHID_CLOSE:
+		d->opened = 0;
+		break;
+	case UHID_OUTPUT:
+		return handle_output(d, ev.u.output.data, ev.u.output.size);
+	case UHID_GET_REPORT:
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_GET_REPORT_REPLY;
+		reply.u.get_report_reply.id = ev.u.get_report.id;
+		reply.u.get_report_reply.err = EIO;
+		return uhid_send(d, &reply);
+	case UHID_SET_REPORT:
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_SET_REPORT_REPLY;
+		reply.u.set_report_reply.id = ev.u.set_report.id;
+		reply.u.set_report_reply.err = EIO;
+		return uhid_send(d, &reply);
+	default:
+		break;
+	}
+	return 0;
+}
+
+/*
+  Buttons pressed in simple mode, to go through the personality
+  selection of simplejc.c. Starts over when the driver missed it.
+  Pairs step together, driven by their left half.
+ */
+static void simple_script(emu_dev *d, nswitch_dev_simple_state *s, __u64 now) {
+	emu_dev *lead = d->partner && d->type == RIGHT_JOYCON ? d->partner : d;
+	int step;
+
+	if (d->grip)
+		return;
+	if (d == lead) {
+		if (!d->outputs || now - d->last_output < QUIET_NS)
+			return;
+		if (d->partner && (!d->partner->outputs ||
+						   now - d->partner->last_output < QUIET_NS))
+			return;
+		if (++d->step >= SCRIPT_TICKS)
+			d->step = 0;
+	}
+	step = lead->step;
+
+	if (d->partner) {
+		if (step < 10)
+			s->lr = 1;
+		else if (step >= 20 && step < 30 && d->type == RIGHT_JOYCON)
+			s->down = 1;
+		return;
+	}
+	if (step < 10 && d->type != PRO_CONTROLLER)
+		s->sl = s->sr = 1;
+	else if (step >= 20 && step < 30)
+		s->right = 1;
+}
+
+static int send_tick(emu_dev *d, __u64 now) {
+	nswitch_dev_input_report rep;
+	stick_state *ss;
+	int i;
+
+	if (d->mode != STANDARD && d->mode != STD_NFCIR) {
+		memset(&rep, 0, sizeof(rep));
+		rep.input_report = SIMPLE;
+		rep.simple.direction = NEUTRAL;
+		simple_script(d, &rep.simple, now);
+		++d->reports;
+		return send_report(d, &rep, 12);
+	}
+
+	/* Without fragment while the IR camera is set up */
+	fill_header(d, &rep, d->mode);
+	ss = d->type == RIGHT_JOYCON ? &rep.full.right_stick : &rep.full.left_stick;
+	ss->x = SEQ_BASE + d->seq * SEQ_STEP;
+	for (i = 0; i < 3; ++i) {
+		rep.full.ax6[i][0][2] = 4096;
+		rep.full.ax6[i][1][0] = (d->timer & 3) - 2;
+	}
+	d->sent[d->seq] = now;
+	d->seq = (d->seq + 1) % SEQ_RING;
+	++d->reports;
+	++d->streamed;
+	return send_report(d, &rep, 1 + sizeof(rep.full));
+}
+
+/*
+  The left half of a pair owns the input device.
+  The driver only streams full reports once it is opened.
+ */
+static int has_personality(emu_dev *d) {
+	return !d->partner || d->type == LEFT_JOYCON;
+}
+
+static void find_evdevs(void) {
+	char path[64], name[256];
+	int i, j, fd, missing = 0;
+	clockid_t clk = CLOCK_MONOTONIC;
+
+	for (j = 0; j < ndevs; ++j)
+		missing += has_personality(&devs[j]) && devs[j].evfd < 0;
+	for (i = 0; missing && i < 1024; ++i) {
+		snprintf(path, sizeof(path), "/dev/input/event%d", i);
+		fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		if (fd < 0) {
+			if (errno == ENOENT && i > 256)
+				break;
+			continue;
+		}
+		memset(name, 0, sizeof(name));
+		ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name);
+		for (j = 0; j < ndevs; ++j) {
+			if (devs[j].evfd >= 0 || !has_personality(&devs[j]))
+				continue;
+			/* Pro controllers also have a motion sensors device */
+			if (!strncmp(name, devs[j].name, strlen(devs[j].name)) &&
+				name[strlen(devs[j].name)] == ' ' &&
+				!strstr(name, "Motion Sensors"))
+				break;
+		}
+		if (j == ndevs) {
+			close(fd);
+			continue;
+		}
+		ioctl(fd, EVIOCSCLOCKID, &clk);
+		devs[j].evfd = fd;
+		--missing;
+	}
+}
+
+static void record_latency(emu_dev *d, int value, __u64 ts) {
+	int seq = value - SEQ_BASE;
+	__u64 sent;
+
+	if (!d || seq < 0 || seq % SEQ_STEP || seq / SEQ_STEP >= SEQ_RING)
+		return;
+	seq /= SEQ_STEP;
+	sent = d->sent[seq];
+	d->sent[seq] = 0;
+	if (!sent || ts < sent || ts - sent > 1000000000ULL)
+		return;
+	++d->matched;
+	if (nlatencies < latencies_cap)
+		latencies[nlatencies++] = ts - sent;
+}
+
+static void read_evdev(emu_dev *d, int record) {
+	struct input_event ev[64];
+	ssize_t n;
+	int i;
+
+	while ((n = read(d->evfd, ev, sizeof(ev))) > 0) {
+		if (!record)
+			continue;
+		for (i = 0; i < n / (ssize_t)sizeof(*ev); ++i) {
+			if (ev[i].type != EV_ABS)
+				continue;
+			if (ev[i].code == ABS_X)
+				record_latency(d, ev[i].value,
+							   ev[i].input_event_sec * 1000000000ULL +
+							   ev[i].input_event_usec * 1000ULL);
+			else if (ev[i].code == ABS_RX)
+				record_latency(d->partner, ev[i].value,
+							   ev[i].input_event_sec * 1000000000ULL +
+							   ev[i].input_event_usec * 1000ULL);
+		}
+	}
+}
+
+/*
+  Path of the V4L2 device of the IR camera of d, from the HID device
+  it belongs to
+ */
+static int find_video(emu_dev *d, char *path, size_t size) {
+	char uevent[512], line[256], name[128];
+	struct dirent *de;
+	DIR *dir;
+	FILE *f;
+	int found = 0;
+
+	snprintf(name, sizeof(name), "HID_NAME=%s\n", d->name);
+	dir = opendir("/sys/class/video4linux");
+	if (!dir)
+		return -1;
+	while (!found && (de = readdir(dir))) {
+		if (strncmp(de->d_name, "video", 5))
+			continue;
+		snprintf(uevent, sizeof(uevent),
+				 "/sys/class/video4linux/%s/device/uevent", de->d_name);
+		f = fopen(uevent, "r");
+		if (!f)
+			continue;
+		while (!found && fgets(line, sizeof(line), f))
+			found = !strcmp(line, name);
+		fclose(f);
+		if (found)
+			snprintf(path, size, "/dev/%s", de->d_name);
+	}
+	closedir(dir);
+	return found ? 0 : -1;
+}
+
+/*
+  Returns the number of wrong pixels of an IR frame
+ */
+static int ir_check_frame(const __u8 *p) {
+	int i, bad = 0;
+
+	for (i = 0; i < IR_WIDTH * IR_HEIGHT; ++i)
+		bad += p[i] != ir_pattern(i / IR_FRAGMENT_SIZE, i % IR_FRAGMENT_SIZE);
+	return bad;
+}
+
+/*
+  Streams the IR camera of d for duration seconds.
+  Runs in a child process: VIDIOC_STREAMON waits for the driver
+  exchanges with the device, answered by the parent.
+  Exits with 1 when a frame is wrong or none arrived.
+ */
+static void ir_capture(emu_dev *d, int duration) {
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer buf;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	struct pollfd pfd;
+	char path[300];
+	void *maps[IR_BUFFERS];
+	__u64 start, deadline;
+	unsigned long frames = 0, bad = 0;
+	unsigned int i;
+	int fd;
+
+	if (find_video(d, path, sizeof(path))) {
+		fprintf(stderr, "%s: no IR camera\n", d->name);
+		_exit(1);
+	}
+	fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path);
+		_exit(1);
+	}
+	memset(&req, 0, sizeof(req));
+	req.count = IR_BUFFERS;
+	req.type = type;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(fd, VIDIOC_REQBUFS, &req) || req.count > IR_BUFFERS) {
+		perror("VIDIOC_REQBUFS");
+		_exit(1);
+	}
+	for (i = 0; i < req.count; ++i) {
+		memset(&buf, 0, sizeof(buf));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (ioctl(fd, VIDIOC_QUERYBUF, &buf)) {
+			perror("VIDIOC_QUERYBUF");
+			_exit(1);
+		}
+		maps[i] = mmap(NULL, buf.length, PROT_READ, MAP_SHARED, fd,
+					   buf.m.offset);
+		if (maps[i] == MAP_FAILED || ioctl(fd, VIDIOC_QBUF, &buf)) {
+			perror("IR buffer");
+			_exit(1);
+		}
+	}
+
+	start = now_ns();
+	deadline = start + duration * 1000000000ULL;
+	if (ioctl(fd, VIDIOC_STREAMON, &type)) {
+		perror("VIDIOC_STREAMON");
+		_exit(1);
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (now_ns() < deadline) {
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		memset(&buf, 0, sizeof(buf));
+		buf.type = type;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(fd, VIDIOC_DQBUF, &buf))
+			continue;
+		if (buf.bytesused != IR_WIDTH * IR_HEIGHT ||
+			ir_check_frame(maps[buf.index]))
+			++bad;
+		++frames;
+		ioctl(fd, VIDIOC_QBUF, &buf);
+	}
+	ioctl(fd, VIDIOC_STREAMOFF, &type);
+	printf("ir %s: %lu frames, %lu wrong, %.2f frames/s\n", d->name,
+		   frames, bad, frames * 1e9 / (now_ns() - start));
+	fflush(stdout);
+	_exit(!frames || bad);
+}
+
+/*
+  Collects the IR capture processes that exited
+ */
+static void ir_reap(void) {
+	int status;
+
+	while (ir_children && waitpid(-1, &status, WNOHANG) > 0) {
+		--ir_children;
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			++ir_failed;
+	}
+}
+
+/*
+  Runs the emulation until the deadline, or until every device
+  has reached its personality when setup is 1, or until the IR
+  captures are over when setup is 2
+ */
+static int run(int tfd, __u64 deadline, int setup) {
+	struct pollfd pfds[2 * MAX_DEVS + 1];
+	emu_dev *owners[2 * MAX_DEVS + 1];
+	__u64 expirations, now, last_scan = 0;
+	int i, n, ready;
+
+	while ((now = now_ns()) < deadline) {
+		if (now - last_scan > 1000000000ULL) {
+			find_evdevs();
+			last_scan = now;
+		}
+		if (setup) {
+			ready = 1;
+			for (i = 0; i < ndevs; ++i)
+				if (has_personality(&devs[i]) && devs[i].evfd < 0)
+					ready = 0;
+				else if (devs[i].mode != STANDARD)
+					ready = 0;
+			if (ready)
+				return 0;
+		}
+		ir_reap();
+		if (setup == 2 && !ir_children)
+			return 0;
+
+		n = 0;
+		pfds[n].fd = tfd;
+		pfds[n++].events = POLLIN;
+		for (i = 0; i < ndevs; ++i) {
+			pfds[n].fd = devs[i].fd;
+			pfds[n].events = POLLIN;
+			owners[n++] = &devs[i];
+			if (devs[i].evfd >= 0) {
+				pfds[n].fd = devs[i].evfd;
+				pfds[n].events = POLLIN;
+				owners[n++] = &devs[i];
+			}
+		}
+		if (poll(pfds, n, 100) < 0 && errno != EINTR) {
+			perror("poll");
+			return -1;
+		}
+
+		for (i = 1; i < n; ++i) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			if (pfds[i].fd == owners[i]->evfd)
+				read_evdev(owners[i], !setup);
+			else if (uhid_poll(owners[i]) < 0)
+				return -1;
+		}
+		if ((pfds[0].revents & POLLIN) &&
+			read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+			now = now_ns();
+			for (i = 0; i < ndevs; ++i)
+				if (devs[i].opened && send_tick(&devs[i], now))
+					return -1;
+		}
+	}
+	return setup ? 1 : 0;
+}
+
+/*
+  Busy time of all CPUs, in ns
+ */
+static __u64 cpu_busy_ns(void) {
+	unsigned long long v[8] = { 0 };
+	FILE *f = fopen("/proc/stat", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+			   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) != 8)
+		memset(v, 0, sizeof(v));
+	fclose(f);
+	return (v[0] + v[1] + v[2] + v[5] + v[6] + v[7]) *
+		(1000000000ULL / sysconf(_SC_CLK_TCK));
+}
+
+static __u64 self_user_ns(void) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec * 1000000000ULL + ru.ru_utime.tv_usec * 1000ULL;
+}
+
+static int read_stages(stage_stats *st) {
+	char path[512], line[256], name[16];
+	unsigned long long count, avg, max;
+	struct dirent *de;
+	int i, n = 0;
+	DIR *dir;
+	FILE *f;
+
+	memset(st, 0, MAX_STAGES * sizeof(*st));
+	dir = opendir(DEBUGFS_STATS);
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), DEBUGFS_STATS "/%s/stats", de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "%15[^:]: %llu reports, %llu ns/report, %llu ns max",
+					   name, &count, &avg, &max) != 4)
+				continue;
+			for (i = 0; i < n && strcmp(st[i].name, name); ++i)
+				;
+			if (i == n) {
+				if (n == MAX_STAGES)
+					continue;
+				strcpy(st[n++].name, name);
+			}
+			st[i].count += count;
+			st[i].total_ns += count * avg;
+			if (max > st[i].max_ns)
+				st[i].max_ns = max;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return n;
+}
+
+/*
+  Prints the mean and max of the driver init times of all the devices
+ */
+static void print_init_times(void) {
+	static const char *const names[3] = { "ready", "first event", "calibrated" };
+	unsigned long long v[3], total[3] = { 0 }, max[3] = { 0 }, n[3] = { 0 };
+	char path[512], line[256];
+	struct dirent *de;
+	DIR *dir;
+	FILE *f;
+	int i;
+
+	dir = opendir(DEBUGFS_STATS);
+	if (!dir)
+		return;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), DEBUGFS_STATS "/%s/stats", de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "init: ready %llu us, first event %llu us, calibrated %llu us",
+					   &v[0], &v[1], &v[2]) != 3)
+				continue;
+			for (i = 0; i < 3; ++i) {
+				/* Not reached yet */
+				if (!v[i])
+					continue;
+				total[i] += v[i];
+				++n[i];
+				if (v[i] > max[i])
+					max[i] = v[i];
+			}
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	for (i = 0; i < 3; ++i)
+		printf("init %s: %llu us mean, %llu us max, %llu devices\n", names[i],
+			   n[i] ? total[i] / n[i] : 0, max[i], n[i]);
+}
+
+/*
+  Prints the deepest transmit queue and the reports dropped because
+  one was full, over all the devices
+ */
+static void print_tx_queues(void) {
+	unsigned int queued, max, deepest = 0, n = 0;
+	unsigned long long dropped, total = 0;
+	char path[512], line[256];
+	struct dirent *de;
+	DIR *dir;
+	FILE *f;
+
+	dir = opendir(DEBUGFS_STATS);
+	if (!dir)
+		return;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), DEBUGFS_STATS "/%s/stats", de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "tx queue: %u queued, %u max, %llu dropped",
+					   &queued, &max, &dropped) != 3)
+				continue;
+			if (max > deepest)
+				deepest = max;
+			total += dropped;
+			++n;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	printf("driver tx queue: %u max, %llu dropped, %u devices\n",
+		   deepest, total, n);
+}
+
+static void lock_stat_clear(void) {
+	FILE *f = fopen("/proc/lock_stat", "w");
+
+	if (f) {
+		fputs("0\n", f);
+		fclose(f);
+	}
+}
+
+static void lock_stat_print(void) {
+	static const char *const locks[] = { "global_lock", "state_lock", "cmd_lock" };
+	char line[512];
+	size_t i;
+	FILE *f = fopen("/proc/lock_stat", "r");
+
+	if (!f) {
+		printf("lock_stat: unavailable (CONFIG_LOCK_STAT)\n");
+		return;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (strstr(line, "class name"))
+			fputs(line, stdout);
+		for (i = 0; i < sizeof(locks) / sizeof(*locks); ++i)
+			if (strstr(line, locks[i]) && strchr(line, ':'))
+				fputs(line, stdout);
+	}
+	fclose(f);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	__u64 x = *(const __u64*)a, y = *(const __u64*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static __u64 percentile(int p) {
+	return nlatencies ? latencies[(nlatencies - 1) * p / 100] : 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-l n] [-r n] [-p n] [-P n] [-g n] [-i] [-f hz] [-d s] [-w s]\n"
+			"\t-l\tleft joycons (1)\n"
+			"\t-r\tright joycons (1)\n"
+			"\t-p\tpro controllers (0)\n"
+			"\t-P\tleft/right pairs among the joycons (all that can be)\n"
+			"\t-g\tCharging Grips, each holding a left and a right joycon (0)\n"
+			"\t-i\tstream and check the IR camera of the right joycons\n"
+			"\t-f\treports per second and per device (120)\n"
+			"\t-d\tmeasurement duration, in seconds (10)\n"
+			"\t-w\tsetup timeout, in seconds (30)\n", name);
+}
+
+int main(int argc, char **argv) {
+	struct itimerspec its;
+	struct uhid_event ev;
+	stage_stats before[MAX_STAGES], after[MAX_STAGES];
+	__u64 start, elapsed, busy, user;
+	unsigned long reports, streamed, matched;
+	int nleft = 1, nright = 1, npro = 0, npairs = -1, ngrips = 0, ir = 0;
+	int rate = 120, duration = 10, setup_timeout = 30;
+	int tfd, i, j, c, nstages;
+
+	while ((c = getopt(argc, argv, "l:r:p:P:g:if:d:w:")) != -1) {
+		switch (c) {
+		case 'l': nleft = atoi(optarg); break;
+		case 'r': nright = atoi(optarg); break;
+		case 'p': npro = atoi(optarg); break;
+		case 'P': npairs = atoi(optarg); break;
+		case 'g': ngrips = atoi(optarg); break;
+		case 'i': ir = 1; break;
+		case 'f': rate = atoi(optarg); break;
+		case 'd': duration = atoi(optarg); break;
+		case 'w': setup_timeout = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (npairs < 0)
+		npairs = nleft < nright ? nleft : nright;
+	if (nleft < 0 || nright < 0 || npro < 0 || ngrips < 0 ||
+		rate <= 0 || duration <= 0 || npairs > nleft || npairs > nright ||
+		nleft + nright + npro + 2 * ngrips > MAX_DEVS ||
+		nleft + nright + npro + ngrips == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Left halves come first, so that pairs step on the same tick */
+	for (i = 0; i < nleft + nright + npro + 2 * ngrips; ++i) {
+		emu_dev *d = &devs[ndevs++];
+
+		d->type = i < nleft ? LEFT_JOYCON :
+			i < nleft + nright ? RIGHT_JOYCON :
+			i < nleft + nright + npro ? PRO_CONTROLLER :
+			(i - nleft - nright - npro) % 2 ? RIGHT_JOYCON : LEFT_JOYCON;
+		snprintf(d->name, sizeof(d->name), "nswitch-load %c%d",
+				 "?LRP"[d->type], i);
+		d->mode = SIMPLE;
+		d->ir = ir && d->type == RIGHT_JOYCON;
+		d->evfd = -1;
+		d->fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+		if (d->fd < 0) {
+			perror("/dev/uhid");
+			return 1;
+		}
+	}
+	for (i = 0; i < npairs; ++i) {
+		devs[i].partner = &devs[nleft + i];
+		devs[nleft + i].partner = &devs[i];
+	}
+	for (i = 0; i < ngrips; ++i) {
+		j = nleft + nright + npro + 2 * i;
+		devs[j].partner = &devs[j + 1];
+		devs[j + 1].partner = &devs[j];
+		devs[j].grip = devs[j + 1].grip = i + 1;
+	}
+	for (i = 0; i < ndevs; ++i)
+		if (uhid_create(&devs[i]))
+			return 1;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (tfd < 0) {
+		perror("timerfd_create");
+		return 1;
+	}
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 1000000000L / rate;
+	its.it_value = its.it_interval;
+	timerfd_settime(tfd, 0, &its, NULL);
+
+	latencies_cap = (size_t)ndevs * rate * duration;
+	latencies = malloc(latencies_cap * sizeof(*latencies));
+	if (!latencies) {
+		perror("malloc");
+		return 1;
+	}
+
+	printf("%d devices (%d left, %d right, %d pro, %d pairs, %d grips) at %d Hz\n",
+		   ndevs, nleft, nright, npro, npairs, ngrips, rate);
+	switch (run(tfd, now_ns() + setup_timeout * 1000000000ULL, 1)) {
+	case 0:
+		break;
+	case 1:
+		fprintf(stderr, "Setup timed out, measuring anyway\n");
+		break;
+	default:
+		return 1;
+	}
+	print_init_times();
+
+	for (i = 0; i < ndevs; ++i)
+		devs[i].reports = devs[i].streamed = devs[i].matched = 0;
+	fflush(stdout);
+	for (i = 0; i < ndevs; ++i) {
+		if (!devs[i].ir)
+			continue;
+		switch (fork()) {
+		case -1:
+			perror("fork");
+			return 1;
+		case 0:
+			ir_capture(&devs[i], duration);
+			break;
+		default:
+			++ir_children;
+		}
+	}
+	nstages = read_stages(before);
+	lock_stat_clear();
+	busy = cpu_busy_ns();
+	user = self_user_ns();
+	start = now_ns();
+	if (run(tfd, start + duration * 1000000000ULL, 0))
+		return 1;
+	elapsed = now_ns() - start;
+	/* The captures stop streaming through the device */
+	if (run(tfd, now_ns() + setup_timeout * 1000000000ULL, 2))
+		return 1;
+	if (ir_children)
+		fprintf(stderr, "%d IR captures did not stop\n", ir_children);
+	busy = cpu_busy_ns() - busy;
+	user = self_user_ns() - user;
+	read_stages(after);
+
+	reports = streamed = matched = 0;
+	for (i = 0; i < ndevs; ++i) {
+		reports += devs[i].reports;
+		streamed += devs[i].streamed;
+		matched += devs[i].matched;
+	}
+	qsort(latencies, nlatencies, sizeof(*latencies), cmp_u64);
+
+	printf("%lu reports in %llu ms, %llu reports/s\n", reports,
+		   (unsigned long long)(elapsed / 1000000),
+		   (unsigned long long)(elapsed ? reports * 1000000000ULL / elapsed : 0));
+	printf("cpu: %llu ns/report, %llu ns/report without the generator\n",
+		   (unsigned long long)(reports ? busy / reports : 0),
+		   (unsigned long long)(reports && busy > user ? (busy - user) / reports : 0));
+	printf("events: %lu of %lu standard reports seen on evdev\n",
+		   matched, streamed);
+	printf("latency: p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n",
+		   (unsigned long long)percentile(50) / 1000,
+		   (unsigned long long)percentile(90) / 1000,
+		   (unsigned long long)percentile(99) / 1000,
+		   (unsigned long long)(nlatencies ? latencies[nlatencies - 1] / 1000 : 0));
+
+	for (i = 0; i < MAX_STAGES && after[i].name[0]; ++i) {
+		for (j = 0; j < nstages && strcmp(before[j].name, after[i].name); ++j)
+			;
+		if (j < nstages) {
+			after[i].count -= before[j].count;
+			after[i].total_ns -= before[j].total_ns;
+		}
+		printf("driver %s: %llu reports, %llu ns/report, %llu ns max\n",
+			   after[i].name, (unsigned long long)after[i].count,
+			   (unsigned long long)(after[i].count ?
+									after[i].total_ns / after[i].count : 0),
+			   (unsigned long long)after[i].max_ns);
+	}
+	print_tx_queues();
+	lock_stat_print();
+
+	for (i = 0; i < ndevs; ++i) {
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_DESTROY;
+		uhid_send(&devs[i], &ev);
+		if (devs[i].evfd >= 0)
+			close(devs[i].evfd);
+		close(devs[i].fd);
+	}
+	free(latencies);
+	return ir_failed || ir_children;
+}
@@ -0,0 +1,247 @@
+/*
+ * Replay of hid-nswitch traces through uhid
+ * Copyright (c) 2018 Nabil Boutemeur <nabil.boutemeur@gmail.com>
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+  Recreates the traced peripheral with /dev/uhid and feeds it the
+  recorded input reports, with their original timing or as fast as
+  possible (-f).
+  On the first loop, input reports recorded after an output command
+  are only sent once the driver has sent the matching output, so that
+  replies never arrive before the command they answer.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+
+#include "../nswitch-uapi.h"
+
+#define SYNC_TIMEOUT_MS 1000
+
+typedef struct {
+	int fd;
+	int opened;
+	unsigned long outputs;
+} replay_dev;
+
+static __u64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(__u64 t) {
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000ULL;
+	ts.tv_nsec = t % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static int uhid_send(replay_dev *d, struct uhid_event *ev) {
+	if (write(d->fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+		perror("uhid write");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+  Handle uhid events for at most timeout ms
+ */
+static int uhid_poll(replay_dev *d, int timeout) {
+	struct pollfd pfd = { d->fd, POLLIN, 0 };
+	struct uhid_event ev;
+	struct uhid_event reply;
+
+	if (poll(&pfd, 1, timeout) <= 0)
+		return 0;
+	if (read(d->fd, &ev, sizeof(ev)) <= 0)
+		return -1;
+
+	switch (ev.type) {
+	case UHID_OPEN:
+		d->opened = 1;
+		break;
+	case UHID_CLOSE:
+		d->opened = 0;
+		break;
+	case UHID_OUTPUT:
+		++d->outputs;
+		break;
+	case UHID_GET_REPORT:
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_GET_REPORT_REPLY;
+		reply.u.get_report_reply.id = ev.u.get_report.id;
+		reply.u.get_report_reply.err = EIO;
+		uhid_send(d, &reply);
+		break;
+	case UHID_SET_REPORT:
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_SET_REPORT_REPLY;
+		reply.u.set_report_reply.id = ev.u.set_report.id;
+		reply.u.set_report_reply.err = EIO;
+		uhid_send(d, &reply);
+		break;
+	default:
+		break;
+	}
+	return 1;
+}
+
+static int uhid_create(replay_dev *d, nswitch_trace_header *hdr) {
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char*)ev.u.create2.name, sizeof(ev.u.create2.name), "%s", hdr->name);
+	snprintf((char*)ev.u.create2.phys, sizeof(ev.u.create2.phys), "%s", hdr->phys);
+	snprintf((char*)ev.u.create2.uniq, sizeof(ev.u.create2.uniq), "%s", hdr->uniq);
+	ev.u.create2.rd_size = hdr->rdesc_size;
+	ev.u.create2.bus = hdr->bus;
+	ev.u.create2.vendor = hdr->vendor;
+	ev.u.create2.product = hdr->product;
+	ev.u.create2.version = hdr->dev_version;
+	ev.u.create2.country = hdr->country;
+	memcpy(ev.u.create2.rd_data, hdr->rdesc, hdr->rdesc_size);
+	return uhid_send(d, &ev);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-f] [-n loops] trace\n"
+			"\t-f\treplay as fast as possible\n"
+			"\t-n\treplay the trace n times\n", name);
+}
+
+int main(int argc, char **argv) {
+	nswitch_trace_header hdr;
+	nswitch_trace_record rec;
+	struct uhid_event ev;
+	replay_dev d = { -1, 0, 0 };
+	unsigned long expected_outputs, reports, total;
+	__u64 first_ts, start, bench_start, elapsed;
+	int fast = 0, loops = 1, loop, waited, c;
+	FILE *trace;
+
+	while ((c = getopt(argc, argv, "fn:")) != -1) {
+		switch (c) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	trace = fopen(argv[optind], "rb");
+	if (!trace) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, trace) != 1 ||
+		memcmp(hdr.magic, NSWITCH_TRACE_MAGIC, sizeof(hdr.magic)) ||
+		hdr.version != NSWITCH_TRACE_VERSION ||
+		hdr.rdesc_size > sizeof(hdr.rdesc)) {
+		fprintf(stderr, "%s: not a nswitch trace\n", argv[optind]);
+		return 1;
+	}
+
+	d.fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (d.fd < 0) {
+		perror("/dev/uhid");
+		return 1;
+	}
+	if (uhid_create(&d, &hdr))
+		return 1;
+	while (!d.opened)
+		if (uhid_poll(&d, -1) < 0)
+			return 1;
+
+	total = 0;
+	bench_start = now_ns();
+	for (loop = 0; loop < loops; ++loop) {
+		fseek(trace, sizeof(hdr), SEEK_SET);
+		first_ts = 0;
+		reports = 0;
+		expected_outputs = d.outputs;
+		start = now_ns();
+		while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+			memset(&ev, 0, sizeof(ev));
+			if (rec.size > sizeof(ev.u.input2.data) ||
+				fread(ev.u.input2.data, rec.size, 1, trace) != 1) {
+				fprintf(stderr, "Truncated trace\n");
+				break;
+			}
+			if (rec.direction == NSWITCH_TRACE_OUT) {
+				/* The driver is already set up after the first loop */
+				if (!loop)
+					++expected_outputs;
+				continue;
+			}
+
+			if (!first_ts)
+				first_ts = rec.timestamp;
+			if (!fast)
+				sleep_until(start + (rec.timestamp - first_ts));
+			for (waited = 0; d.outputs < expected_outputs; waited += 10) {
+				if (waited >= SYNC_TIMEOUT_MS) {
+					fprintf(stderr, "Driver diverged from trace, resyncing\n");
+					d.outputs = expected_outputs;
+					break;
+				}
+				if (uhid_poll(&d, 10) < 0)
+					return 1;
+			}
+			while (uhid_poll(&d, 0) > 0)
+				;
+
+			ev.type = UHID_INPUT2;
+			ev.u.input2.size = rec.size;
+			if (uhid_send(&d, &ev))
+				return 1;
+			++reports;
+		}
+		total += reports;
+	}
+	elapsed = now_ns() - bench_start;
+
+	printf("%lu reports", total);
+	if (fast && elapsed)
+		printf(" in %llu us, %llu reports/s",
+			   (unsigned long long)(elapsed / 1000),
+			   (unsigned long long)(total * 1000000000ULL / elapsed));
+	printf("\n");
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_send(&d, &ev);
+	close(d.fd);
+	fclose(trace);
+	return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * Latency and throughput of the hid-nswitch state page against evdev
+ * Copyright (c) 2018 Nabil Boutemeur <nabil.boutemeur@gmail.com>
+ */
+
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ */
+
+/*
+  Reads the same device through the state page mmap'd from
+  /dev/nswitchN and through the evdev node of its personality, at the
+  same time, each from its own thread:
+  - the page reader polls the page, every -p us or spinning, and takes
+    a consistent copy with the sequence counter;
+  - the evdev reader blocks in read().
+  For both, the latency of an update is the time from the sample time
+  of the report, reconstructed by the driver, to the moment the reader
+  sees it. Then measures the cost of a page copy and of a read() call,
+  without waiting for the device.
+  Run it while the device streams, on a real one or under
+  tools/nswitch-load:
+
+	nswitch-state -d 10 /dev/nswitch0 /dev/input/event5
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../nswitch-uapi.h"
+
+#define MAX_SAMPLES (1 << 20)
+#define COST_LOOPS 100000
+
+typedef struct {
+	const char *name;
+	__u64 *latencies;
+	size_t nlatencies;
+	unsigned long updates; /* Seen by the reader */
+	unsigned long missed; /* Overwritten before the reader saw them */
+	unsigned long calls; /* Page copies or read() calls */
+} reader_stats;
+
+static const volatile nswitch_state_page *page;
+static int evfd;
+static __u64 deadline;
+static unsigned int page_period_us;
+
+static __u64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(reader_stats *st, __u64 sample_time, __u64 seen) {
+	if (!sample_time || seen < sample_time || st->nlatencies == MAX_SAMPLES)
+		return;
+	st->latencies[st->nlatencies++] = seen - sample_time;
+}
+
+/*
+  Consistent copy of the page, see NSWITCH_MMAP_STATE
+ */
+static void page_copy(nswitch_state_page *copy) {
+	__u32 seq;
+
+	do {
+		seq = page->seq;
+		__sync_synchronize();
+		memcpy(copy, (const void*)page, sizeof(*copy));
+		__sync_synchronize();
+	} while ((seq & 1) || seq != page->seq);
+}
+
+static void *page_reader(void *data) {
+	reader_stats *st = data;
+	nswitch_state_page copy;
+	struct timespec period;
+	__u64 last;
+
+	period.tv_sec = 0;
+	period.tv_nsec = page_period_us * 1000L;
+	page_copy(&copy);
+	last = copy.updates;
+	while (now_ns() < deadline) {
+		if (page_period_us)
+			nanosleep(&period, NULL);
+		page_copy(&copy);
+		++st->calls;
+		if (copy.updates == last)
+			continue;
+		++st->updates;
+		st->missed += copy.updates - last - 1;
+		last = copy.updates;
+		record(st, copy.sample_time, now_ns());
+	}
+	return NULL;
+}
+
+static void *evdev_reader(void *data) {
+	reader_stats *st = data;
+	struct input_event ev[64];
+	__u64 seen;
+	ssize_t n;
+	int i;
+
+	while (now_ns() < deadline) {
+		n = read(evfd, ev, sizeof(ev));
+		++st->calls;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("evdev read");
+			break;
+		}
+		seen = now_ns();
+		for (i = 0; i < n / (ssize_t)sizeof(*ev); ++i) {
+			if (ev[i].type != EV_SYN || ev[i].code != SYN_REPORT)
+				continue;
+			++st->updates;
+			record(st, ev[i].input_event_sec * 1000000000ULL +
+				   ev[i].input_event_usec * 1000ULL, seen);
+		}
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	__u64 x = *(const __u64*)a, y = *(const __u64*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static __u64 percentile(const reader_stats *st, int p) {
+	return st->nlatencies ? st->latencies[(st->nlatencies - 1) * p / 100] : 0;
+}
+
+static void print_stats(reader_stats *st, __u64 elapsed) {
+	qsort(st->latencies, st->nlatencies, sizeof(*st->latencies), cmp_u64);
+	printf("%s: %lu updates/s, %lu missed, %lu calls/s\n", st->name,
+		   (unsigned long)(st->updates * 1000000000ULL / elapsed), st->missed,
+		   (unsigned long)(st->calls * 1000000000ULL / elapsed));
+	printf("%s latency: p50 %llu us, p90 %llu us, p99 %llu us, max %llu us\n",
+		   st->name,
+		   (unsigned long long)percentile(st, 50) / 1000,
+		   (unsigned long long)percentile(st, 90) / 1000,
+		   (unsigned long long)percentile(st, 99) / 1000,
+		   (unsigned long long)(st->nlatencies ?
+								st->latencies[st->nlatencies - 1] / 1000 : 0));
+}
+
+/*
+  Cost of getting the state without waiting for it
+ */
+static void print_costs(void) {
+	nswitch_state_page copy;
+	struct input_event ev[64];
+	volatile __u32 sink = 0;
+	__u64 start, page_ns, read_ns;
+	int i, flags;
+
+	start = now_ns();
+	for (i = 0; i < COST_LOOPS; ++i) {
+		page_copy(&copy);
+		sink += copy.buttons;
+	}
+	page_ns = now_ns() - start;
+
+	flags = fcntl(evfd, F_GETFL);
+	fcntl(evfd, F_SETFL, flags | O_NONBLOCK);
+	start = now_ns();
+	for (i = 0; i < COST_LOOPS; ++i)
+		if (read(evfd, ev, sizeof(ev)) > 0)
+			sink += ev[0].value;
+	read_ns = now_ns() - start;
+	fcntl(evfd, F_SETFL, flags);
+
+	printf("cost: %llu ns per page copy, %llu ns per evdev read()\n",
+		   (unsigned long long)(page_ns / COST_LOOPS),
+		   (unsigned long long)(read_ns / COST_LOOPS));
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-d s] [-p us] /dev/nswitchN /dev/input/eventN\n"
+			"\t-d\tmeasurement duration, in seconds (10)\n"
+			"\t-p\tpage polling period, in us, 0 to spin (0)\n", name);
+}
+
+int main(int argc, char **argv) {
+	reader_stats pst, est;
+	pthread_t pth, eth;
+	clockid_t clk = CLOCK_MONOTONIC;
+	int duration = 10, fd, c;
+	__u64 start, elapsed;
+	void *map;
+
+	while ((c = getopt(argc, argv, "d:p:")) != -1) {
+		switch (c) {
+		case 'd': duration = atoi(optarg); break;
+		case 'p': page_period_us = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 2 || duration <= 0 || page_period_us >= 1000000) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	map = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd,
+			   NSWITCH_MMAP_STATE);
+	if (map == MAP_FAILED) {
+		perror("state page");
+		return 1;
+	}
+	page = map;
+	evfd = open(argv[optind + 1], O_RDONLY | O_CLOEXEC);
+	if (evfd < 0) {
+		perror(argv[optind + 1]);
+		return 1;
+	}
+	/* Sample times are CLOCK_MONOTONIC */
+	ioctl(evfd, EVIOCSCLOCKID, &clk);
+
+	memset(&pst, 0, sizeof(pst));
+	memset(&est, 0, sizeof(est));
+	pst.name = "page";
+	est.name = "evdev";
+	pst.latencies = malloc(MAX_SAMPLES * sizeof(*pst.latencies));
+	est.latencies = malloc(MAX_SAMPLES * sizeof(*est.latencies));
+	if (!pst.latencies || !est.latencies) {
+		perror("malloc");
+		return 1;
+	}
+
+	start = now_ns();
+	deadline = start + duration * 1000000000ULL;
+	if (pthread_create(&pth, NULL, page_reader, &pst) ||
+		pthread_create(&eth, NULL, evdev_reader, &est)) {
+		perror("pthread_create");
+		return 1;
+	}
+	pthread_join(pth, NULL);
+	/* The evdev reader may block until the next report */
+	pthread_join(eth, NULL);
+	elapsed = now_ns() - start;
+
+	print_stats(&pst, elapsed);
+	print_stats(&est, elapsed);
+	print_costs();
+
+	free(pst.latencies);
+	free(est.latencies);
+	munmap(map, sysconf(_SC_PAGESIZE));
+	close(evfd);
+	close(fd);
+	return 0;
+}